@@ -5,21 +5,43 @@ layout(location = 2) in lowp    vec4  aTangent;
 layout(location = 3) in mediump vec2  aTexCoords;
 layout(location = 4) in lowp    uvec4 aJoints; // lowp int ranges between 0-255 
 layout(location = 5) in lowp    vec4  aWeights;
+layout(location = 6) in highp   uint  aDrawID;  // baseInstance of the indirect draw command, see: rMeshEnableDrawID
 
 out mediump vec2 vTexCoords;
-out highp   vec4 vLightSpaceFrag;
+out highp   vec3 vShadowPos; // world position with normal bias, cascade is selected in fragment shader
 out lowp    mat3 vTBN;
 // out flat    lowp int  vBoneIdx;
 
 uniform highp mat4 uModel;
-uniform highp mat4 uLightMatrix;
 uniform highp mat4 uViewProj;
 
 uniform highp sampler2D uAnimTex;
+uniform int uAnimRow; // each animated character has its own row in uAnimTex
+// used when uHasAnimation is 2, uAnimTex is baked animation texture, frames are wrapped into columns of MaxBakedRows.
+// each instance is 4 texels in a row of uInstanceTex: 3x4 transform, x = first frame of the clip, y = number of frames, z = current frame
+// when uHasAnimation is 3 mesh is static and instanced, instance rows of uInstanceTex are 3x4 transforms starting from uInstanceOffset
+uniform highp sampler2D uInstanceTex;
+uniform int uInstanceOffset;
+uniform int uBakedColumnWidth; // number of joints * 3
 uniform mediump vec3 uSunDir;
 
 uniform int uHasNormalMap;
 uniform int uHasAnimation;
+uniform int uIndirect; // 1 when drawing with multi draw indirect, model matrix is in uDrawData
+
+#ifndef ANDROID
+// per draw data of multi draw indirect, same layout with SceneRenderer's IndirectDrawData
+struct DrawData
+{
+    highp mat4 model;
+    ivec4 info; // x = material index
+};
+
+layout(std430, binding = 2) readonly buffer DrawDataBuffer
+{
+    DrawData uDrawData[];
+};
+#endif
 
 // https://www.shadertoy.com/view/3s33zj
 mat3 adjoint(in mat4 m)
@@ -29,27 +51,64 @@ mat3 adjoint(in mat4 m)
                 cross(m[0].xyz, m[1].xyz));
 }
 
+// weighted sum of the joint matrices in given row of the uAnimTex, column is the x offset of the palette
+mediump mat4 GetAnimMatrix(int column, int row)
+{
+    mediump mat4 animMat = mat4(0.0);
+    animMat[3].w = 1.0; // last row is [0.0, 0.0, 0.0, 1.0]
+
+    for (int i = 0; i < 4; i++)
+    {
+        int matIdx = column + int(aJoints[i]) * 3; // 3 because our matrix is: RGBA16f x 3
+        animMat[0] += texelFetch(uAnimTex, ivec2(matIdx + 0, row), 0) * aWeights[i];
+        animMat[1] += texelFetch(uAnimTex, ivec2(matIdx + 1, row), 0) * aWeights[i];
+        animMat[2] += texelFetch(uAnimTex, ivec2(matIdx + 2, row), 0) * aWeights[i]; 
+    }
+    return animMat;
+}
+
+const int MaxBakedRows = 2048; // same as Animation.hpp
+
+mediump mat4 GetBakedAnimMatrix(int frame)
+{
+    return GetAnimMatrix((frame / MaxBakedRows) * uBakedColumnWidth, frame % MaxBakedRows);
+}
+
 // https://developer.android.com/games/optimize/vertex-data-management
 void main()
 {
     highp mat4 model = uModel;
+#ifndef ANDROID
+    if (uIndirect == 1) model = uDrawData[aDrawID].model;
+#endif
 
     // vBoneIdx = -1;
-    if (uHasAnimation > 0) 
+    if (uHasAnimation == 1) 
     {
-        mediump mat4 animMat = mat4(0.0);
-        animMat[3].w = 1.0; // last row is [0.0, 0.0, 0.0, 1.0]
-
-        for (int i = 0; i < 4; i++)
-        {
-            int matIdx = int(aJoints[i]) * 3; // 3 because our matrix is: RGBA16f x 3
-            animMat[0] += texelFetch(uAnimTex, ivec2(matIdx + 0, 0), 0) * aWeights[i];
-            animMat[1] += texelFetch(uAnimTex, ivec2(matIdx + 1, 0), 0) * aWeights[i];
-            animMat[2] += texelFetch(uAnimTex, ivec2(matIdx + 2, 0), 0) * aWeights[i]; 
-        }
+        mediump mat4 animMat = GetAnimMatrix(0, uAnimRow);
         // vBoneIdx = int(aJoints[0]);
         model = model * transpose(animMat);
     }
+    else if (uHasAnimation == 2)
+    {
+        // baked animation, instanced. interpolate two frames of the looping clip
+        highp vec4 anim = texelFetch(uInstanceTex, ivec2(3, gl_InstanceID), 0);
+        highp mat4 instance = mat4(texelFetch(uInstanceTex, ivec2(0, gl_InstanceID), 0),
+                                   texelFetch(uInstanceTex, ivec2(1, gl_InstanceID), 0),
+                                   texelFetch(uInstanceTex, ivec2(2, gl_InstanceID), 0), vec4(0.0, 0.0, 0.0, 1.0));
+        highp float frame = mod(anim.z, anim.y);
+        int frame0 = int(anim.x + floor(frame));
+        int frame1 = int(anim.x + mod(floor(frame) + 1.0, anim.y));
+        mediump mat4 animMat = mix(GetBakedAnimMatrix(frame0), GetBakedAnimMatrix(frame1), fract(frame));
+        model = transpose(instance) * model * transpose(animMat);
+    }
+    else if (uHasAnimation == 3)
+    {
+        int row = uInstanceOffset + gl_InstanceID;
+        model = transpose(mat4(texelFetch(uInstanceTex, ivec2(0, row), 0),
+                               texelFetch(uInstanceTex, ivec2(1, row), 0),
+                               texelFetch(uInstanceTex, ivec2(2, row), 0), vec4(0.0, 0.0, 0.0, 1.0)));
+    }
 
     mediump mat3 normalMatrix = adjoint(model);
     vTBN[0] = normalize(normalMatrix * aTangent.xyz); 
@@ -61,8 +120,7 @@ void main()
     float scale = 1.0 / length(model[0].xyz);
     vec3 normalBias = aNormal * scale * 0.08;
 
-    vLightSpaceFrag = uLightMatrix * (model * vec4(aPos + normalBias, 1.0));
-    vLightSpaceFrag.xyz = vLightSpaceFrag.xyz * 0.5 + 0.5; // [-1,1] to [0, 1]
+    vShadowPos = (model * vec4(aPos + normalBias, 1.0)).xyz;
 
     vTexCoords  = aTexCoords; 
     gl_Position = uViewProj * outPos;
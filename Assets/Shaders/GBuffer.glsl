@@ -8,7 +8,7 @@ layout(location = 1) out lowp vec4 oNormalMetallic;  // TextureType_RGBA8
 layout(location = 2) out lowp float oRoughness; // TextureType_R8
 
 in mediump vec2 vTexCoords;
-in highp   vec4 vLightSpaceFrag;
+in highp   vec3 vShadowPos;
 in lowp    mat3 vTBN;
 // in flat lowp int  vBoneIdx;
 
@@ -16,31 +16,65 @@ uniform lowp sampler2D uAlbedo;
 uniform lowp sampler2D uNormalMap;
 
 uniform lowp sampler2D  uMetallicRoughnessMap;
-uniform sampler2DShadow uShadowMap; 
+uniform sampler2DShadow uShadowMap; // 2x2 atlas of cascades
+
+// world to atlas uv and depth of each cascade, see: SceneRenderer::FitCascade
+uniform highp mat4 uShadowMatrices[4];
+uniform highp vec4 uCascadeSplits; // far distance of each cascade in view space
+uniform highp vec3 uCameraPos;
+uniform mediump vec3 uCameraForward;
 
 uniform int uHasNormalMap;
 
-float ShadowLookup(vec4 loc, vec2 offset)
+// small textures are packed into atlases. xy = scale, zw = offset
+// highp because mediump has half texel error in 1024 atlas
+uniform highp vec4 uAlbedoRect;
+uniform highp vec4 uNormalRect;
+uniform highp vec4 uMetallicRect;
+
+highp vec2 AtlasUV(highp vec4 rect)
+{
+    // fract emulates repeat wrap mode inside of the atlas, atlases don't have mips so it is safe
+    return rect.x < 1.0 ? fract(vTexCoords) * rect.xy + rect.zw : vTexCoords;
+}
+
+// quad is the min and max uv of the cascade in the atlas, taps are clamped to it
+// otherwise edges of the cascade would sample depth of the neighbour cascade
+float ShadowLookup(vec4 loc, vec2 offset, highp vec4 quad)
 {
     vec2 texmapscale = 1.0 / vec2(textureSize(uShadowMap, 0));
     texmapscale *= 1.35; // increase spread area, to make shadow softer 
-    return textureProj(uShadowMap, vec4(loc.xy + offset * texmapscale * loc.w, loc.z, loc.w));
+    highp vec2 uv = clamp(loc.xy + offset * texmapscale * loc.w, quad.xy * loc.w, quad.zw * loc.w);
+    return textureProj(uShadowMap, vec4(uv, loc.z, loc.w));
 }
 
 // https://developer.nvidia.com/gpugems/gpugems/part-ii-lighting-and-shadows/chapter-11-shadow-map-antialiasing
 float ShadowCalculation()
 {
     const vec4 minShadow = vec4(0.15);
+    
+    // select the cascade with view space depth
+    highp float depth = dot(vShadowPos - uCameraPos, uCameraForward);
+    int cascade = int(dot(vec4(greaterThan(vec4(depth), uCascadeSplits)), vec4(1.0)));
+    if (cascade > 3) return 1.0; // further than shadow distance
+
+    highp vec4 vLightSpaceFrag = uShadowMatrices[cascade] * vec4(vShadowPos, 1.0);
+
+    // quarter of the atlas that cascade uses, shrunk by half texel because of the linear filtering
+    highp vec2 halfTexel = 0.5 / vec2(textureSize(uShadowMap, 0));
+    highp vec2 quadMin = vec2(float(cascade & 1), float(cascade >> 1)) * 0.5;
+    highp vec4 quad = vec4(quadMin + halfTexel, quadMin + 0.5 - halfTexel);
+
     #ifdef ANDROID
     vec2 offset;
     const vec2 mixer = vec2(1.037, 1.137);
     offset.x = fract(dot(vTexCoords.xy, mixer)) * 0.5;
     offset.y = fract(dot(vTexCoords.yx, mixer)) * 0.5;
     
-    vec4 shadow = vec4(ShadowLookup(vLightSpaceFrag, offset + vec2(-0.50,  0.25)),
-                       ShadowLookup(vLightSpaceFrag, offset + vec2( 0.25,  0.25)),
-                       ShadowLookup(vLightSpaceFrag, offset + vec2(-0.50, -0.50)),
-                       ShadowLookup(vLightSpaceFrag, offset + vec2( 0.25, -0.50)));
+    vec4 shadow = vec4(ShadowLookup(vLightSpaceFrag, offset + vec2(-0.50,  0.25), quad),
+                       ShadowLookup(vLightSpaceFrag, offset + vec2( 0.25,  0.25), quad),
+                       ShadowLookup(vLightSpaceFrag, offset + vec2(-0.50, -0.50), quad),
+                       ShadowLookup(vLightSpaceFrag, offset + vec2( 0.25, -0.50), quad));
     
     return dot(max(shadow, minShadow), vec4(1.0)) * 0.25;  // max is used with 4 elements maybe it helps to make this simd
     #else
@@ -48,10 +82,10 @@ float ShadowCalculation()
     float y = -1.5;
     for (int i = 0; i < 4; i++, y += 1.0)
     {
-        vec4 shadow = vec4(ShadowLookup(vLightSpaceFrag, vec2(-1.5, y)),
-                           ShadowLookup(vLightSpaceFrag, vec2(-0.5, y)),
-                           ShadowLookup(vLightSpaceFrag, vec2(+0.5, y)),
-                           ShadowLookup(vLightSpaceFrag, vec2(+1.5, y)));
+        vec4 shadow = vec4(ShadowLookup(vLightSpaceFrag, vec2(-1.5, y), quad),
+                           ShadowLookup(vLightSpaceFrag, vec2(-0.5, y), quad),
+                           ShadowLookup(vLightSpaceFrag, vec2(+0.5, y), quad),
+                           ShadowLookup(vLightSpaceFrag, vec2(+1.5, y), quad));
     
         // horizontal sum. max is used with 4 elements maybe it helps to make this simd
         result[i] = dot(max(shadow, minShadow), vec4(1.0));
@@ -62,7 +96,7 @@ float ShadowCalculation()
 
 void main()
 {
-    lowp vec4 color = texture(uAlbedo, vTexCoords);
+    lowp vec4 color = texture(uAlbedo, AtlasUV(uAlbedoRect));
 
     #if ALPHA_CUTOFF == 1
     if (color.a < 0.8 && dot(color.rgb, color.rgb) < 0.1)
@@ -75,7 +109,7 @@ void main()
     if (uHasNormalMap == 1)
     {
         // obtain normal from normal map in range [0,1]
-        lowp vec2  c = texture(uNormalMap, vTexCoords).rg * 2.0 - 1.0;
+        lowp vec2  c = texture(uNormalMap, AtlasUV(uNormalRect)).rg * 2.0 - 1.0;
         lowp float z = sqrt(1.0 - c.x * c.x - c.y * c.y);
         normal  = normalize(vec3(c, z));
         // transform normal vector to range [-1,1]
@@ -83,7 +117,7 @@ void main()
     }
     #endif
 
-    lowp vec2 metallicRoughness = texture(uMetallicRoughnessMap, vTexCoords).rg;
+    lowp vec2 metallicRoughness = texture(uMetallicRoughnessMap, AtlasUV(uMetallicRect)).rg;
     color.a = ShadowCalculation();
     oRoughness = metallicRoughness.y;
     oFragColorShadow = color;
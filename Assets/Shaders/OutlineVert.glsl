@@ -10,6 +10,7 @@ uniform highp mat4 uModel;
 uniform highp mat4 uViewProj;
 
 uniform highp sampler2D uAnimTex;
+uniform int uAnimRow; // each animated character has its own row in uAnimTex
 
 uniform int uHasAnimation;
 
@@ -27,9 +28,9 @@ void main()
         for (int i = 0; i < 4; i++)
         {
             int matIdx = int(aJoints[i]) * 3; // 3 because our matrix is: RGBA16f x 3
-            animMat[0] += texelFetch(uAnimTex, ivec2(matIdx + 0, 0), 0) * aWeights[i];
-            animMat[1] += texelFetch(uAnimTex, ivec2(matIdx + 1, 0), 0) * aWeights[i];
-            animMat[2] += texelFetch(uAnimTex, ivec2(matIdx + 2, 0), 0) * aWeights[i]; 
+            animMat[0] += texelFetch(uAnimTex, ivec2(matIdx + 0, uAnimRow), 0) * aWeights[i];
+            animMat[1] += texelFetch(uAnimTex, ivec2(matIdx + 1, uAnimRow), 0) * aWeights[i];
+            animMat[2] += texelFetch(uAnimTex, ivec2(matIdx + 2, uAnimRow), 0) * aWeights[i]; 
         }
         // vBoneIdx = int(aJoints[0]);
         model = model * transpose(animMat);
@@ -11,24 +11,59 @@ uniform mat4 model;
 uniform mat4 lightMatrix;
 uniform int uHasAnimation;
 uniform mediump sampler2D uAnimTex;
+uniform int uAnimRow; // each animated character has its own row in uAnimTex
+// baked animation when uHasAnimation is 2, same as 3DVert.glsl
+uniform highp sampler2D uInstanceTex;
+uniform int uBakedColumnWidth;
+uniform int uInstanceOffset; // static mesh instances when uHasAnimation is 3, same as 3DVert.glsl
+
+mediump mat4 GetAnimMatrix(int column, int row)
+{
+    mediump mat4 animMat = mat4(0.0);
+    animMat[3].w = 1.0;
+
+    for (int i = 0; i < 4; i++)
+    {
+        int matIdx = column + int(aJoints[i]) * 3; // 3 because our matrix is: RGBA16f x 3
+        animMat[0] += texelFetch(uAnimTex, ivec2(matIdx + 0, row), 0) * aWeights[i];
+        animMat[1] += texelFetch(uAnimTex, ivec2(matIdx + 1, row), 0) * aWeights[i];
+        animMat[2] += texelFetch(uAnimTex, ivec2(matIdx + 2, row), 0) * aWeights[i]; 
+    }
+    return animMat;
+}
+
+const int MaxBakedRows = 2048; // same as Animation.hpp
+
+mediump mat4 GetBakedAnimMatrix(int frame)
+{
+    return GetAnimMatrix((frame / MaxBakedRows) * uBakedColumnWidth, frame % MaxBakedRows);
+}
 
 void main() 
 {
     mat4 vmodel = model;
-    if (uHasAnimation > 0)
+    if (uHasAnimation == 1)
     {
-        mediump mat4 animMat = mat4(0.0);
-        animMat[3].w = 1.0;
-
-        for (int i = 0; i < 4; i++)
-        {
-            int matIdx = int(aJoints[i]) * 3; // 3 because our matrix is: RGBA16f x 3
-            animMat[0] += texelFetch(uAnimTex, ivec2(matIdx + 0, 0), 0) * aWeights[i];
-            animMat[1] += texelFetch(uAnimTex, ivec2(matIdx + 1, 0), 0) * aWeights[i];
-            animMat[2] += texelFetch(uAnimTex, ivec2(matIdx + 2, 0), 0) * aWeights[i]; 
-        }
-        
-        vmodel = vmodel * transpose(animMat);
+        vmodel = vmodel * transpose(GetAnimMatrix(0, uAnimRow));
+    }
+    else if (uHasAnimation == 2)
+    {
+        highp vec4 anim = texelFetch(uInstanceTex, ivec2(3, gl_InstanceID), 0);
+        highp mat4 instance = mat4(texelFetch(uInstanceTex, ivec2(0, gl_InstanceID), 0),
+                                   texelFetch(uInstanceTex, ivec2(1, gl_InstanceID), 0),
+                                   texelFetch(uInstanceTex, ivec2(2, gl_InstanceID), 0), vec4(0.0, 0.0, 0.0, 1.0));
+        highp float frame = mod(anim.z, anim.y);
+        int frame0 = int(anim.x + floor(frame));
+        int frame1 = int(anim.x + mod(floor(frame) + 1.0, anim.y));
+        mediump mat4 animMat = mix(GetBakedAnimMatrix(frame0), GetBakedAnimMatrix(frame1), fract(frame));
+        vmodel = transpose(instance) * vmodel * transpose(animMat);
+    }
+    else if (uHasAnimation == 3)
+    {
+        int row = uInstanceOffset + gl_InstanceID;
+        vmodel = transpose(mat4(texelFetch(uInstanceTex, ivec2(0, row), 0),
+                                texelFetch(uInstanceTex, ivec2(1, row), 0),
+                                texelFetch(uInstanceTex, ivec2(2, row), 0), vec4(0.0, 0.0, 0.0, 1.0)));
     }
     gl_Position = lightMatrix * (vmodel * vec4(aPos, 1.0));
 }
\ No newline at end of file
@@ -16,158 +16,632 @@
 #include "include/Scene.hpp"
 #include "include/SceneRenderer.hpp"
 #include "include/Platform.hpp"
+#include "include/JobSystem.hpp"
 
 #include "../ASTL/Math/Half.hpp"
 
+#include <math.h> // sqrtf
+
+#include <mutex>
+
+/*//////////////////////////////////////////////////////////////////////////*/
+/*                              Bone Palettes                               */
+/*//////////////////////////////////////////////////////////////////////////*/
+
+// all of the animated characters are writing their matrices to this buffer, each one uses one row.
+// this way we upload the matrices of all characters with one texture update
+static Texture       g_BonePaletteTex;
+static Matrix3x4f16* g_BonePalettes; // [MaxAnimatedInstances][MaxBonePoses]
+static bool          g_PaletteRowUsed[MaxAnimatedInstances];
+static bool          g_PaletteRowDirty[MaxAnimatedInstances];
+static int           g_NumPaletteRows;
+
+static int AllocatePaletteRow()
+{
+    if (g_NumPaletteRows == 0)
+    {
+        g_BonePaletteTex = rCreateTexture(MaxBonePoses * 3, MaxAnimatedInstances, nullptr, TextureType_RGBA16F, TexFlags_RawData);
+        g_BonePalettes = new Matrix3x4f16[MaxAnimatedInstances * MaxBonePoses]{};
+    }
+
+    for (int i = 0; i < MaxAnimatedInstances; i++)
+    {
+        if (g_PaletteRowUsed[i]) continue;
+        g_PaletteRowUsed[i] = true;
+        g_NumPaletteRows++;
+        return i;
+    }
+    AX_WARN("number of animated characters is greater than MaxAnimatedInstances");
+    return -1;
+}
+
+static void FreePaletteRow(int row)
+{
+    if (row < 0 || !g_PaletteRowUsed[row]) return;
+    g_PaletteRowUsed[row] = false;
+    g_PaletteRowDirty[row] = false;
+
+    if (--g_NumPaletteRows == 0)
+    {
+        rDeleteTexture(g_BonePaletteTex);
+        delete[] g_BonePalettes;
+        g_BonePaletteTex = {};
+        g_BonePalettes = nullptr;
+    }
+}
+
+Texture GetBonePaletteTexture()
+{
+    return g_BonePaletteTex;
+}
+
+void UploadBonePalettes()
+{
+    int minRow = MaxAnimatedInstances, maxRow = -1;
+    for (int i = 0; i < MaxAnimatedInstances; i++)
+    {
+        if (!g_PaletteRowDirty[i]) continue;
+        g_PaletteRowDirty[i] = false;
+        minRow = MIN(minRow, i);
+        maxRow = MAX(maxRow, i);
+    }
+
+    if (maxRow == -1)
+        return;
+
+    // rows in between are uploaded as well, it is cheaper than issuing many uploads
+    int numRows = maxRow - minRow + 1;
+    rUpdateTextureRegion(g_BonePaletteTex, 0, minRow, MaxBonePoses * 3, numRows, g_BonePalettes + (minRow * MaxBonePoses));
+}
+
 void StartAnimationSystem()
 { }
 
-static void SetBoneNode(Prefab* prefab, ANode*& node, int& index, const char* name)
+
+static void InitBindPose(Pose* pose, ANode* nodes, int numNodes)
 {
-    index = Prefab::FindNodeFromName(prefab, name);
-    node = &prefab->nodes[index];
+    for (int i = 0; i < MaxBonePoses; i++)
+    {
+        pose->tx[i] = pose->ty[i] = pose->tz[i] = 0.0f;
+        pose->rx[i] = pose->ry[i] = pose->rz[i] = 0.0f;
+        pose->rw[i] = 1.0f;
+    }
+
+    for (int i = 0; i < numNodes; i++)
+    {
+        pose->tx[i] = nodes[i].translation[0];
+        pose->ty[i] = nodes[i].translation[1];
+        pose->tz[i] = nodes[i].translation[2];
+        pose->rx[i] = nodes[i].rotation[0];
+        pose->ry[i] = nodes[i].rotation[1];
+        pose->rz[i] = nodes[i].rotation[2];
+        pose->rw[i] = nodes[i].rotation[3];
+    }
 }
 
-void CreateAnimationController(Prefab* prefab, AnimationController* result, bool humanoid, int lowerBodyStart)
+// LOD's are selected from screen size in pixels
+static const float LodMinScreenSize[NumAnimLODs]  = { 300.0f, 120.0f, 40.0f, 0.0f };
+static const int   LodUpdateInterval[NumAnimLODs] = { 1, 2, 4, 8 };
+// dead band around the thresholds, otherwise character that is near a threshold changes LOD every frame
+static const float LodHysteresis = 0.15f;
+
+static void InitNodeDepths(AnimationController* controller, Prefab* prefab)
+{
+    MemsetZero(controller->mNodeDepths, sizeof(controller->mNodeDepths));
+    int maxDepth = 0;
+    // parents are before the children in skeleton hierarchy
+    for (int i = 1; i < prefab->numSkeletonNodes; i++)
+    {
+        int depth = controller->mNodeDepths[prefab->skeletonParents[i]] + 1;
+        controller->mNodeDepths[prefab->skeletonNodes[i]] = (unsigned char)MIN(depth, 255);
+        maxDepth = MAX(maxDepth, depth);
+    }
+    // last four levels are finger joints with mixamo skeletons, Hand->Index1->Index2->Index3->Index4
+    controller->mLodCullDepth = MAX(maxDepth - 4, 1);
+}
+
+// everything except the bone palette row, baking uses this directly because it doesn't render the controller
+static bool InitAnimationController(Prefab* prefab, AnimationController* result, bool humanoid, int lowerBodyStart)
 {
+    result->mPaletteRow = -1;
     ASkin* skin = &prefab->skins[0];
     if (skin == nullptr) {
-        AX_WARN("skin is null %s", prefab->path); return;
+        AX_WARN("skin is null %s", prefab->path); return false;
     }
-    if (skin->numJoints > MaxBonePoses) {
+    if (skin->numJoints > MaxBonePoses || prefab->numNodes > MaxBonePoses) {
         AX_WARN("number of joints is greater than max capacity %s", prefab->path); 
-        return; 
+        return false; 
     }
-    result->mMatrixTex = rCreateTexture(skin->numJoints*3, 1, nullptr, TextureType_RGBA16F, TexFlags_RawData);
     result->mRootNodeIndex = Prefab::FindAnimRootNodeIndex(prefab);
     result->mPrefab = prefab;
     result->mState = AnimState_Update;
     result->mNumNodes = prefab->numNodes;
     result->mTrigerredNorm = 0.0f;
-    result->lowerBodyIdxStart = lowerBodyStart;
+    result->mLodScreenSize = -1.0f;
+    result->lowerBodyIdxStart = MIN(lowerBodyStart, prefab->numNodes);
+    InitBindPose(&result->mBindPose, prefab->nodes, prefab->numNodes);
+    result->mLodLevel = 0;
+    result->mLodFrame = 0;
+    result->mLodDeltaTime = 0.0f;
+    result->mLodHasPrevPose = false;
+
+    // cursor per animation channel, in total there are not many channels so we allocate them in one buffer
+    int numCursors = 0;
+    result->mKeyCursorOffsets = new int[prefab->numAnimations + 1];
+    for (int a = 0; a < prefab->numAnimations; a++)
+    {
+        result->mKeyCursorOffsets[a] = numCursors;
+        numCursors += prefab->animations[a].numChannels;
+    }
+    result->mKeyCursorOffsets[prefab->numAnimations] = numCursors;
+    result->mKeyCursors = new int[MAX(numCursors, 1)]{};
 
     ASSERT(result->mRootNodeIndex < MaxBonePoses);
     ASSERT(prefab->GetNodePtr(result->mRootNodeIndex)->numChildren > 0); // root node has to have children nodes
+    ASSERT(prefab->skeletonNodes != nullptr && prefab->skeletonNodes[0] == result->mRootNodeIndex);
+    InitNodeDepths(result, prefab);
     
     if (!humanoid)
-        return;
+        return true;
     
-    SetBoneNode(prefab, result->mSpineNode, result->mSpineNodeIdx, "mixamorig:Spine");
-    SetBoneNode(prefab, result->mNeckNode , result->mNeckNodeIdx , "mixamorig:Neck");
+    result->mSpineNodeIdx = Prefab::FindNodeFromName(prefab, "mixamorig:Spine");
+    result->mNeckNodeIdx  = Prefab::FindNodeFromName(prefab, "mixamorig:Neck");
+    return true;
 }
 
-static inline void RotateNode(ANode* node, float xAngle, float yAngle)
+void CreateAnimationController(Prefab* prefab, AnimationController* result, bool humanoid, int lowerBodyStart)
 {
-    Quaternion q = QMul(QMul(QFromXAngle(xAngle), QFromYAngle(yAngle)), VecLoad(node->rotation));
-    VecStore(node->rotation, q);
+    if (!InitAnimationController(prefab, result, humanoid, lowerBodyStart))
+        return;
+    result->mPaletteRow = AllocatePaletteRow();
+    if (result->mPaletteRow == -1) {
+        ClearAnimationController(result);
+        result->mPrefab = nullptr;
+        return;
+    }
+    prefab->numAnimControllers++;
 }
 
-purefn Matrix4 GetNodeMatrix(ANode* node)
+/*//////////////////////////////////////////////////////////////////////////*/
+/*                              Pose Kernels                                */
+/*//////////////////////////////////////////////////////////////////////////*/
+
+// streams are padded with identity joints, so we can always process 4 joints at once
+purefn int PoseStreamLength(int numNodes)
 {
-    return Matrix4::PositionRotationScale(node->translation, node->rotation, node->scale);
+    return (numNodes + 3) & ~3;
 }
 
-void AnimationController::RecurseBoneMatrices(ANode* node, Matrix4 parentMatrix)
+static void CopyPose(Pose* dst, const Pose* src, int begin, int end)
 {
-    for (int c = 0; c < node->numChildren; c++)
+    int count = end - begin;
+    SmallMemCpy(dst->tx + begin, src->tx + begin, count * sizeof(float));
+    SmallMemCpy(dst->ty + begin, src->ty + begin, count * sizeof(float));
+    SmallMemCpy(dst->tz + begin, src->tz + begin, count * sizeof(float));
+    SmallMemCpy(dst->rx + begin, src->rx + begin, count * sizeof(float));
+    SmallMemCpy(dst->ry + begin, src->ry + begin, count * sizeof(float));
+    SmallMemCpy(dst->rz + begin, src->rz + begin, count * sizeof(float));
+    SmallMemCpy(dst->rw + begin, src->rw + begin, count * sizeof(float));
+}
+
+static void LerpStream(float* a, const float* b, Vector4x32f t, int count)
+{
+    for (int i = 0; i < count; i += 4)
     {
-        int childIndex = node->children[c];
-        ANode* children = &mPrefab->nodes[childIndex];
+        Vector4x32f va = VecLoad(a + i);
+        VecStore(a + i, VecAdd(va, VecMul(VecSub(VecLoad(b + i), va), t)));
+    }
+}
 
-        if (children == mSpineNode && Abs(mSpineYAngle) + Abs(mSpineXAngle) > Epsilon) { RotateNode(children, mSpineXAngle, mSpineYAngle); }
-        if (children == mNeckNode && Abs(mNeckYAngle) + Abs(mSpineXAngle) > Epsilon) { RotateNode(children, mNeckXAngle, mNeckYAngle); }
+// pose0 = lerp(pose0, pose1, animBlend), rotations are nlerped from shortest path
+static void BlendPoses(Pose* pose0, const Pose* pose1, float animBlend, int numNodes)
+{
+    const int count = PoseStreamLength(numNodes);
+    const Vector4x32f t = VecSet1(animBlend);
+    LerpStream(pose0->tx, pose1->tx, t, count);
+    LerpStream(pose0->ty, pose1->ty, t, count);
+    LerpStream(pose0->tz, pose1->tz, t, count);
 
-        mBoneMatrices[childIndex] = GetNodeMatrix(children) * parentMatrix;
+    const Vector4x32f one = VecSet1(1.0f);
+    const Vector4x32f tiny = VecSet1(1e-20f);
+    const Vector4x32f invT = VecSet1(1.0f - animBlend);
 
-        RecurseBoneMatrices(children, mBoneMatrices[childIndex]);
+    for (int i = 0; i < count; i += 4)
+    {
+        Vector4x32f ax = VecLoad(pose0->rx + i), bx = VecLoad(pose1->rx + i);
+        Vector4x32f ay = VecLoad(pose0->ry + i), by = VecLoad(pose1->ry + i);
+        Vector4x32f az = VecLoad(pose0->rz + i), bz = VecLoad(pose1->rz + i);
+        Vector4x32f aw = VecLoad(pose0->rw + i), bw = VecLoad(pose1->rw + i);
+
+        // sign of the dot product, negative means quaternions are in opposite hemispheres
+        Vector4x32f dot = VecAdd(VecAdd(VecMul(ax, bx), VecMul(ay, by)), VecAdd(VecMul(az, bz), VecMul(aw, bw)));
+        Vector4x32f sign = VecDiv(dot, VecMax(VecMax(dot, VecNeg(dot)), tiny));
+        Vector4x32f bt = VecMul(sign, t);
+
+        Vector4x32f x = VecAdd(VecMul(ax, invT), VecMul(bx, bt));
+        Vector4x32f y = VecAdd(VecMul(ay, invT), VecMul(by, bt));
+        Vector4x32f z = VecAdd(VecMul(az, invT), VecMul(bz, bt));
+        Vector4x32f w = VecAdd(VecMul(aw, invT), VecMul(bw, bt));
+
+        Vector4x32f lenSq = VecAdd(VecAdd(VecMul(x, x), VecMul(y, y)), VecAdd(VecMul(z, z), VecMul(w, w)));
+        Vector4x32f invLen = VecDiv(one, VecSqrt(VecMax(lenSq, tiny)));
+        VecStore(pose0->rx + i, VecMul(x, invLen));
+        VecStore(pose0->ry + i, VecMul(y, invLen));
+        VecStore(pose0->rz + i, VecMul(z, invLen));
+        VecStore(pose0->rw + i, VecMul(w, invLen));
     }
 }
 
-static void MergeAnims(Pose* pose0, Pose* pose1, float animBlend, int numNodes)
+static inline void RotateJoint(Pose* pose, int index, float xAngle, float yAngle)
 {
-    for (int i = 0; i < numNodes; i++)
+    Quaternion rotation = VecSetR(pose->rx[index], pose->ry[index], pose->rz[index], pose->rw[index]);
+    Quaternion q = QMul(QMul(QFromXAngle(xAngle), QFromYAngle(yAngle)), rotation);
+    float r[4];
+    VecStore(r, q);
+    pose->rx[index] = r[0]; pose->ry[index] = r[1]; pose->rz[index] = r[2]; pose->rw[index] = r[3];
+}
+
+purefn Matrix4 GetJointMatrix(const Pose* pose, const ANode* node, int index)
+{
+    float translation[3] = { pose->tx[index], pose->ty[index], pose->tz[index] };
+    float rotation[4]    = { pose->rx[index], pose->ry[index], pose->rz[index], pose->rw[index] };
+    return Matrix4::PositionRotationScale(translation, rotation, node->scale);
+}
+
+void AnimationController::ComputeBoneMatrices(Pose* pose)
+{
+    // additive rotations are applied to the local transforms before, so the loop below doesn't have to check every node
+    // indices are -1 if the skeleton doesn't have spine or neck
+    if (mSpineNodeIdx >= 0 && Abs(mSpineYAngle) + Abs(mSpineXAngle) > Epsilon) RotateJoint(pose, mSpineNodeIdx, mSpineXAngle, mSpineYAngle);
+    if (mNeckNodeIdx  >= 0 && Abs(mNeckYAngle)  + Abs(mNeckXAngle)  > Epsilon) RotateJoint(pose, mNeckNodeIdx , mNeckXAngle , mNeckYAngle);
+
+    const ANode* nodes       = mPrefab->nodes;
+    const int* skeletonNodes = mPrefab->skeletonNodes;
+    const int* parents       = mPrefab->skeletonParents;
+    mBoneMatrices[skeletonNodes[0]] = GetJointMatrix(pose, &nodes[skeletonNodes[0]], skeletonNodes[0]);
+
+    // parents are always before the children, so parent matrix is ready when we reach the node
+    for (int i = 1; i < mPrefab->numSkeletonNodes; i++)
     {
-        pose0[i].rotation    = QNLerp(pose0[i].rotation, pose1[i].rotation, animBlend); // slerp+norm?
-        pose0[i].translation = VecLerp(pose0[i].translation, pose1[i].translation, animBlend);
-        // pose0[i].scale    = VecLerp(pose0[i].scale, pose1[i].scale, animBlend);
+        int nodeIndex = skeletonNodes[i];
+        mBoneMatrices[nodeIndex] = GetJointMatrix(pose, &nodes[nodeIndex], nodeIndex) * mBoneMatrices[parents[i]];
     }
 }
 
-static void InitNodes(ANode* nodes, Pose* pose, int begin, int numNodes)
+// see GetCookedSamplerSize for the format, and CompressAnimationSamplers in AssetManager.cpp for the encoder
+static inline Vector4x32f DecodeRotationKey(const ushort* key)
 {
-    numNodes += begin;
-    for (int i = begin; i < numNodes; i++)
+    constexpr float scale = 1.41421356f / 32767.0f; // [0, 32767] -> [0, sqrt(2)]
+    int largest = (key[0] >> 15) | ((key[1] >> 15) << 1);
+    float a = float(key[0] & 0x7FFF) * scale - 0.70710678f;
+    float b = float(key[1] & 0x7FFF) * scale - 0.70710678f;
+    float c = float(key[2] & 0x7FFF) * scale - 0.70710678f;
+    float q[4];
+    q[largest] = sqrtf(MAX(1.0f - a * a - b * b - c * c, 0.0f));
+    q[largest == 0 ? 1 : 0] = a;
+    q[largest <= 1 ? 2 : 1] = b;
+    q[largest <= 2 ? 3 : 2] = c;
+    return VecLoad(q);
+}
+
+static inline Vector4x32f DecodeSamplerKey(const AAnimSampler& sampler, int index)
+{
+    if (sampler.numComponent == 4)
+        return DecodeRotationKey((const ushort*)sampler.output + index * 3);
+
+    const float* range = sampler.output; // min[3], extent[3]
+    const ushort* key  = (const ushort*)(range + 6) + index * 3;
+    constexpr float inv = 1.0f / 65535.0f;
+    return VecSetR(range[0] + range[3] * (float(key[0]) * inv),
+                   range[1] + range[4] * (float(key[1]) * inv),
+                   range[2] + range[5] * (float(key[2]) * inv), 0.0f);
+}
+
+// returns the keyframe index that satisfies: input[index] <= time < input[index + 1]
+static int FindKeyframe(const float* input, int count, float time, int cursor)
+{
+    const int lastIdx = count - 2; // last index that has a next keyframe
+    if (lastIdx <= 0) return 0;
+    
+    cursor = MIN(cursor, lastIdx);
+    // forward playback, most of the time key is same or next one
+    if (time >= input[cursor])
     {
-        VecStore(nodes[i].translation, pose[i].translation);
-        VecStore(nodes[i].rotation, pose[i].rotation);
-        // VecStore(nodes[i].scale, pose[i].scale);
+        for (int i = 0; i < 4 && cursor < lastIdx; i++)
+        {
+            if (time < input[cursor + 1]) return cursor;
+            cursor++;
+        }
+        if (cursor == lastIdx || time < input[cursor + 1]) return cursor;
     }
+
+    // jumped or playing reverse, binary search
+    int low = 0, high = lastIdx;
+    while (low < high)
+    {
+        int mid = (low + high + 1) >> 1;
+        if (input[mid] <= time) low = mid;
+        else                    high = mid - 1;
+    }
+    return low;
 }
 
-static void InitPose(Pose* pose, ANode* nodes, int numNodes)
+/*//////////////////////////////////////////////////////////////////////////*/
+/*                               Pose Cache                                 */
+/*//////////////////////////////////////////////////////////////////////////*/
+
+// controllers that are playing same clip at same time (synchronized crowds, split screen) are sharing sampled poses.
+// direct mapped, each slot has its own lock so parallel updates are not waiting each other most of the time.
+// prefabs that have single controller are not using the cache, there is nothing to share and copying the pose costs
+constexpr int   PoseCacheSize = 32;
+constexpr float PoseCacheRate = 240.0f; // time quantization, samples per second
+
+struct PoseCacheKey
 {
-    for (int i = 0; i < numNodes; i++)
+    const Prefab* prefab;
+    int animIdx;
+    int quantizedTime; // -1 - quantizedTime when sampling reverse
+    int cullDepth;     // LOD's are skipping joints
+};
+
+struct PoseCacheEntry
+{
+    PoseCacheKey key;
+    Pose pose;
+};
+
+static PoseCacheEntry g_PoseCache[PoseCacheSize];
+static std::mutex     g_PoseCacheLocks[PoseCacheSize];
+
+static inline bool PoseCacheKeyEqual(const PoseCacheKey& a, const PoseCacheKey& b)
+{
+    return a.prefab == b.prefab && a.animIdx == b.animIdx && a.quantizedTime == b.quantizedTime && a.cullDepth == b.cullDepth;
+}
+
+static inline int PoseCacheSlot(const PoseCacheKey& key)
+{
+    uint64_t hash = (uint64_t)key.prefab * 0x9E3779B97F4A7C15ull;
+    hash ^= (uint64_t)(uint32_t)key.animIdx * 0xC2B2AE3D27D4EB4Full;
+    hash ^= (uint64_t)(uint32_t)key.quantizedTime * 0x165667B19E3779F9ull;
+    hash ^= (uint64_t)(uint32_t)key.cullDepth;
+    return (int)((hash ^ (hash >> 29)) % PoseCacheSize);
+}
+
+static bool FindCachedPose(const PoseCacheKey& key, Pose* pose, int numNodes)
+{
+    int slot = PoseCacheSlot(key);
+    std::lock_guard<std::mutex> lock(g_PoseCacheLocks[slot]);
+    if (!PoseCacheKeyEqual(g_PoseCache[slot].key, key))
+        return false;
+    CopyPose(pose, &g_PoseCache[slot].pose, 0, PoseStreamLength(numNodes));
+    return true;
+}
+
+static void StoreCachedPose(const PoseCacheKey& key, const Pose* pose, int numNodes)
+{
+    int slot = PoseCacheSlot(key);
+    std::lock_guard<std::mutex> lock(g_PoseCacheLocks[slot]);
+    g_PoseCache[slot].key = key;
+    CopyPose(&g_PoseCache[slot].pose, pose, 0, PoseStreamLength(numNodes));
+}
+
+// call when prefabs are destroyed, new prefab can be allocated at the same address
+void ClearPoseCache()
+{
+    for (int i = 0; i < PoseCacheSize; i++)
     {
-        pose[i].translation = VecLoad(nodes[i].translation);
-        pose[i].rotation    = VecLoad(nodes[i].rotation);
-        // pose[i].scale    = VecLoad(nodes[i].scale);
+        std::lock_guard<std::mutex> lock(g_PoseCacheLocks[i]);
+        g_PoseCache[i].key.prefab = nullptr;
     }
 }
 
+// interpolated translation or rotation of the channel at given time, keyCursor is updated
+static Vector4x32f SampleChannel(const AAnimChannel& channel, const AAnimSampler& sampler, int& keyCursor, float realTime, bool reverse)
+{
+    int beginIdx = FindKeyframe(sampler.input, sampler.count, realTime, keyCursor);
+    int endIdx   = MIN(beginIdx + 1, sampler.count - 1);
+    keyCursor = beginIdx;
+
+    if (reverse) Swap(beginIdx, endIdx);
+
+    Vector4x32f begin = DecodeSamplerKey(sampler, beginIdx);
+    Vector4x32f end   = DecodeSamplerKey(sampler, endIdx);
+
+    float beginTime = MAX(0.0001f, realTime - sampler.input[beginIdx]);
+    float endTime   = MAX(0.0001f, sampler.input[endIdx] - sampler.input[beginIdx]);
+    
+    if (reverse) Swap(beginTime, endTime);
+    
+    float t = Clamp01(beginTime / endTime);
+
+    if (channel.targetPath == AAnimTargetPath_Rotation)
+        return QNorm(QSlerp(begin, end, t)); // QNormEst maybe
+    
+    return VecLerp(begin, end, t);
+}
+
 void AnimationController::SampleAnimationPose(Pose* pose, int animIdx, float normTime)
 {
     AAnimation* animation = &mPrefab->animations[animIdx];
     bool reverse = normTime < 0.0f;
     normTime = Abs(normTime);
+    
+    PoseCacheKey cacheKey;
+    bool useCache = mPrefab->numAnimControllers > 1 && animation->duration > 0.0f;
+    if (useCache)
+    {
+        int quantizedTime      = (int)(normTime * animation->duration * PoseCacheRate);
+        cacheKey.prefab        = mPrefab;
+        cacheKey.animIdx       = animIdx;
+        cacheKey.quantizedTime = reverse ? -1 - quantizedTime : quantizedTime;
+        cacheKey.cullDepth     = mLodLevel > 0 ? mLodCullDepth : 255;
+        if (FindCachedPose(cacheKey, pose, mNumNodes))
+            return;
+        
+        // sample at the quantized time, so the cached pose is the same pose for every controller that hits it
+        normTime = (float)quantizedTime / (animation->duration * PoseCacheRate);
+    }
+
     if (reverse) normTime = MAX(1.0f - normTime, 0.0f);
 
-    InitPose(pose, mPrefab->nodes, mPrefab->numNodes);
+    CopyPose(pose, &mBindPose, 0, PoseStreamLength(mNumNodes));
     float realTime = normTime * animation->duration;
+    int* keyCursors = mKeyCursors + mKeyCursorOffsets[animIdx];
+    // small characters on screen doesn't need finger animations, culled joints are staying in bind pose
+    int cullDepth = mLodLevel > 0 ? mLodCullDepth : 255;
     
     for (int c = 0; c < animation->numChannels; c++)
     {
         AAnimChannel& channel = animation->channels[c];
         int targetNode = channel.targetNode; // prefab->GetNodePtr();
-        AAnimSampler& sampler = animation->samplers[channel.sampler];
     
         // morph targets are not supported
-        if (channel.targetPath == AAnimTargetPath_Weight)
+        if (channel.targetPath == AAnimTargetPath_Weight || mNodeDepths[targetNode] > cullDepth)
             continue;
     
-        // maybe binary search
-        int beginIdx = 0, endIdx;
-        while (realTime >= sampler.input[beginIdx + 1])
-            beginIdx++;
-        
-        beginIdx = MIN(beginIdx, sampler.count - 1);
-        endIdx   = beginIdx + 1;
-
-        if (reverse) Swap(beginIdx, endIdx);
-
-        Vector4x32f begin = ((Vector4x32f*)sampler.output)[beginIdx];
-        Vector4x32f end   = ((Vector4x32f*)sampler.output)[endIdx];
-    
-        float beginTime = MAX(0.0001f, realTime - sampler.input[beginIdx]);
-        float endTime   = MAX(0.0001f, sampler.input[endIdx] - sampler.input[beginIdx]);
-        
-        if (reverse) Swap(beginTime, endTime);
-        
-        float t = Clamp01(beginTime / endTime);
+        Vector4x32f value = SampleChannel(channel, animation->samplers[channel.sampler], keyCursors[c], realTime, reverse);
+        float result[4];
+        VecStore(result, value);
 
         switch (channel.targetPath)
         {
             case AAnimTargetPath_Translation:
-                pose[targetNode].translation = VecLerp(begin, end, t);
+                pose->tx[targetNode] = result[0];
+                pose->ty[targetNode] = result[1];
+                pose->tz[targetNode] = result[2];
                 break;
             case AAnimTargetPath_Rotation:
-                Quaternion rot = QSlerp(begin, end, t);
-                pose[targetNode].rotation = QNorm(rot); // QNormEst maybe
+                pose->rx[targetNode] = result[0];
+                pose->ry[targetNode] = result[1];
+                pose->rz[targetNode] = result[2];
+                pose->rw[targetNode] = result[3];
                 break;
         //  case AAnimTargetPath_Scale:
         //      pose[targetNode].scale = VecLerp(begin, end, t);
         //      break;
         };
     }
+    if (useCache)
+        StoreCachedPose(cacheKey, pose, mNumNodes);
+}
+
+void AnimationController::SampleBlendTree(Pose* pose, const BlendClip* clips, int numClips)
+{
+    // with single clip we can use the pose cache
+    int numActive = 0, lastActive = 0;
+    float totalWeight = 0.0f;
+    for (int i = 0; i < numClips; i++)
+    {
+        if (clips[i].weight < BlendWeightEpsilon) continue;
+        totalWeight += clips[i].weight;
+        lastActive = i;
+        numActive++;
+    }
+
+    if (numActive == 0) {
+        CopyPose(pose, &mBindPose, 0, PoseStreamLength(mNumNodes));
+        return;
+    }
+
+    if (numActive == 1) {
+        SampleAnimationPose(pose, clips[lastActive].animIdx, clips[lastActive].normTime);
+        return;
+    }
+
+    // weighted sum of all clips, there is no intermediate pose for each clip.
+    // joints that are not animated by a clip are using bind pose for that clip, added at the end
+    alignas(16) float translationWeights[MaxBonePoses];
+    alignas(16) float rotationWeights[MaxBonePoses];
+    MemsetZero(translationWeights, sizeof(translationWeights));
+    MemsetZero(rotationWeights, sizeof(rotationWeights));
+    MemsetZero(pose, sizeof(Pose));
+
+    int cullDepth = mLodLevel > 0 ? mLodCullDepth : 255;
+
+    for (int i = 0; i < numClips; i++)
+    {
+        float weight = clips[i].weight;
+        if (weight < BlendWeightEpsilon) continue;
+
+        int animIdx = clips[i].animIdx;
+        AAnimation* animation = &mPrefab->animations[animIdx];
+        bool reverse = clips[i].normTime < 0.0f;
+        float normTime = Abs(clips[i].normTime);
+        if (reverse) normTime = MAX(1.0f - normTime, 0.0f);
+
+        float realTime = normTime * animation->duration;
+        int* keyCursors = mKeyCursors + mKeyCursorOffsets[animIdx];
+
+        for (int c = 0; c < animation->numChannels; c++)
+        {
+            AAnimChannel& channel = animation->channels[c];
+            int n = channel.targetNode;
+            
+            if (channel.targetPath == AAnimTargetPath_Weight || channel.targetPath == AAnimTargetPath_Scale || mNodeDepths[n] > cullDepth)
+                continue;
+            
+            float v[4];
+            VecStore(v, SampleChannel(channel, animation->samplers[channel.sampler], keyCursors[c], realTime, reverse));
+
+            if (channel.targetPath == AAnimTargetPath_Translation)
+            {
+                pose->tx[n] += v[0] * weight;
+                pose->ty[n] += v[1] * weight;
+                pose->tz[n] += v[2] * weight;
+                translationWeights[n] += weight;
+            }
+            else
+            {
+                // q and -q are same rotation, keep all of the samples in the same hemisphere
+                float dot = pose->rx[n] * v[0] + pose->ry[n] * v[1] + pose->rz[n] * v[2] + pose->rw[n] * v[3];
+                float w = dot < 0.0f ? -weight : weight;
+                pose->rx[n] += v[0] * w;
+                pose->ry[n] += v[1] * w;
+                pose->rz[n] += v[2] * w;
+                pose->rw[n] += v[3] * w;
+                rotationWeights[n] += weight;
+            }
+        }
+    }
+
+    // add bind pose for the remaining weights and normalize, 4 joint at a time
+    const Vector4x32f total    = VecSet1(totalWeight);
+    const Vector4x32f invTotal = VecSet1(1.0f / totalWeight);
+    
+    const Vector4x32f tiny     = VecSet1(1e-20f);
+    const Vector4x32f one      = VecSet1(1.0f);
+    const Pose* bind = &mBindPose;
+    const int count = PoseStreamLength(mNumNodes);
+
+    for (int i = 0; i < count; i += 4)
+    {
+        Vector4x32f remaining = VecSub(total, VecLoad(translationWeights + i));
+        VecStore(pose->tx + i, VecMul(VecAdd(VecLoad(pose->tx + i), VecMul(VecLoad(bind->tx + i), remaining)), invTotal));
+        VecStore(pose->ty + i, VecMul(VecAdd(VecLoad(pose->ty + i), VecMul(VecLoad(bind->ty + i), remaining)), invTotal));
+        VecStore(pose->tz + i, VecMul(VecAdd(VecLoad(pose->tz + i), VecMul(VecLoad(bind->tz + i), remaining)), invTotal));
+
+        Vector4x32f ax = VecLoad(pose->rx + i), bx = VecLoad(bind->rx + i);
+        Vector4x32f ay = VecLoad(pose->ry + i), by = VecLoad(bind->ry + i);
+        Vector4x32f az = VecLoad(pose->rz + i), bz = VecLoad(bind->rz + i);
+        Vector4x32f aw = VecLoad(pose->rw + i), bw = VecLoad(bind->rw + i);
+
+        // bind rotation has to be in the same hemisphere with accumulated rotation as well, same as BlendPoses
+        Vector4x32f dot = VecAdd(VecAdd(VecMul(ax, bx), VecMul(ay, by)), VecAdd(VecMul(az, bz), VecMul(aw, bw)));
+        Vector4x32f sign = VecDiv(VecAdd(dot, tiny), VecMax(VecMax(dot, VecNeg(dot)), tiny));
+        remaining = VecMul(sign, VecSub(total, VecLoad(rotationWeights + i)));
+
+        Vector4x32f x = VecAdd(ax, VecMul(bx, remaining));
+        Vector4x32f y = VecAdd(ay, VecMul(by, remaining));
+        Vector4x32f z = VecAdd(az, VecMul(bz, remaining));
+        Vector4x32f w = VecAdd(aw, VecMul(bw, remaining));
+
+        Vector4x32f lenSq = VecAdd(VecAdd(VecMul(x, x), VecMul(y, y)), VecAdd(VecMul(z, z), VecMul(w, w)));
+        Vector4x32f invLen = VecDiv(one, VecSqrt(VecMax(lenSq, tiny)));
+        VecStore(pose->rx + i, VecMul(x, invLen));
+        VecStore(pose->ry + i, VecMul(y, invLen));
+        VecStore(pose->rz + i, VecMul(z, invLen));
+        VecStore(pose->rw + i, VecMul(w, invLen));
+    }
 }
 
 // send matrices to GPU
@@ -176,50 +650,104 @@ void AnimationController::UploadBoneMatrices()
     ASkin& skin = mPrefab->skins[0];
     Matrix4* invMatrices = (Matrix4*)skin.inverseBindMatrices;
 
+    WriteBonePalette(g_BonePalettes + (mPaletteRow * MaxBonePoses));
+    
+    // each controller writes only to its own row, so this is safe when evaluating with multiple threads
+    g_PaletteRowDirty[mPaletteRow] = true;
+}
+
+void AnimationController::WriteBonePalette(Matrix3x4f16* outMatrices)
+{
+    ASkin& skin = mPrefab->skins[0];
+    Matrix4* invMatrices = (Matrix4*)skin.inverseBindMatrices;
+
     // give this, thousands of joints it will process it rapidly!
     for (int i = 0; i < skin.numJoints; i++)
     {
         Matrix4 mat = invMatrices[i] * mBoneMatrices[skin.joints[i]];
         mat = Matrix4::Transpose(mat);
         // with AVX F16C this is single instruction! vcvtps2ph 
-        ConvertFloat8ToHalf8(mOutMatrices[i].x, &mat.m[0][0]);
-        ConvertFloat4ToHalf4(mOutMatrices[i].z, &mat.m[2][0]); // this is single instruction with it as well
+        ConvertFloat8ToHalf8(outMatrices[i].x, &mat.m[0][0]);
+        ConvertFloat4ToHalf4(outMatrices[i].z, &mat.m[2][0]); // this is single instruction with it as well
     }
-    
-    // upload anim matrix texture to the GPU
-    rUpdateTexture(mMatrixTex, mOutMatrices);
 }
 
-void AnimationController::UploadPose(Pose* pose)
+void AnimationController::ComputeSkinMatrices(Matrix4* outMatrices, const Matrix4& transform)
 {
-    InitNodes(mPrefab->nodes, pose, 0, mPrefab->numNodes);
+    ASkin& skin = mPrefab->skins[0];
+    Matrix4* invMatrices = (Matrix4*)skin.inverseBindMatrices;
 
-    ANode* rootNode = mPrefab->GetNodePtr(mRootNodeIndex);
-    mBoneMatrices[mRootNodeIndex] = GetNodeMatrix(rootNode);
+    for (int i = 0; i < skin.numJoints; i++)
+    {
+        outMatrices[i] = invMatrices[i] * mBoneMatrices[skin.joints[i]] * transform;
+    }
+}
 
-    RecurseBoneMatrices(rootNode, mBoneMatrices[mRootNodeIndex]);
-    UploadBoneMatrices();
+void AnimationController::UploadPose(Pose* pose)
+{
+    // copy, additive rotations shouldn't accumulate on the poses that we are blending over frames
+    CopyPose(&mOutPose, pose, 0, PoseStreamLength(mNumNodes));
+    UploadOutPose();
 }
 
 // when we want to play different animations with lower body and upper body
 void AnimationController::UploadPoseUpperLower(Pose* lowerPose, Pose* uperPose)
 {
     // apply posess to lower body and upper body seperately, so both of it has diferrent animations
-    InitNodes(mPrefab->nodes, lowerPose, lowerBodyIdxStart, mPrefab->numNodes - lowerBodyIdxStart);
-    InitNodes(mPrefab->nodes, uperPose, 0, lowerBodyIdxStart);
+    CopyPose(&mOutPose, lowerPose, lowerBodyIdxStart, mNumNodes);
+    CopyPose(&mOutPose, uperPose, 0, lowerBodyIdxStart);
+    UploadOutPose();
+}
 
-    ANode* rootNode = mPrefab->GetNodePtr(mRootNodeIndex);
-    Matrix4 rootMatrix = GetNodeMatrix(rootNode);
-    mBoneMatrices[mRootNodeIndex] = rootMatrix;
+void AnimationController::UploadOutPose()
+{
+    if (mLodLevel == 1)
+    {
+        // keep last two poses, we are showing previous pose and interpolating towards the new one until next update.
+        // this adds one update of latency, but it is not noticeable at this distance
+        int length = PoseStreamLength(mNumNodes);
+        CopyPose(&mLodPrevPose, mLodHasPrevPose ? &mLodNextPose : &mOutPose, 0, length);
+        CopyPose(&mLodNextPose, &mOutPose, 0, length);
+        mLodHasPrevPose = true;
+        UploadInterpolatedPose(0.0f);
+        return;
+    }
+    ComputeBoneMatrices(&mOutPose);
+    UploadBoneMatrices();
+}
 
-    RecurseBoneMatrices(rootNode, rootMatrix);
+void AnimationController::UploadInterpolatedPose(float t)
+{
+    CopyPose(&mOutPose, &mLodPrevPose, 0, PoseStreamLength(mNumNodes));
+    BlendPoses(&mOutPose, &mLodNextPose, t, mNumNodes);
+    ComputeBoneMatrices(&mOutPose);
     UploadBoneMatrices();
 }
 
+void AnimationController::SetLODFromScreenSize(float screenSize)
+{
+    int level = 0;
+    while (level < NumAnimLODs - 1)
+    {
+        // thresholds are moved away from the current LOD, so it has to pass the dead band to change
+        float threshold = LodMinScreenSize[level] * (level < mLodLevel ? 1.0f + LodHysteresis : 1.0f - LodHysteresis);
+        if (screenSize >= threshold)
+            break;
+        level++;
+    }
+
+    if (level == mLodLevel)
+        return;
+    
+    mLodLevel = level;
+    mLodHasPrevPose = false;
+    mLodFrame = LodUpdateInterval[level]; // evaluate immediately with new LOD
+}
+
 void AnimationController::PlayAnim(int index, float norm)
 {
-    SampleAnimationPose(mAnimPoseA, index, norm);
-    UploadPose(mAnimPoseA);
+    SampleAnimationPose(&mAnimPoseA, index, norm);
+    UploadPose(&mAnimPoseA);
 }
 
 bool AnimationController::TriggerAnim(int index, float transitionInTime, float transitionOutTime, eAnimTriggerOpt triggerOpt)
@@ -237,7 +765,7 @@ bool AnimationController::TriggerAnim(int index, float transitionInTime, float t
     }
 
     mState = AnimState_TriggerIn;
-    SmallMemCpy(mAnimPoseC, mAnimPoseA, sizeof(mAnimPoseA));
+    CopyPose(&mAnimPoseC, &mAnimPoseA, 0, PoseStreamLength(mNumNodes));
     if (EnumHasBit(triggerOpt, eAnimTriggerOpt_ReverseOut))
         mAnimTime.y = 0.0f;
     return true;
@@ -247,8 +775,8 @@ bool AnimationController::TriggerTransition(float deltaTime, int targetAnim)
 {
     float newNorm   = Clamp01((mTransitionTime - mCurTransitionTime) / mTransitionTime);
     float animDelta = Clamp01(deltaTime * (1.0f / MAX(1.0f - newNorm, Epsilon)));
-    SampleAnimationPose(mAnimPoseD, targetAnim, mAnimTime.y);
-    MergeAnims(mAnimPoseC, mAnimPoseD, animDelta, mNumNodes);
+    SampleAnimationPose(&mAnimPoseD, targetAnim, mAnimTime.y);
+    BlendPoses(&mAnimPoseC, &mAnimPoseD, animDelta, mNumNodes);
     mCurTransitionTime -= deltaTime;
     return mCurTransitionTime <= 0.0f;
 }
@@ -256,7 +784,47 @@ bool AnimationController::TriggerTransition(float deltaTime, int targetAnim)
 // x, y has to be between -1.0 and 1.0
 void AnimationController::EvaluateLocomotion(float x, float y, float animSpeed)
 {
-    const float deltaTime = (float)GetDeltaTime();
+    mLodDeltaTime += (float)GetDeltaTime();
+    
+    if (++mLodFrame < LodUpdateInterval[mLodLevel])
+    {
+        // between updates, LOD 1 interpolates last two poses, others are reusing the previous palette without uploading
+        if (mLodLevel == 1 && mLodHasPrevPose) 
+            UploadInterpolatedPose(float(mLodFrame) / float(LodUpdateInterval[1]));
+        return;
+    }
+
+    float deltaTime = mLodDeltaTime;
+    mLodDeltaTime = 0.0f;
+    mLodFrame = 0;
+    EvaluateLocomotionStep(x, y, animSpeed, deltaTime);
+}
+
+// bilinear weights of the four grid cells around (x, y), x selects the column and y selects the row.
+// negative y is walking backwards, it uses the inverse rows. diagonals are blended from the neighbor columns
+int AnimationController::ComputeLocomotionWeights(float x, float y, BlendClip* clips)
+{
+    float row = MIN(Abs(y), 3.0f);
+    int y0 = MIN(int(row), 3);
+    int y1 = MIN(y0 + 1, 3);
+    float yBlend = EaseOut(row - float(y0));
+    int ySign = y < 0.0f ? -1 : 1;
+
+    float column = Clamp(x, -1.0f, 1.0f) + 1.0f; // 0 = aLeft, 1 = aMiddle, 2 = aRight
+    int x0 = MIN(int(column), aMiddle);
+    int x1 = x0 + 1;
+    float xBlend = column - float(x0);
+
+    // ordered from slowest to fastest row, EvaluateLocomotionStep advances time with the last clip that has weight
+    clips[0] = { GetAnim(x0, y0 * ySign), mAnimTime.y, (1.0f - xBlend) * (1.0f - yBlend) };
+    clips[1] = { GetAnim(x1, y0 * ySign), mAnimTime.y, xBlend * (1.0f - yBlend) };
+    clips[2] = { GetAnim(x0, y1 * ySign), mAnimTime.y, (1.0f - xBlend) * yBlend };
+    clips[3] = { GetAnim(x1, y1 * ySign), mAnimTime.y, xBlend * yBlend };
+    return 4;
+}
+
+void AnimationController::EvaluateLocomotionStep(float x, float y, float animSpeed, float deltaTime)
+{
     bool wasTriggerState = IsTrigerred();
 
     if (mState == AnimState_TriggerIn)
@@ -273,7 +841,7 @@ void AnimationController::EvaluateLocomotion(float x, float y, float animSpeed)
         }
         else 
         {
-            SampleAnimationPose(mAnimPoseC, mTriggerredAnim, -mTrigerredNorm);
+            SampleAnimationPose(&mAnimPoseC, mTriggerredAnim, -mTrigerredNorm);
             float animStep = 1.0f / mPrefab->animations[mTriggerredAnim].duration;
             mTrigerredNorm = Clamp01(mTrigerredNorm + (animSpeed * animStep * deltaTime));
             if (mTrigerredNorm >= 1.0f)
@@ -282,7 +850,7 @@ void AnimationController::EvaluateLocomotion(float x, float y, float animSpeed)
     }
     else if (mState == AnimState_TriggerPlaying)
     {
-        SampleAnimationPose(mAnimPoseC, mTriggerredAnim, mTrigerredNorm);
+        SampleAnimationPose(&mAnimPoseC, mTriggerredAnim, mTrigerredNorm);
 
         float animStep = 1.0f / mPrefab->animations[mTriggerredAnim].duration;
         mTrigerredNorm = Clamp01(mTrigerredNorm + (animSpeed * animStep * deltaTime));
@@ -301,22 +869,14 @@ void AnimationController::EvaluateLocomotion(float x, float y, float animSpeed)
     if (!wasTriggerState || (wasTriggerState && EnumHasBit(mTriggerOpt, eAnimTriggerOpt_Standing) && Abs(y) > 0.001f))
     {
         // play and blend walking and running anims
-        y = Abs(y); 
-        int yi = int(y);
-        // sample y anim
-        ASSERTR(yi <= 3, return); // must be between 1 and 4
-        yIndex = GetAnim(aMiddle, yi);
-
-        SampleAnimationPose(mAnimPoseA, yIndex, mAnimTime.y);
-        float yBlend = Fract(y);
-
-        bool shouldAnimBlendY = yi != 3 && yBlend > 0.00002f;
-        if (shouldAnimBlendY)
-        {
-            yIndex = GetAnim(aMiddle, yi + 1);
-            SampleAnimationPose(mAnimPoseB, yIndex, mAnimTime.y);
-            MergeAnims(mAnimPoseA, mAnimPoseB, EaseOut(yBlend), mNumNodes);
-        }
+        BlendClip clips[MaxBlendClips];
+        int numClips = ComputeLocomotionWeights(x, y, clips);
+        SampleBlendTree(&mAnimPoseA, clips, numClips);
+        
+        // time is advanced with the duration of the fastest clip that has weight
+        yIndex = clips[0].animIdx;
+        for (int i = 1; i < numClips; i++)
+            if (clips[i].weight >= BlendWeightEpsilon) yIndex = clips[i].animIdx;
 
         // if anim is two seconds animStep is 0.5 because we are using normalized value
         float yAnimStep = 1.0f / mPrefab->animations[yIndex].duration;
@@ -326,19 +886,261 @@ void AnimationController::EvaluateLocomotion(float x, float y, float animSpeed)
     mLastAnim = yIndex;
 
     if (!wasTriggerState) {
-        UploadPose(mAnimPoseA);
+        UploadPose(&mAnimPoseA);
     }
     else {
-        if (EnumHasBit(mTriggerOpt, eAnimTriggerOpt_Standing) && y > 0.001f)
-            UploadPoseUpperLower(mAnimPoseA, mAnimPoseC);
+        if (EnumHasBit(mTriggerOpt, eAnimTriggerOpt_Standing) && Abs(y) > 0.001f)
+            UploadPoseUpperLower(&mAnimPoseA, &mAnimPoseC);
         else
-            UploadPose(mAnimPoseC);
+            UploadPose(&mAnimPoseC);
     }
 }
 
 void ClearAnimationController(AnimationController* animSystem)
 {
-    rDeleteTexture(animSystem->mMatrixTex);
+    // controllers that are used for baking don't have palette row and they are not counted
+    if (animSystem->mPaletteRow != -1 && animSystem->mPrefab != nullptr)
+        animSystem->mPrefab->numAnimControllers--;
+    FreePaletteRow(animSystem->mPaletteRow);
+    animSystem->mPaletteRow = -1;
+    delete[] animSystem->mKeyCursorOffsets;
+    delete[] animSystem->mKeyCursors;
+    animSystem->mKeyCursorOffsets = nullptr;
+    animSystem->mKeyCursors = nullptr;
+}
+
+struct LocomotionBatch
+{
+    AnimationController** controllers;
+    const LocomotionInput* inputs;
+};
+
+static void EvaluateLocomotionRange(void* data, int task, int begin, int end)
+{
+    const LocomotionBatch* batch = (const LocomotionBatch*)data;
+    for (int i = begin; i < end; i++)
+    {
+        const LocomotionInput& input = batch->inputs[i];
+        batch->controllers[i]->EvaluateLocomotion(input.x, input.y, input.animSpeed);
+    }
+}
+
+void EvaluateLocomotionBatch(AnimationController** controllers, const LocomotionInput* inputs, int count)
+{
+    // controllers are not sharing any writable data except the pose cache, which is locked per slot.
+    // it is not worth to split few characters
+    constexpr int MinControllersPerTask = 4;
+    int numTasks = MIN(count / MinControllersPerTask, GetNumJobThreads());
+    
+    LocomotionBatch batch = { controllers, inputs };
+    ParallelRange(EvaluateLocomotionRange, &batch, count, numTasks);
+}
+
+/*//////////////////////////////////////////////////////////////////////////*/
+/*                              CPU Skinning                                */
+/*//////////////////////////////////////////////////////////////////////////*/
+
+inline Vector4x32f UnpackNormal(uint32_t p)
+{
+    // sign extend 10 bit components, Pack_INT_2_10_10_10_REV stores them as two's complement
+    int x = (int)(p << 22) >> 22;
+    int y = (int)(p << 12) >> 22;
+    int z = (int)(p <<  2) >> 22;
+    return VecMul(VecSetR((float)x, (float)y, (float)z, 0.0f), VecSet1(1.0f / 511.0f));
+}
+
+void SkinVertices(const Matrix4* skinMatrices, const ASkinedVertex* vertices, int count, Vector3f* outPositions, Vector3f* outNormals)
+{
+    const Vector4x32f weightScale = VecSet1(1.0f / 255.0f);
+
+    for (int v = 0; v < count; v++)
+    {
+        const ASkinedVertex& vertex = vertices[v];
+        // weighted sum of the joint matrices, same as GetAnimMatrix in 3DVert.glsl
+        Vector4x32f r0 = VecZero(), r1 = VecZero(), r2 = VecZero(), r3 = VecZero();
+
+        for (int j = 0, shift = 0; j < 4; j++, shift += 8)
+        {
+            uint32_t weight = (vertex.weights >> shift) & 0xFFu;
+            if (weight == 0u) 
+                continue;
+
+            const Matrix4& mat = skinMatrices[(vertex.joints >> shift) & 0xFFu];
+            Vector4x32f w = VecMul(VecSet1((float)weight), weightScale);
+            r0 = VecAdd(r0, VecMul(mat.r[0], w));
+            r1 = VecAdd(r1, VecMul(mat.r[1], w));
+            r2 = VecAdd(r2, VecMul(mat.r[2], w));
+            r3 = VecAdd(r3, VecMul(mat.r[3], w));
+        }
+
+        // row vector * matrix
+        Vector4x32f position = VecAdd(VecMul(VecSet1(vertex.position.x), r0), 
+                               VecAdd(VecMul(VecSet1(vertex.position.y), r1), 
+                               VecAdd(VecMul(VecSet1(vertex.position.z), r2), r3)));
+        outPositions[v] = { VecGetX(position), VecGetY(position), VecGetZ(position) };
+
+        if (!outNormals) 
+            continue;
+
+        Vector4x32f packed = UnpackNormal(vertex.normal);
+        Vector4x32f normal = VecAdd(VecMul(VecSwizzle(packed, 0, 0, 0, 0), r0),
+                             VecAdd(VecMul(VecSwizzle(packed, 1, 1, 1, 1), r1),
+                                    VecMul(VecSwizzle(packed, 2, 2, 2, 2), r2)));
+        normal = Vec3Norm(normal);
+        outNormals[v] = { VecGetX(normal), VecGetY(normal), VecGetZ(normal) };
+    }
+}
+
+struct SkinPrimitivesData
+{
+    const Matrix4* skinMatrices;
+    const SkinningJob* jobs;
+    int numJobs;
+};
+
+// vertices of all jobs are seen as one big array, each task skins [begin, end) range of it
+static void SkinPrimitivesRange(void* data, int task, int begin, int end)
+{
+    const SkinPrimitivesData* skin = (const SkinPrimitivesData*)data;
+    const Matrix4* skinMatrices = skin->skinMatrices;
+    const SkinningJob* jobs = skin->jobs;
+    int numJobs = skin->numJobs;
+    int jobStart = 0;
+    for (int i = 0; i < numJobs && jobStart < end; i++)
+    {
+        const SkinningJob& job = jobs[i];
+        int first = MAX(begin, jobStart) - jobStart;
+        int last  = MIN(end, jobStart + job.numVertices) - jobStart;
+        
+        if (first < last)
+        {
+            Vector3f* normals = job.outNormals ? job.outNormals + first : nullptr;
+            SkinVertices(skinMatrices, job.vertices + first, last - first, job.outPositions + first, normals);
+        }
+        jobStart += job.numVertices;
+    }
+}
+
+void SkinPrimitives(AnimationController* controller, const Matrix4& transform, const SkinningJob* jobs, int numJobs)
+{
+    ASSERTR(controller->mPrefab && controller->mPrefab->numSkins > 0, return);
+    
+    Matrix4 skinMatrices[MaxBonePoses];
+    controller->ComputeSkinMatrices(skinMatrices, transform);
+
+    int totalVertices = 0;
+    for (int i = 0; i < numJobs; i++)
+        totalVertices += jobs[i].numVertices;
+
+    // it is not worth to split small meshes
+    constexpr int MinVerticesPerTask = 4096;
+    int numTasks = MIN(totalVertices / MinVerticesPerTask, GetNumJobThreads());
+    
+    SkinPrimitivesData data = { skinMatrices, jobs, numJobs };
+    ParallelRange(SkinPrimitivesRange, &data, totalVertices, numTasks);
+}
+
+/*//////////////////////////////////////////////////////////////////////////*/
+/*                           Baked Animations                               */
+/*//////////////////////////////////////////////////////////////////////////*/
+
+static int GetNumBakedFrames(const AAnimation& animation)
+{
+    return MAX((int)(animation.duration * BakedAnimSampleRate + 0.5f), 1);
+}
+
+void BakeAnimations(Prefab* prefab, BakedAnimations* result, const int* clipIndices, int numClips)
+{
+    MemsetZero(result, sizeof(BakedAnimations));
+    if (numClips == 0 || prefab->numAnimations == 0 || prefab->numSkins == 0)
+        return;
+
+    int totalFrames = 0;
+    for (int c = 0; c < numClips; c++)
+    {
+        ASSERTR(clipIndices[c] >= 0 && clipIndices[c] < prefab->numAnimations, return);
+        totalFrames += GetNumBakedFrames(prefab->animations[clipIndices[c]]);
+    }
+
+    // texture width can't be bigger than MaxBakedRows either
+    int numJoints = prefab->skins[0].numJoints;
+    int maxColumns = MaxBakedRows / (numJoints * 3);
+    if (totalFrames > maxColumns * MaxBakedRows) {
+        AX_WARN("animations are too long to bake %s", prefab->path);
+        return;
+    }
+
+    // controller is big, don't use stack. we don't render it, so it doesn't need bone palette row
+    AnimationController* controller = new AnimationController();
+    MemsetZero(controller, sizeof(AnimationController));
+    if (!InitAnimationController(prefab, controller, false, 0)) {
+        delete controller;
+        return;
+    }
+
+    result->numClips    = numClips;
+    result->numJoints   = numJoints;
+    result->totalFrames = totalFrames;
+    result->clips       = new BakedClip[numClips];
+    result->palettes    = new Matrix3x4f16[totalFrames * numJoints];
+
+    int currFrame = 0;
+    for (int c = 0; c < numClips; c++)
+    {
+        AAnimation& animation = prefab->animations[clipIndices[c]];
+        BakedClip& clip = result->clips[c];
+        clip.firstFrame = currFrame;
+        clip.numFrames  = GetNumBakedFrames(animation);
+        clip.animation  = clipIndices[c];
+        currFrame += clip.numFrames;
+
+        // clips are looping, last frame interpolates to the first frame, so we don't sample the end of the clip
+        for (int f = 0; f < clip.numFrames; f++)
+        {
+            float norm = float(f) / float(clip.numFrames);
+            controller->SampleAnimationPose(&controller->mAnimPoseA, clip.animation, norm);
+            CopyPose(&controller->mOutPose, &controller->mAnimPoseA, 0, PoseStreamLength(controller->mNumNodes));
+            controller->ComputeBoneMatrices(&controller->mOutPose);
+            controller->WriteBonePalette(result->palettes + (clip.firstFrame + f) * numJoints);
+        }
+    }
+
+    ClearAnimationController(controller);
+    delete controller;
+}
+
+void UploadBakedAnimations(BakedAnimations* bake)
+{
+    if (bake->totalFrames == 0)
+        return;
+
+    // wrap the frames into columns, so texture height is at most MaxBakedRows
+    int numColumns = (bake->totalFrames + MaxBakedRows - 1) / MaxBakedRows;
+    int width  = numColumns * bake->numJoints;
+    int height = MIN(bake->totalFrames, MaxBakedRows);
+    Matrix3x4f16* texels = new Matrix3x4f16[width * height]{};
+
+    for (int f = 0; f < bake->totalFrames; f++)
+    {
+        int column = f / MaxBakedRows, row = f % MaxBakedRows;
+        SmallMemCpy(texels + (row * width) + (column * bake->numJoints), 
+                    bake->palettes + (f * bake->numJoints), bake->numJoints * sizeof(Matrix3x4f16));
+    }
+
+    bake->texture = rCreateTexture(width * 3, height, texels, TextureType_RGBA16F, TexFlags_RawData);
+    bake->texture.buffer = nullptr; // rDeleteTexture would free our texels otherwise
+    delete[] texels;
+    delete[] bake->palettes;
+    bake->palettes = nullptr;
+}
+
+void FreeBakedAnimations(BakedAnimations* bake)
+{
+    if (bake->texture.handle != 0)
+        rDeleteTexture(bake->texture);
+    delete[] bake->clips;
+    delete[] bake->palettes;
+    MemsetZero(bake, sizeof(BakedAnimations));
 }
 
 void DestroyAnimationSystem()
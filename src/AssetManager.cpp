@@ -11,6 +11,7 @@
 #include "include/Platform.hpp"
 #include "include/Renderer.hpp"
 #include "include/Scene.hpp"
+#include "include/Animation.hpp"
 
 #if !AX_GAME_BUILD
 	#include "../External/ufbx.h"
@@ -437,6 +438,193 @@ int LoadFBX(const char* path, SceneBundle* fbxScene, float scale)
 }
 
 
+/*//////////////////////////////////////////////////////////////////////////*/
+/*                         Animation Compression                            */
+/*//////////////////////////////////////////////////////////////////////////*/
+
+const float AnimRotationTolerance    = 0.0005f; // < max quaternion component error of removed keys
+const float AnimTranslationTolerance = 0.001f;  // < max error of removed keys, relative to the range of the sampler
+
+// can we remove the keys between begin and end, and interpolate them instead
+static bool CanInterpolateKeys(const Vector4x32f* keys, const float* times, int begin, int end, int numComponent, float tolerance)
+{
+    float duration = MAX(times[end] - times[begin], 1e-6f);
+    for (int k = begin + 1; k < end; k++)
+    {
+        float t = Clamp01((times[k] - times[begin]) / duration);
+        // same interpolation with SampleAnimationPose
+        Vector4x32f interpolated = numComponent == 4 ? QNorm(QSlerp(keys[begin], keys[end], t)) 
+                                                     : VecLerp(keys[begin], keys[end], t);
+        float diff[4];
+        VecStore(diff, VecSub(interpolated, keys[k]));
+        for (int c = 0; c < MIN(numComponent, 4); c++)
+            if (Abs(diff[c]) > tolerance) return false;
+    }
+    return true;
+}
+
+// removes the keys that can be interpolated from neighbors, returns the number of remaining keys
+// compaction is in place, kept keys are written to indices that we don't read anymore
+static int ReduceKeyframes(Vector4x32f* keys, float* times, int count, int numComponent, float tolerance)
+{
+    if (count <= 2) return count;
+    int numKept = 1, lastKept = 0;
+    
+    for (int i = 1; i < count - 1; i++)
+    {
+        if (CanInterpolateKeys(keys, times, lastKept, i + 1, numComponent, tolerance))
+            continue;
+        keys[numKept]  = keys[i];
+        times[numKept] = times[i];
+        numKept++;
+        lastKept = i;
+    }
+    keys[numKept]  = keys[count - 1];
+    times[numKept] = times[count - 1];
+    return numKept + 1;
+}
+
+// smallest three, largest component is calculated from other three when decoding
+static void EncodeRotationKey(ushort* out, Vector4x32f key)
+{
+    float q[4];
+    VecStore(q, QNorm(key));
+    int largest = 0;
+    for (int i = 1; i < 4; i++)
+        if (Abs(q[i]) > Abs(q[largest])) largest = i;
+
+    // q and -q are same rotation, make the largest positive so we don't have to store the sign
+    float sign = q[largest] < 0.0f ? -1.0f : 1.0f;
+    for (int i = 0, j = 0; i < 4; i++)
+    {
+        if (i == largest) continue;
+        // other components are between -1/sqrt(2) and 1/sqrt(2)
+        float norm = Clamp01(q[i] * sign * 0.70710678f + 0.5f);
+        out[j++] = (ushort)(norm * 32767.0f + 0.5f);
+    }
+    out[0] |= (ushort)((largest & 1) << 15);
+    out[1] |= (ushort)((largest >> 1) << 15);
+}
+
+static void EncodeTranslationKeys(char* out, const Vector4x32f* keys, int count)
+{
+    float minv[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, maxv[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    for (int i = 0; i < count; i++)
+    {
+        float key[4];
+        VecStore(key, keys[i]);
+        for (int c = 0; c < 3; c++)
+            minv[c] = MIN(minv[c], key[c]), maxv[c] = MAX(maxv[c], key[c]);
+    }
+
+    float* range = (float*)out;
+    ushort* quantized = (ushort*)(range + 6);
+    for (int c = 0; c < 3; c++)
+        range[c] = minv[c], range[c + 3] = maxv[c] - minv[c];
+
+    for (int i = 0; i < count; i++)
+    {
+        float key[4];
+        VecStore(key, keys[i]);
+        for (int c = 0; c < 3; c++)
+        {
+            float norm = range[c + 3] > 1e-9f ? (key[c] - minv[c]) / range[c + 3] : 0.0f;
+            quantized[i * 3 + c] = (ushort)(Clamp01(norm) * 65535.0f + 0.5f);
+        }
+    }
+}
+
+// reduces and quantizes the keyframes of all animation samplers, 
+// all of the sampler inputs and outputs are allocated in one buffer each
+static void CompressAnimationSamplers(SceneBundle* gltf)
+{
+    int totalSamplerInput = 0, maxSamplerInput = 0;
+    for (int a = 0; a < gltf->numAnimations; a++)
+        for (int s = 0; s < gltf->animations[a].numSamplers; s++)
+        {
+            totalSamplerInput += gltf->animations[a].samplers[s].count;
+            maxSamplerInput = MAX(maxSamplerInput, gltf->animations[a].samplers[s].count);
+        }
+    
+    Vector4x32f* keys = new Vector4x32f[maxSamplerInput]{};
+    float* times = new float[maxSamplerInput];
+
+    // reduce keys first, so we know the size of the buffers
+    float* reducedTimes = new float[totalSamplerInput];
+    Vector4x32f* reducedKeys = new Vector4x32f[totalSamplerInput];
+    int totalReduced = 0, totalOutputSize = 0;
+
+    for (int a = 0; a < gltf->numAnimations; a++)
+    {
+        for (int s = 0; s < gltf->animations[a].numSamplers; s++)
+        {
+            AAnimSampler& sampler = gltf->animations[a].samplers[s];
+            SmallMemCpy(times, sampler.input, sampler.count * sizeof(float));
+            float minv[4] = { FLT_MAX, FLT_MAX, FLT_MAX, FLT_MAX }, maxv[4] = { -FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+            for (int i = 0; i < sampler.count; i++)
+            {
+                const float* src = sampler.output + (i * sampler.numComponent);
+                float key[4] = {};
+                SmallMemCpy(key, src, sizeof(float) * MIN(sampler.numComponent, 4));
+                keys[i] = VecLoad(key);
+                for (int c = 0; c < 3; c++)
+                    minv[c] = MIN(minv[c], key[c]), maxv[c] = MAX(maxv[c], key[c]);
+            }
+
+            float tolerance = AnimRotationTolerance;
+            if (sampler.numComponent != 4) {
+                float extent = MAX(MAX(maxv[0] - minv[0], maxv[1] - minv[1]), maxv[2] - minv[2]);
+                tolerance = MAX(extent, 1e-4f) * AnimTranslationTolerance;
+            }
+
+            int numKeys = ReduceKeyframes(keys, times, sampler.count, sampler.numComponent, tolerance);
+            SmallMemCpy(reducedTimes + totalReduced, times, numKeys * sizeof(float));
+            SmallMemCpy(reducedKeys  + totalReduced, keys, numKeys * sizeof(Vector4x32f));
+            
+            sampler.count = numKeys; // input and output pointers are set below
+            totalReduced += numKeys;
+            totalOutputSize += GetCookedSamplerSize(numKeys, sampler.numComponent);
+        }
+    }
+
+    float* samplerInput = new float[totalReduced];
+    SmallMemCpy(samplerInput, reducedTimes, totalReduced * sizeof(float));
+    // allocated as vector array because Scene::Destroy deletes it as vector array
+    Vector4x32f* samplerOutput = new Vector4x32f[(totalOutputSize + 15) / 16]{};
+    char* currOutput = (char*)samplerOutput;
+    int currInput = 0;
+
+    for (int a = 0; a < gltf->numAnimations; a++)
+    {
+        for (int s = 0; s < gltf->animations[a].numSamplers; s++)
+        {
+            AAnimSampler& sampler = gltf->animations[a].samplers[s];
+            const Vector4x32f* samplerKeys = reducedKeys + currInput;
+            
+            if (sampler.numComponent == 4) {
+                for (int i = 0; i < sampler.count; i++)
+                    EncodeRotationKey((ushort*)currOutput + i * 3, samplerKeys[i]);
+            }
+            else {
+                EncodeTranslationKeys(currOutput, samplerKeys, sampler.count);
+            }
+
+            sampler.input  = samplerInput + currInput;
+            sampler.output = (float*)currOutput;
+            currInput  += sampler.count;
+            currOutput += GetCookedSamplerSize(sampler.count, sampler.numComponent);
+        }
+    }
+
+    AX_LOG("animation keys reduced from %i to %i, %i bytes", totalSamplerInput, totalReduced, totalOutputSize);
+
+    delete[] keys;
+    delete[] times;
+    delete[] reducedTimes;
+    delete[] reducedKeys;
+}
+
 /*//////////////////////////////////////////////////////////////////////////*/
 /*                            Vertex Load                                   */
 /*//////////////////////////////////////////////////////////////////////////*/
@@ -637,33 +825,7 @@ void CreateVerticesIndicesSkined(SceneBundle* gltf)
 
     if (gltf->numAnimations)
     {
-        int totalSamplerInput = 0;
-        for (int a = 0; a < gltf->numAnimations; a++)
-            for (int s = 0; s < gltf->animations[a].numSamplers; s++)
-                totalSamplerInput += gltf->animations[a].samplers[s].count;
-        
-        float* currSampler = new float[totalSamplerInput]{};
-        Vector4x32f* currOutput  = new Vector4x32f[totalSamplerInput]{};
-
-        for (int a = 0; a < gltf->numAnimations; a++)
-        {
-            for (int s = 0; s < gltf->animations[a].numSamplers; s++)
-            {
-                AAnimSampler& sampler = gltf->animations[a].samplers[s];
-                SmallMemCpy(currSampler, sampler.input, sampler.count * sizeof(float));
-                sampler.input = currSampler;
-                currSampler += sampler.count;
-
-                for (int i = 0; i < sampler.count; i++)
-                {
-                    SmallMemCpy(currOutput + i, sampler.output + (i * sampler.numComponent), sizeof(float) * sampler.numComponent);
-                    // currOutput[i] = VecLoad(sampler.output + (i * sampler.numComponent));
-                    // if (sampler.numComponent == 3) currOutput[i] = VecSetW(currOutput[i], 0.0f);
-                }
-                sampler.output = (float*)currOutput;
-                currOutput += sampler.count;
-            }
-        }
+        CompressAnimationSamplers(gltf);
     }
 
     FreeGLTFBuffers(gltf);
@@ -675,7 +837,7 @@ void CreateVerticesIndicesSkined(SceneBundle* gltf)
 /*//////////////////////////////////////////////////////////////////////////*/
 
 ZSTD_CCtx* zstdCompressorCTX = nullptr;
-const int ABMMeshVersion = 42;
+const int ABMMeshVersion = 45;
 
 bool IsABMLastVersion(const char* path)
 {
@@ -709,7 +871,7 @@ static void WriteGLTFString(const char* str, AFile file)
     if (str) AFileWrite(str, nameLen + 1, file);
 }
 
-int SaveGLTFBinary(SceneBundle* gltf, const char* path)
+int SaveGLTFBinary(SceneBundle* gltf, const char* path, const BakedAnimations* bake)
 {
 #if !AX_GAME_BUILD
     AFile file = AFileOpen(path, AOpenFlag_WriteBinary);
@@ -870,19 +1032,25 @@ int SaveGLTFBinary(SceneBundle* gltf, const char* path)
         AFileWrite(skin.joints, sizeof(int) * skin.numJoints, file);
     }
     
-    int totalAnimSamplerInput = 0;
+    int totalAnimSamplerInput = 0, totalAnimSamplerOutput = 0;
     if (gltf->numAnimations > 0)
     {
         for (int a = 0; a < gltf->numAnimations; a++)
             for (int s = 0; s < gltf->animations[a].numSamplers; s++)
-                totalAnimSamplerInput += gltf->animations[a].samplers[s].count;
+            {
+                AAnimSampler& sampler = gltf->animations[a].samplers[s];
+                totalAnimSamplerInput  += sampler.count;
+                totalAnimSamplerOutput += GetCookedSamplerSize(sampler.count, sampler.numComponent);
+            }
     }
 
     AFileWrite(&totalAnimSamplerInput, sizeof(int), file);
+    AFileWrite(&totalAnimSamplerOutput, sizeof(int), file);
     if (totalAnimSamplerInput > 0) {
         // all sampler input and outputs are allocated in one buffer each. at the end of the CreateVerticesIndicesSkined function
+        // outputs are compressed, see: CompressAnimationSamplers
         AFileWrite(gltf->animations[0].samplers[0].input, sizeof(float) * totalAnimSamplerInput, file);
-        AFileWrite(gltf->animations[0].samplers[0].output, sizeof(Vector4x32f) * totalAnimSamplerInput, file);
+        AFileWrite(gltf->animations[0].samplers[0].output, totalAnimSamplerOutput, file);
     }
 
     for (int i = 0; i < gltf->numAnimations; i++)
@@ -903,6 +1071,24 @@ int SaveGLTFBinary(SceneBundle* gltf, const char* path)
             AFileWrite(&animation.samplers[j].interpolation, sizeof(float), file);
         }
     }
+
+    // baked animations
+    int numBakedClips = bake ? bake->numClips : 0;
+    AFileWrite(&numBakedClips, sizeof(int), file);
+    if (numBakedClips > 0)
+    {
+        AFileWrite(&bake->numJoints, sizeof(int), file);
+        AFileWrite(&bake->totalFrames, sizeof(int), file);
+        AFileWrite(bake->clips, sizeof(BakedClip) * numBakedClips, file);
+
+        uint64_t palettesSize = sizeof(Matrix3x4f16) * bake->numJoints * bake->totalFrames;
+        uint64_t bound = ZSTD_compressBound(palettesSize);
+        char* compressedPalettes = new char[bound];
+        uint64_t compressedPalettesSize = ZSTD_compress(compressedPalettes, bound, bake->palettes, palettesSize, 5);
+        AFileWrite(&compressedPalettesSize, sizeof(uint64_t), file);
+        AFileWrite(compressedPalettes, compressedPalettesSize, file);
+        delete[] compressedPalettes;
+    }
     
     AFileClose(file);
 #endif
@@ -936,7 +1122,7 @@ void ReadGLTFString(char*& str, AFile file, FixedSizeGrowableAllocator<char>& st
     }
 }
 
-int LoadSceneBundleBinary(const char* path, SceneBundle* gltf)
+int LoadSceneBundleBinary(const char* path, SceneBundle* gltf, BakedAnimations* bakeOut)
 {
     AFile file = AFileOpen(path, AOpenFlag_ReadBinary);
     if (!AFileExist(file))
@@ -1144,16 +1330,18 @@ int LoadSceneBundleBinary(const char* path, SceneBundle* gltf)
         AFileRead(skin.joints, sizeof(int) * skin.numJoints, file);
     }
 
-    int totalAnimSamplerInput = 0;
+    int totalAnimSamplerInput = 0, totalAnimSamplerOutput = 0;
     AFileRead(&totalAnimSamplerInput, sizeof(int), file);
+    AFileRead(&totalAnimSamplerOutput, sizeof(int), file);
     float* currSamplerInput;
-    Vector4x32f* currSamplerOutput;
+    char* currSamplerOutput;
 
     if (totalAnimSamplerInput) {
         currSamplerInput = new float[totalAnimSamplerInput]{};
-        currSamplerOutput = new Vector4x32f[totalAnimSamplerInput]{};
+        // allocated as vector array because Scene::Destroy deletes it as vector array
+        currSamplerOutput = (char*)new Vector4x32f[(totalAnimSamplerOutput + 15) / 16]{};
         AFileRead(currSamplerInput, sizeof(float) * totalAnimSamplerInput, file);
-        AFileRead(currSamplerOutput, sizeof(Vector4x32f) * totalAnimSamplerInput, file);
+        AFileRead(currSamplerOutput, totalAnimSamplerOutput, file);
     }
 
     if (gltf->numAnimations) gltf->animations = new AAnimation[gltf->numAnimations]{};
@@ -1179,7 +1367,33 @@ int LoadSceneBundleBinary(const char* path, SceneBundle* gltf)
             animation.samplers[j].input = currSamplerInput;
             animation.samplers[j].output = (float*)currSamplerOutput;
             currSamplerInput += count;
-            currSamplerOutput += count;
+            currSamplerOutput += GetCookedSamplerSize(count, animation.samplers[j].numComponent);
+        }
+    }
+
+    int numBakedClips = 0;
+    AFileRead(&numBakedClips, sizeof(int), file);
+    if (numBakedClips > 0 && bakeOut != nullptr)
+    {
+        bakeOut->numClips = numBakedClips;
+        AFileRead(&bakeOut->numJoints, sizeof(int), file);
+        AFileRead(&bakeOut->totalFrames, sizeof(int), file);
+        bakeOut->clips = new BakedClip[numBakedClips];
+        AFileRead(bakeOut->clips, sizeof(BakedClip) * numBakedClips, file);
+
+        uint64_t palettesSize = sizeof(Matrix3x4f16) * bakeOut->numJoints * bakeOut->totalFrames;
+        uint64_t compressedPalettesSize;
+        AFileRead(&compressedPalettesSize, sizeof(uint64_t), file);
+        char* compressedPalettes = new char[compressedPalettesSize];
+        AFileRead(compressedPalettes, compressedPalettesSize, file);
+        bakeOut->palettes = new Matrix3x4f16[bakeOut->numJoints * bakeOut->totalFrames];
+        uint64_t result = ZSTD_decompress(bakeOut->palettes, palettesSize, compressedPalettes, compressedPalettesSize);
+        delete[] compressedPalettes;
+
+        // baked animations are optional, continue without them
+        if (ZSTD_isError(result) || result != palettesSize) {
+            AX_WARN("baked animation decompression failed %s %s", path, ZSTD_isError(result) ? ZSTD_getErrorName(result) : "size mismatch");
+            FreeBakedAnimations(bakeOut);
         }
     }
 
@@ -4,6 +4,7 @@
 #include "include/SceneRenderer.hpp"
 #include "include/Camera.hpp"
 #include "include/UI.hpp"
+#include "include/TLAS.hpp"
 #include <stdio.h>
 
 #include "../ASTL/String.hpp" // StringEqual
@@ -27,8 +28,7 @@ void CharacterController::Start(Prefab* _character)
     mCharacter  = _character;
     mTouchStart = Vec2(0.0f, 0.0f);
     // we don't need to set zero the poses
-    constexpr size_t poseSize = sizeof(AnimationController::mAnimPoseA) * 4 
-                              + sizeof(AnimationController::mBoneMatrices) + sizeof(AnimationController::mOutMatrices);
+    constexpr size_t poseSize = sizeof(AnimationController::mAnimPoseA) * 8 + sizeof(AnimationController::mBoneMatrices);
     MemsetZero(&mAnimController, sizeof(AnimationController) - poseSize);
     CreateAnimationController(_character, &mAnimController, true, 58);
     mRandomState = Random::Seed32();
@@ -44,6 +44,8 @@ void CharacterController::Start(Prefab* _character)
     mIdleTime       = 0.0f;
     mLastInputAngle = 0.0f;
     mSwordSlashDelay = -1.0f;
+    mPlayKickHuh = mPlaySwordSlash = false;
+    mAttackPressed = mKickPressed = mImpactPressed = false;
 
     mRootNodeIdx = Prefab::FindAnimRootNodeIndex(_character);
     mPosPtr = _character->nodes[mRootNodeIdx].translation;
@@ -99,6 +101,76 @@ void CharacterController::Start(Prefab* _character)
     mAnimController.SetAnim(aLeft  , -1, a_jog_forward); //a_diagonal_left);
     mAnimController.SetAnim(aMiddle, -1, a_jog_backward);
     mAnimController.SetAnim(aRight , -1, a_jog_forward);//a_diagonal_right);
+
+    // only skinned primitives are selected, attachments that are not skinned use the node transforms
+    const PrimitiveBounds& bounds = _character->worldBounds;
+    int totalVertices = 0;
+    mSkinJobs.Resize(0);
+    mSkinBoundIndices.Resize(0);
+    for (int i = 0; i < bounds.numPrimitives; i++)
+    {
+        const APrimitive& primitive = _character->meshes[_character->nodes[bounds.nodeIndices[i]].index].primitives[bounds.primitiveIndices[i]];
+        if (!EnumHasBit(primitive.attributes, AAttribType_JOINTS) || primitive.numVertices == 0)
+            continue;
+
+        SkinningJob job = { (const ASkinedVertex*)primitive.vertices, primitive.numVertices, nullptr, nullptr };
+        mSkinJobs.Add(job);
+        mSkinBoundIndices.Add(i);
+        totalVertices += primitive.numVertices;
+    }
+
+    // outputs are set after all of the jobs are added, array might be reallocated
+    mSkinnedPositions.Resize(totalVertices);
+    mSkinnedBounds.Resize(mSkinJobs.Size() * 2);
+    for (int i = 0, offset = 0; i < mSkinJobs.Size(); i++)
+    {
+        mSkinJobs[i].outPositions = mSkinnedPositions.Data() + offset;
+        offset += mSkinJobs[i].numVertices;
+    }
+    mHasSkinnedBounds = false;
+}
+
+void CharacterController::UpdateSkinnedBounds()
+{
+    if (mSkinJobs.Size() == 0) 
+        return;
+
+    // mesh space, node transform is applied by ApplySkinnedBounds because node moves in SyncWithRenderer
+    SkinPrimitives(&mAnimController, Matrix4::Identity(), mSkinJobs.Data(), mSkinJobs.Size());
+
+    for (int i = 0; i < mSkinJobs.Size(); i++)
+    {
+        const SkinningJob& job = mSkinJobs[i];
+        Vector3f vmin = job.outPositions[0], vmax = job.outPositions[0];
+        for (int v = 1; v < job.numVertices; v++)
+        {
+            const Vector3f& p = job.outPositions[v];
+            vmin.x = MIN(vmin.x, p.x); vmin.y = MIN(vmin.y, p.y); vmin.z = MIN(vmin.z, p.z);
+            vmax.x = MAX(vmax.x, p.x); vmax.y = MAX(vmax.y, p.y); vmax.z = MAX(vmax.z, p.z);
+        }
+        mSkinnedBounds[i * 2 + 0] = vmin;
+        mSkinnedBounds[i * 2 + 1] = vmax;
+    }
+    mHasSkinnedBounds = true;
+}
+
+void CharacterController::ApplySkinnedBounds()
+{
+    if (!mHasSkinnedBounds)
+        return;
+
+    PrimitiveBounds& bounds = mCharacter->worldBounds;
+    for (int i = 0; i < mSkinJobs.Size(); i++)
+    {
+        int index = mSkinBoundIndices[i];
+        const Vector3f& vmin = mSkinnedBounds[i * 2 + 0];
+        const Vector3f& vmax = mSkinnedBounds[i * 2 + 1];
+        SetPrimitiveBounds(&bounds, index, VecSetR(vmin.x, vmin.y, vmin.z, 1.0f), VecSetR(vmax.x, vmax.y, vmax.z, 1.0f), 
+                           mCharacter->globalNodeTransforms[bounds.nodeIndices[index]]);
+    }
+
+    if (mCharacter->tlas) 
+        mCharacter->tlas->Refit();
 }
 
 void CharacterController::ColissionDetection(Vector3f oldPos)
@@ -138,20 +210,20 @@ void CharacterController::RespondInput()
 
     if (GetKeyPressed(Key_SPACE)) {
         if (mAnimController.TriggerAnim(mJumpIndex, 0.0f, 0.0f, 0))
-            SoundPlay(mKickHuhSound);
+            mPlayKickHuh = true;
     }
 
     if (GetKeyPressed('F')) {
         if (mAnimController.TriggerAnim(mKickIndex, 0.0f, 0.0f, 0)) {
             mCurrentMovement = Vector2f::Zero();
-            SoundPlay(mKickHuhSound);
+            mPlayKickHuh = true;
         }
     }
 
     if (GetKeyPressed('C')) {
         if (mAnimController.TriggerAnim(mImpactIndex, 0.5f, 0.35f, 0)) {
             mCurrentMovement = Vector2f::Zero();
-            SoundPlay(mKickHuhSound);
+            mPlayKickHuh = true;
         }
     }
 
@@ -160,33 +232,45 @@ void CharacterController::RespondInput()
             mCurrentMovement = Vector2f::Zero();
     }
 #else
+    // buttons are hit tested on the main thread, see: UpdateButtons
+    if (mAttackPressed) {
+        if (mAnimController.TriggerAnim(mAtackIndex, 0.0f, 0.0f, eAnimTriggerOpt_Standing))
+            mPlaySwordSlash = true;
+    }
+
+    if (mKickPressed) {
+        if (mAnimController.TriggerAnim(mKickIndex, 0.0f, 0.0f, 0))
+            mPlayKickHuh = true;
+    }
+
+    if (mImpactPressed) {
+        if (mAnimController.TriggerAnim(mImpactIndex, 0.5f, 0.35f, 0))
+            mPlayKickHuh = true;
+    }
+#endif
+}
+
+void CharacterController::UpdateButtons()
+{
+    mAttackPressed = mKickPressed = mImpactPressed = false;
+#ifdef PLATFORM_ANDROID
+    if (!mControlling) return;
+
     Vector2f pos = { 1731.0f, 840.0f };
     const float buttonSize = 40.0f;
     const float buttonPadding = 120.0f;
     constexpr uint effect = uFadeBit | uEmptyInsideBit | uFadeInvertBit | uIntenseFadeBit;
     uCircle(pos, buttonSize, ~0, effect);
-    if (uClickCheckCircle(pos, buttonSize))
-    {
-        if (mAnimController.TriggerAnim(mAtackIndex, 0.0f, 0.0f, eAnimTriggerOpt_Standing))
-            SoundPlay(mSwordSlashSound);
-    }
+    mAttackPressed = uClickCheckCircle(pos, buttonSize);
 
     pos.x -= buttonPadding;
     uCircle(pos, buttonSize, ~0, effect);
-    if (uClickCheckCircle(pos, buttonSize))
-    {
-        if (mAnimController.TriggerAnim(mKickIndex, 0.0f, 0.0f, 0))
-            SoundPlay(mKickHuhSound);
-    }
+    mKickPressed = uClickCheckCircle(pos, buttonSize);
 
     pos.x += buttonPadding;
     pos.y -= buttonPadding;
     uCircle(pos, buttonSize, ~0, effect);
-    if (uClickCheckCircle(pos, buttonSize))
-    {
-        if (mAnimController.TriggerAnim(mImpactIndex, 0.5f, 0.35f, 0))
-            SoundPlay(mKickHuhSound);
-    }
+    mImpactPressed = uClickCheckCircle(pos, buttonSize);
 #endif
 }
 
@@ -197,9 +281,8 @@ void CharacterController::TurningState()
     if (!mAnimController.IsTrigerred())
     {
         // turning animation ended
-        CameraBase* camera = SceneRenderer::GetCamera();
         // angle we have turned + camera look angle
-        float x = camera->yaw * -TwoPI;
+        float x = mCameraYaw * -TwoPI;
         mRotation = QFromYAngle(x - mTurnRotation + PI);
 
         mCurrentMovement.y = Sin(mTurnRotation + HalfPI);
@@ -269,7 +352,8 @@ void CharacterController::MovementState(bool isSponza)
     if (Abs(animX) > Abs(animY)) animY = animX;
 
     bool isRunning = GetKeyDown(Key_SHIFT);
-    mAnimController.EvaluateLocomotion(animX, animY, isRunning ? animSpeed * 1.5f : animSpeed);
+    // character is rotated towards the input, so it always moves forward. only the middle column of the grid is used
+    mAnimController.EvaluateLocomotion(0.0f, Abs(animY), isRunning ? animSpeed * 1.5f : animSpeed);
     targetMovement *= float(isRunning) + 1.0f;
     
     const float smoothTime = 0.25f;
@@ -277,9 +361,8 @@ void CharacterController::MovementState(bool isSponza)
     mCurrentMovement.y = SmoothDamp(mCurrentMovement.y, targetMovement.y, mSpeedSmoothVelocity, smoothTime, 9999.0f, deltaTime); // Lerp(mCurrentMovement.y, targetMovement.y, acceleration * deltaTime);
     mCurrentMovement.x = Lerp(mCurrentMovement.x, targetMovement.x, 4.0f * deltaTime);
 
-    CameraBase* camera = SceneRenderer::GetCamera();
     // angle of user input, (keyboard or joystick)
-    float x = camera->yaw * -TwoPI;
+    float x = mCameraYaw * -TwoPI;
     float inputAngle = ATan2(targetMovement.y, Clamp(targetMovement.x, -1.0f, 1.0f));
     float movementValue = targetMovement.LengthSquared();
     if (movementValue < 0.001f) inputAngle = 0.0f;
@@ -311,7 +394,6 @@ void CharacterController::MovementState(bool isSponza)
     
     mPosition.y = 0.0f; // GetTerrainHeight(mPosition);
     // animatedPos.y = 8.15f; // if you want to walk on top floor
-    camera->targetPos = mPosition;
     mNonStopDuration += float(Abs(movementAmount) < 0.002f) * deltaTime;
     mNonStopDuration *= Abs(movementAmount) < 0.002f; 
     if (mNonStopDuration > 0.15f) {
@@ -379,9 +461,7 @@ void CharacterController::HandleNeckAndSpineRotation(float deltaTime)
 {
     if (!mAnimController.IsTrigerred()) 
     {
-        CameraBase* camera = SceneRenderer::GetCamera();
-        
-        float neckYTarget = -mLastInputAngle + camera->yaw * -TwoPI;
+        float neckYTarget = -mLastInputAngle + mCameraYaw * -TwoPI;
         const float yMinAngle = -PI / 3.0f, yMaxAngle = PI / 3.0f;
         // take differance of character forward direction and camera direction
         neckYTarget = Clamp(neckYTarget - mOldInputAngle, yMinAngle, yMaxAngle);
@@ -391,8 +471,8 @@ void CharacterController::HandleNeckAndSpineRotation(float deltaTime)
         mAnimController.mSpineYAngle = Lerp(mAnimController.mSpineYAngle, neckYTarget * 0.5f, deltaTime * rotateSpeed);
         
         const float neckMaxXAngle = 1.25f, spineMaxAngle = 1.85f;
-        mAnimController.mNeckXAngle  = Lerp(mAnimController.mNeckXAngle, camera->pitch * neckMaxXAngle, deltaTime * rotateSpeed);
-        mAnimController.mSpineXAngle = Lerp(mAnimController.mSpineXAngle, camera->pitch * spineMaxAngle, deltaTime * rotateSpeed);
+        mAnimController.mNeckXAngle  = Lerp(mAnimController.mNeckXAngle, mCameraPitch * neckMaxXAngle, deltaTime * rotateSpeed);
+        mAnimController.mSpineXAngle = Lerp(mAnimController.mSpineXAngle, mCameraPitch * spineMaxAngle, deltaTime * rotateSpeed);
     }
     else 
     {
@@ -414,13 +494,10 @@ void CharacterController::Update(float deltaTime, bool isSponza)
 
     if (!mControlling) return;
 
-    SmallMemCpy(mPosPtr, &mStartPos.x, sizeof(Vector3f));
-    VecStore(mRotPtr, mStartRotation);
-
     HandleNeckAndSpineRotation(deltaTime);
 
     if (mSwordSlashDelay >= 0.0f && (mSwordSlashDelay += deltaTime) > 0.45f)
-        SoundPlay(mSwordSlashSound), mSwordSlashDelay = -1.0f;
+        mPlaySwordSlash = true, mSwordSlashDelay = -1.0f;
 
     switch (mState)
     {
@@ -430,17 +507,41 @@ void CharacterController::Update(float deltaTime, bool isSponza)
     };
 
     RespondInput();
+    UpdateSkinnedBounds();
+
+    // char test[512] = {};
+    // sprintf_s(test, 512, "x: %f, y: %f, z: %f", mPosition.x, mPosition.y, mPosition.z);
+    // uText(test, Vector2f(500.0f));
+}
+
+void CharacterController::SyncWithRenderer()
+{
+    CameraBase* camera = SceneRenderer::GetCamera();
+    mCameraYaw   = camera->yaw;
+    mCameraPitch = camera->pitch;
+
+    if (mAnimController.mLodScreenSize >= 0.0f)
+        mAnimController.SetLODFromScreenSize(mAnimController.mLodScreenSize);
+
+    // sound system is not thread safe, play the sounds that are requested by the last simulation step
+    if (mPlaySwordSlash) SoundPlay(mSwordSlashSound);
+    if (mPlayKickHuh)    SoundPlay(mKickHuhSound);
+    mPlaySwordSlash = mPlayKickHuh = false;
+
+    UpdateButtons();
+
+    if (!mControlling) return;
 
     VecStore(mRotPtr, mRotation);
     // set animated pos for the renderer
     SmallMemCpy(mPosPtr, &mPosition.x, sizeof(Vector3f));
     mCharacter->UpdateGlobalNodeTransforms(mRootNodeIdx, Matrix4::Identity());
+    mCharacter->UpdateWorldBounds();
+    ApplySkinnedBounds();
 
+    if (mState == eCharacterControllerState_Movement)
+        camera->targetPos = mPosition;
     SceneRenderer::SetCharacterPos(mPosition.x, mPosition.y, mPosition.z);
-
-    // char test[512] = {};
-    // sprintf_s(test, 512, "x: %f, y: %f, z: %f", mPosition.x, mPosition.y, mPosition.z);
-    // uText(test, Vector2f(500.0f));
 }
 
 void CharacterController::Destroy()
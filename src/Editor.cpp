@@ -8,6 +8,7 @@
 
 #include "include/Scene.hpp"
 #include "include/SceneRenderer.hpp"
+#include "include/AssetManager.hpp"
 #include "include/Camera.hpp"
 #include "include/UI.hpp"
 #include "include/BVH.hpp"
@@ -111,18 +112,18 @@ void EditorInit()
         "Assets/Textures/Icons/mesh.png",
         "Assets/Textures/Icons/image_file.png"
     };
-    mSearchIcon = rImportTexture("Assets/Textures/Icons/magnifying-glass.png");
+    mSearchIcon = ImportSharedTexture("Assets/Textures/Icons/magnifying-glass.png");
 
     for (int i = 0; i < FileType_NumFileTypes; i++)
-        mFileIcons[i] = rImportTexture(FileIconFolders[i]);
+        mFileIcons[i] = ImportSharedTexture(FileIconFolders[i]);
 }
 
 void EditorDestroy()
 { 
     for (int i = 0; i < FileType_NumFileTypes; i++)
-        rDeleteTexture(mFileIcons[i]);
+        ReleaseTexture(mFileIcons[i]);
 
-    rDeleteTexture(mSearchIcon);
+    ReleaseTexture(mSearchIcon);
     // delete[] isNodeOpenArray;
 }
 
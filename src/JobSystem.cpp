@@ -0,0 +1,180 @@
+/******************************************************************************************
+*  Purpose:                                                                               *
+*    Persistent Worker Threads That Are Executing Jobs From a Shared Queue               *
+*  Good To Know:                                                                          *
+*    Threads are created once in InitJobSystem, workers sleep on a condition variable     *
+*    when the queue is empty. Waiting thread executes the jobs of the counter that it     *
+*    waits instead of sleeping, so a job can wait for other jobs without deadlock         *
+*  Author:                                                                                *
+*    Anilcan Gulkaya 2024 anilcangulkaya7@gmail.com github @benanil                       *
+*******************************************************************************************/
+
+#include "include/JobSystem.hpp"
+
+#include "../ASTL/Common.hpp"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+struct Job
+{
+    JobFn      fn;      // either fn or rangeFn is used
+    JobRangeFn rangeFn;
+    void*      data;
+    int        task, begin, end;
+    JobCounter* counter;
+};
+
+constexpr int MaxWorkers = 15;
+constexpr int MaxQueuedJobs = 256;
+constexpr int MaxParallelTasks = 16;
+
+static std::thread g_Workers[MaxWorkers];
+static int g_NumWorkers = 0;
+
+// ring buffer, protected by the mutex
+static std::mutex g_JobMutex;
+static std::condition_variable g_JobCondition;
+static Job  g_Jobs[MaxQueuedJobs];
+static int  g_JobHead = 0, g_NumQueuedJobs = 0;
+static bool g_JobSystemRunning = false;
+
+static void ExecuteJob(const Job& job)
+{
+    if (job.fn) job.fn(job.data);
+    else        job.rangeFn(job.data, job.task, job.begin, job.end);
+    job.counter->numJobs.fetch_sub(1, std::memory_order_release);
+}
+
+static void WorkerMain()
+{
+    while (true)
+    {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(g_JobMutex);
+            g_JobCondition.wait(lock, [] { return g_NumQueuedJobs > 0 || !g_JobSystemRunning; });
+
+            if (g_NumQueuedJobs == 0)
+                return; // shutting down
+
+            job = g_Jobs[g_JobHead];
+            g_JobHead = (g_JobHead + 1) % MaxQueuedJobs;
+            g_NumQueuedJobs--;
+        }
+        ExecuteJob(job);
+    }
+}
+
+static void PushJob(const Job& job)
+{
+    job.counter->numJobs.fetch_add(1, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lock(g_JobMutex);
+        // no workers or queue is full, execute on this thread
+        if (g_NumWorkers > 0 && g_NumQueuedJobs < MaxQueuedJobs)
+        {
+            g_Jobs[(g_JobHead + g_NumQueuedJobs) % MaxQueuedJobs] = job;
+            g_NumQueuedJobs++;
+            g_JobCondition.notify_one();
+            return;
+        }
+    }
+    ExecuteJob(job);
+}
+
+// pops one of the queued jobs of the counter, other jobs are not executed because they might be long (simulation)
+static bool TryExecuteJobOf(JobCounter* counter)
+{
+    Job job;
+    {
+        std::lock_guard<std::mutex> lock(g_JobMutex);
+        int found = -1;
+        for (int i = 0; i < g_NumQueuedJobs; i++)
+        {
+            if (g_Jobs[(g_JobHead + i) % MaxQueuedJobs].counter == counter) {
+                found = (g_JobHead + i) % MaxQueuedJobs;
+                break;
+            }
+        }
+        if (found == -1)
+            return false;
+
+        // move the head to the empty slot, order of the jobs is not important
+        job = g_Jobs[found];
+        g_Jobs[found] = g_Jobs[g_JobHead];
+        g_JobHead = (g_JobHead + 1) % MaxQueuedJobs;
+        g_NumQueuedJobs--;
+    }
+    ExecuteJob(job);
+    return true;
+}
+
+void InitJobSystem()
+{
+    if (g_JobSystemRunning) return;
+    int numCores = (int)std::thread::hardware_concurrency();
+    g_NumWorkers = MIN(MAX(numCores - 1, 0), MaxWorkers);
+    g_JobSystemRunning = true;
+
+    for (int i = 0; i < g_NumWorkers; i++)
+    {
+        g_Workers[i] = std::thread(WorkerMain);
+    }
+}
+
+void DestroyJobSystem()
+{
+    {
+        std::lock_guard<std::mutex> lock(g_JobMutex);
+        g_JobSystemRunning = false;
+    }
+    g_JobCondition.notify_all();
+
+    // workers finish the queued jobs before returning
+    for (int i = 0; i < g_NumWorkers; i++)
+    {
+        g_Workers[i].join();
+    }
+    g_NumWorkers = 0;
+}
+
+int GetNumJobThreads()
+{
+    return g_NumWorkers + 1;
+}
+
+int ParallelRange(JobRangeFn fn, void* data, int count, int numTasks)
+{
+    numTasks = MAX(MIN(MIN(numTasks, count), MaxParallelTasks), 1);
+    if (numTasks == 1) {
+        fn(data, 0, 0, count);
+        return 1;
+    }
+
+    JobCounter counter;
+    int perTask = count / numTasks;
+    for (int i = 0; i < numTasks - 1; i++)
+    {
+        PushJob({ nullptr, fn, data, i, i * perTask, (i + 1) * perTask, &counter });
+    }
+    // calling thread executes the last part, it also takes the remaining elements
+    fn(data, numTasks - 1, (numTasks - 1) * perTask, count);
+    WaitJobs(&counter);
+    return numTasks;
+}
+
+void RunJobAsync(JobFn fn, void* data, JobCounter* counter)
+{
+    PushJob({ fn, nullptr, data, 0, 0, 0, counter });
+}
+
+void WaitJobs(JobCounter* counter)
+{
+    while (counter->numJobs.load(std::memory_order_acquire) > 0)
+    {
+        if (!TryExecuteJobOf(counter))
+            std::this_thread::yield();
+    }
+}
@@ -0,0 +1,368 @@
+
+/******************************************************************************************
+*  Purpose:                                                                               *
+*    Software Occlusion Culling, Rasterizes Big Primitives Into Low Resolution Depth       *
+*    Buffer, Bounds of the Primitives Tested Against It Before Drawing                    *
+*  Good To Know:                                                                          *
+*    Rows of the depth buffer are split between jobs, each job rasterizes all of the      *
+*    occluder triangles that are touching its rows, so jobs never write the same pixel.   *
+*    after rasterization each job computes the farthest depth of its 8x8 tiles            *
+*    4 pixels of a row are rasterized at once with edge functions                         *
+*    Depth is ndc z in [0, 1], smaller is closer                                          *
+*    Occluders are rasterized conservatively, only pixels fully covered by the triangle   *
+*    are written with the farthest depth of the pixel, so culling never has false hits    *
+*  Author:                                                                                *
+*    Anilcan Gulkaya 2024 anilcangulkaya7@gmail.com github @benanil                       *
+*******************************************************************************************/
+
+#include "include/OcclusionCulling.hpp"
+#include "include/Scene.hpp"
+#include "include/UI.hpp"
+#include "include/JobSystem.hpp"
+
+#include "../ASTL/Array.hpp"
+
+constexpr int OcclusionTilesX = OcclusionWidth  / OcclusionTileSize;
+constexpr int OcclusionTilesY = OcclusionHeight / OcclusionTileSize;
+
+// primitives that have more triangles than this are not used as occluders,
+// they are expensive to rasterize and usually they are detailed props instead of walls
+constexpr int MaxOccluderTriangles  = 4096;
+constexpr int MaxTrianglesPerFrame  = 1 << 16;
+constexpr float MinOccluderScreenSize = OcclusionHeight * 0.25f; // in occlusion buffer pixels
+constexpr float OcclusionNearW = 0.001f;
+constexpr float OcclusionDepthBias = 0.0005f; // tested boxes are moved towards the camera by this amount
+
+// edge functions and depth plane of the triangle, all of them are evaluated as: A * x + B * y + C
+struct OccluderTriangle
+{
+    float edgeA[3], edgeB[3], edgeC[3];
+    float depthA, depthB, depthC;
+    int minX, minY, maxX, maxY;
+};
+
+namespace
+{
+    alignas(16) float m_Depth[OcclusionHeight][OcclusionWidth];
+    float m_TileDepth[OcclusionTilesY][OcclusionTilesX]; // farthest depth of each tile
+
+    Matrix4 m_ViewProjection;
+    Array<OccluderTriangle> m_Triangles;
+
+    // primitives of the last rasterized prefab that are drawn to depth buffer, one bit per bounds index.
+    // they are not tested, a primitive would occlude itself because of the depth precision
+    Array<uint64_t> m_OccluderBits;
+    const Prefab* m_OccluderPrefab = nullptr;
+
+    bool m_Enabled = true;
+}
+
+bool OcclusionIsEnabled() { return m_Enabled; }
+
+void OcclusionBeginFrame(const Matrix4& viewProjection)
+{
+    m_ViewProjection = viewProjection;
+
+    float* depth = &m_Depth[0][0];
+    for (int i = 0; i < OcclusionWidth * OcclusionHeight; i++)
+        depth[i] = 1.0f;
+
+    float* tileDepth = &m_TileDepth[0][0];
+    for (int i = 0; i < OcclusionTilesX * OcclusionTilesY; i++)
+        tileDepth[i] = 1.0f;
+
+    m_OccluderPrefab = nullptr;
+}
+
+/*//////////////////////////////////////////////////////////////////////////*/
+/*                              Triangle Setup                              */
+/*//////////////////////////////////////////////////////////////////////////*/
+
+// converts clip space position to occlusion buffer coordinates, xy in pixels, z in [0, 1]
+inline void ClipToScreen(Vector4x32f clip, float* out)
+{
+    float clipArr[4];
+    VecStore(clipArr, clip);
+    float invW = 1.0f / clipArr[3];
+    out[0] = (clipArr[0] * invW * 0.5f + 0.5f) * (float)OcclusionWidth;
+    out[1] = (clipArr[1] * invW * 0.5f + 0.5f) * (float)OcclusionHeight;
+    out[2] = clipArr[2] * invW * 0.5f + 0.5f;
+}
+
+// returns false if triangle is not going to be rasterized
+static bool SetupTriangle(Vector4x32f c0, Vector4x32f c1, Vector4x32f c2, OccluderTriangle* tri)
+{
+    // triangles that are crossing the near plane are skipped,
+    // missing occluders only makes culling less aggressive, never wrong
+    if (VecGetW(c0) < OcclusionNearW || VecGetW(c1) < OcclusionNearW || VecGetW(c2) < OcclusionNearW)
+        return false;
+
+    float v[3][3];
+    ClipToScreen(c0, v[0]);
+    ClipToScreen(c1, v[1]);
+    ClipToScreen(c2, v[2]);
+
+    // both windings are rasterized, occluders doesn't have to be closed meshes
+    float area = (v[1][0] - v[0][0]) * (v[2][1] - v[0][1]) - (v[1][1] - v[0][1]) * (v[2][0] - v[0][0]);
+    if (Abs(area) < 1e-6f)
+        return false;
+
+    if (area < 0.0f) {
+        for (int i = 0; i < 3; i++) Swap(v[1][i], v[2][i]);
+        area = -area;
+    }
+
+    // clamp before converting to int, vertices close to the near plane can be really far away
+    tri->minX = (int)Clamp(MIN(MIN(v[0][0], v[1][0]), v[2][0]), 0.0f, (float)OcclusionWidth) & ~3; // aligned for 4 wide rasterization
+    tri->minY = (int)Clamp(MIN(MIN(v[0][1], v[1][1]), v[2][1]), 0.0f, (float)OcclusionHeight);
+    tri->maxX = MIN((int)Clamp(MAX(MAX(v[0][0], v[1][0]), v[2][0]), -1.0f, (float)OcclusionWidth) + 1, OcclusionWidth);
+    tri->maxY = MIN((int)Clamp(MAX(MAX(v[0][1], v[1][1]), v[2][1]), -1.0f, (float)OcclusionHeight) + 1, OcclusionHeight);
+
+    if (tri->minX >= tri->maxX || tri->minY >= tri->maxY)
+        return false;
+
+    // edge i is opposite of the vertex i, so normalized edge function is the barycentric of the vertex i
+    float invArea = 1.0f / area;
+    for (int i = 0; i < 3; i++)
+    {
+        const float* a = v[(i + 1) % 3];
+        const float* b = v[(i + 2) % 3];
+        tri->edgeA[i] = (a[1] - b[1]) * invArea;
+        tri->edgeB[i] = (b[0] - a[0]) * invArea;
+        tri->edgeC[i] = ((b[1] - a[1]) * a[0] - (b[0] - a[0]) * a[1]) * invArea;
+    }
+
+    tri->depthA = tri->edgeA[0] * v[0][2] + tri->edgeA[1] * v[1][2] + tri->edgeA[2] * v[2][2];
+    tri->depthB = tri->edgeB[0] * v[0][2] + tri->edgeB[1] * v[1][2] + tri->edgeB[2] * v[2][2];
+    tri->depthC = tri->edgeC[0] * v[0][2] + tri->edgeC[1] * v[1][2] + tri->edgeC[2] * v[2][2];
+
+    // inner coverage: rasterizer samples the pixel centers, edges are moved inwards by the half pixel,
+    // so only the pixels that are completely inside of the triangle are passing.
+    // depth is moved to the farthest corner of the pixel
+    for (int i = 0; i < 3; i++)
+        tri->edgeC[i] -= (Abs(tri->edgeA[i]) + Abs(tri->edgeB[i])) * 0.5f;
+    tri->depthC += (Abs(tri->depthA) + Abs(tri->depthB)) * 0.5f;
+    return true;
+}
+
+/*//////////////////////////////////////////////////////////////////////////*/
+/*                              Rasterization                               */
+/*//////////////////////////////////////////////////////////////////////////*/
+
+static void RasterizeTriangle(const OccluderTriangle& tri, int rowBegin, int rowEnd)
+{
+    int minY = MAX(tri.minY, rowBegin);
+    int maxY = MIN(tri.maxY, rowEnd);
+
+    const Vector4x32f offsets = VecSetR(0.5f, 1.5f, 2.5f, 3.5f); // pixel centers
+    const Vector4x32f zero = VecZero();
+    const Vector4x32f rejectScale = VecSet1(1e30f);
+
+    for (int y = minY; y < maxY; y++)
+    {
+        float py = (float)y + 0.5f;
+        float* row = m_Depth[y];
+
+        for (int x = tri.minX; x < tri.maxX; x += 4)
+        {
+            Vector4x32f px = VecAdd(VecSet1((float)x), offsets);
+            Vector4x32f w0 = VecAdd(VecMul(px, VecSet1(tri.edgeA[0])), VecSet1(tri.edgeB[0] * py + tri.edgeC[0]));
+            Vector4x32f w1 = VecAdd(VecMul(px, VecSet1(tri.edgeA[1])), VecSet1(tri.edgeB[1] * py + tri.edgeC[1]));
+            Vector4x32f w2 = VecAdd(VecMul(px, VecSet1(tri.edgeA[2])), VecSet1(tri.edgeB[2] * py + tri.edgeC[2]));
+            Vector4x32f depth = VecAdd(VecMul(px, VecSet1(tri.depthA)), VecSet1(tri.depthB * py + tri.depthC));
+
+            // branchless mask, pixels outside of the triangle gets huge depth so min doesn't change the buffer
+            Vector4x32f outside = VecMax(VecNeg(VecMin(VecMin(w0, w1), w2)), zero);
+            depth = VecAdd(depth, VecMul(outside, rejectScale));
+
+            VecStore(row + x, VecMin(VecLoad(row + x), depth));
+        }
+    }
+}
+
+static void RasterizeRows(int rowBegin, int rowEnd)
+{
+    const OccluderTriangle* triangles = m_Triangles.Data();
+    int numTriangles = m_Triangles.Size();
+
+    for (int i = 0; i < numTriangles; i++)
+    {
+        if (triangles[i].maxY <= rowBegin || triangles[i].minY >= rowEnd)
+            continue;
+        RasterizeTriangle(triangles[i], rowBegin, rowEnd);
+    }
+
+    // farthest depth of the tiles, used for rejecting big boxes quickly
+    for (int ty = rowBegin / OcclusionTileSize; ty < rowEnd / OcclusionTileSize; ty++)
+    {
+        for (int tx = 0; tx < OcclusionTilesX; tx++)
+        {
+            Vector4x32f farthest = VecZero();
+            for (int y = 0; y < OcclusionTileSize; y++)
+            {
+                const float* row = m_Depth[ty * OcclusionTileSize + y] + tx * OcclusionTileSize;
+                farthest = VecMax(farthest, VecMax(VecLoad(row), VecLoad(row + 4)));
+            }
+            float depths[4];
+            VecStore(depths, farthest);
+            m_TileDepth[ty][tx] = MAX(MAX(depths[0], depths[1]), MAX(depths[2], depths[3]));
+        }
+    }
+}
+
+// each task rasterizes rows of tiles [begin, end)
+static void RasterizeTileRows(void* data, int task, int begin, int end)
+{
+    RasterizeRows(begin * OcclusionTileSize, end * OcclusionTileSize);
+}
+
+static void RasterizeOccluders()
+{
+    constexpr int MinTrianglesPerTask = 256;
+    // each task takes at least one row of tiles
+    int numTasks = MIN(m_Triangles.Size() / MinTrianglesPerTask, GetNumJobThreads());
+    ParallelRange(RasterizeTileRows, nullptr, OcclusionTilesY, numTasks);
+}
+
+void OcclusionRasterizePrefab(Prefab* prefab)
+{
+    if (!m_Enabled || prefab->numSkins > 0)
+        return;
+
+    const PrimitiveBounds& bounds = prefab->worldBounds;
+    const uint* indices = (const uint*)prefab->allIndices;
+    const char* vertices = (const char*)prefab->allVertices;
+    int numWords = (bounds.capacity + 63) / 64;
+
+    m_Triangles.Resize(0);
+    m_OccluderBits.Resize(numWords);
+    MemsetZero(m_OccluderBits.Data(), sizeof(uint64_t) * numWords);
+    m_OccluderPrefab = prefab;
+
+    for (int w = 0; w < numWords; w++)
+    {
+        for (uint64_t bits = bounds.visibility[w]; bits != 0; bits &= bits - 1)
+        {
+            int i = (w << 6) + TrailingZeroCount64(bits);
+            int nodeIndex = bounds.nodeIndices[i];
+            const APrimitive& primitive = prefab->meshes[prefab->nodes[nodeIndex].index].primitives[bounds.primitiveIndices[i]];
+
+            int numTriangles = primitive.numIndices / 3;
+            if (numTriangles == 0 || numTriangles > MaxOccluderTriangles ||
+                m_Triangles.Size() + numTriangles > MaxTrianglesPerFrame)
+                continue;
+
+            // only big primitives on screen are worth to rasterize
+            float rect[4] = { 1e30f, 1e30f, -1e30f, -1e30f };
+            bool crossesNear = false;
+            for (int c = 0; c < 8; c++)
+            {
+                Vector4x32f corner = VecSetR(c & 1 ? bounds.maxX[i] : bounds.minX[i],
+                                             c & 2 ? bounds.maxY[i] : bounds.minY[i],
+                                             c & 4 ? bounds.maxZ[i] : bounds.minZ[i], 1.0f);
+                Vector4x32f clip = Vector4Transform(corner, m_ViewProjection.r);
+                if (VecGetW(clip) < OcclusionNearW) { crossesNear = true; break; }
+                float screen[3];
+                ClipToScreen(clip, screen);
+                rect[0] = MIN(rect[0], screen[0]); rect[1] = MIN(rect[1], screen[1]);
+                rect[2] = MAX(rect[2], screen[0]); rect[3] = MAX(rect[3], screen[1]);
+            }
+
+            if (!crossesNear && MAX(rect[2] - rect[0], rect[3] - rect[1]) < MinOccluderScreenSize)
+                continue;
+
+            Matrix4 mvp = prefab->globalNodeTransforms[nodeIndex] * m_ViewProjection;
+            const uint* primIndices = indices + primitive.indexOffset;
+            m_OccluderBits[w] |= 1ull << (i & 63);
+
+            for (int t = 0; t < numTriangles; t++)
+            {
+                Vector4x32f clip[3];
+                for (int v = 0; v < 3; v++)
+                {
+                    const float* pos = (const float*)(vertices + primIndices[t * 3 + v] * sizeof(AVertex));
+                    clip[v] = Vector4Transform(VecSetR(pos[0], pos[1], pos[2], 1.0f), mvp.r);
+                }
+
+                OccluderTriangle tri;
+                if (SetupTriangle(clip[0], clip[1], clip[2], &tri))
+                    m_Triangles.Add(tri);
+            }
+        }
+    }
+
+    if (m_Triangles.Size() > 0)
+        RasterizeOccluders();
+}
+
+/*//////////////////////////////////////////////////////////////////////////*/
+/*                              Visibility Test                             */
+/*//////////////////////////////////////////////////////////////////////////*/
+
+bool OcclusionIsOccluder(const Prefab* prefab, int boundsIndex)
+{
+    return m_OccluderPrefab == prefab && (m_OccluderBits[boundsIndex >> 6] & (1ull << (boundsIndex & 63))) != 0;
+}
+
+bool OcclusionTestAABB(Vector4x32f vmin, Vector4x32f vmax)
+{
+    if (!m_Enabled) return true;
+
+    float boxMin[4], boxMax[4];
+    VecStore(boxMin, vmin);
+    VecStore(boxMax, vmax);
+
+    // screen rectangle and closest depth of the box
+    float rect[4] = { 1e30f, 1e30f, -1e30f, -1e30f };
+    float closest = 1.0f;
+    for (int c = 0; c < 8; c++)
+    {
+        Vector4x32f corner = VecSetR(c & 1 ? boxMax[0] : boxMin[0],
+                                     c & 2 ? boxMax[1] : boxMin[1],
+                                     c & 4 ? boxMax[2] : boxMin[2], 1.0f);
+        Vector4x32f clip = Vector4Transform(corner, m_ViewProjection.r);
+        // camera is inside or too close to the box
+        if (VecGetW(clip) < OcclusionNearW)
+            return true;
+
+        float screen[3];
+        ClipToScreen(clip, screen);
+        rect[0] = MIN(rect[0], screen[0]); rect[1] = MIN(rect[1], screen[1]);
+        rect[2] = MAX(rect[2], screen[0]); rect[3] = MAX(rect[3], screen[1]);
+        closest = MIN(closest, screen[2]);
+    }
+
+    // conservative, depth precision of the box and occluders are not the same
+    closest = MAX(closest - OcclusionDepthBias, 0.0f);
+
+    int minX = (int)Clamp(rect[0], 0.0f, (float)OcclusionWidth);
+    int minY = (int)Clamp(rect[1], 0.0f, (float)OcclusionHeight);
+    int maxX = MIN((int)Clamp(rect[2], -1.0f, (float)OcclusionWidth) + 1, OcclusionWidth);
+    int maxY = MIN((int)Clamp(rect[3], -1.0f, (float)OcclusionHeight) + 1, OcclusionHeight);
+    if (minX >= maxX || minY >= maxY)
+        return true; // outside of the screen, frustum culling decides
+
+    // coarse test, if box is in front of the farthest occluder of the tile we have to look at the pixels
+    for (int ty = minY / OcclusionTileSize; ty <= (maxY - 1) / OcclusionTileSize; ty++)
+    {
+        for (int tx = minX / OcclusionTileSize; tx <= (maxX - 1) / OcclusionTileSize; tx++)
+        {
+            if (closest > m_TileDepth[ty][tx])
+                continue;
+
+            int tileMinY = MAX(ty * OcclusionTileSize, minY), tileMaxY = MIN((ty + 1) * OcclusionTileSize, maxY);
+            int tileMinX = MAX(tx * OcclusionTileSize, minX), tileMaxX = MIN((tx + 1) * OcclusionTileSize, maxX);
+            for (int y = tileMinY; y < tileMaxY; y++)
+                for (int x = tileMinX; x < tileMaxX; x++)
+                    if (closest <= m_Depth[y][x])
+                        return true;
+        }
+    }
+
+    return false;
+}
+
+void OcclusionEdit()
+{
+    uCheckBoxW("Occlusion Culling", &m_Enabled, true);
+}
@@ -76,6 +76,162 @@ namespace
     Shader m_TextureCopyShader;
 }
 
+/*//////////////////////////////////////////////////////////////////////////*/
+/*                               State Cache                                */
+/*//////////////////////////////////////////////////////////////////////////*/
+
+// shadow copy of the GL state, r* functions are skipping the calls that wouldn't change anything.
+// all of the GL calls that are changing these states has to be in this file and has to update the cache.
+// ~0 or -1 means unknown, next call will be issued
+constexpr int MaxTextureUnits  = 16;
+constexpr int SamplerCacheSize = 256; // must be power of two
+
+struct SamplerBinding
+{
+    unsigned int program;
+    int location;
+    int unit;
+};
+
+struct GLStateCache
+{
+    unsigned int program;
+    unsigned int vertexArray;
+    unsigned int indexBuffer;
+    unsigned int activeUnit;
+    unsigned int textures[MaxTextureUnits]; // handles are unique, so 2D and 2D array targets are sharing the slot
+    SamplerBinding samplers[SamplerCacheSize]; // sampler uniforms are program state, cached per (program, location)
+    int stencilMask;
+    signed char depthTest, depthWrite, blending, stencilTest, scissorTest, clockWise;
+};
+
+static GLStateCache g_GLState;
+static bool g_StateCacheEnabled = true;
+static rStateStats g_StateStats;
+static rStateStats g_LastFrameStateStats;
+
+static void InvalidateStateCache()
+{
+    MemsetZero(g_GLState.samplers, sizeof(g_GLState.samplers));
+    g_GLState.program     = ~0u;
+    g_GLState.vertexArray = ~0u;
+    g_GLState.indexBuffer = ~0u;
+    g_GLState.activeUnit  = ~0u;
+    for (int i = 0; i < MaxTextureUnits; i++)
+        g_GLState.textures[i] = ~0u;
+    
+    g_GLState.stencilMask = -1;
+    g_GLState.depthTest   = -1, g_GLState.depthWrite  = -1, g_GLState.blending  = -1;
+    g_GLState.stencilTest = -1, g_GLState.scissorTest = -1, g_GLState.clockWise = -1;
+}
+
+// returns true if the gl call should be issued
+static inline bool StateChanged(bool changed)
+{
+    if (changed || !g_StateCacheEnabled) {
+        g_StateStats.issued++;
+        return true;
+    }
+    g_StateStats.filtered++;
+    return false;
+}
+
+static void SetActiveUnit(unsigned int unit)
+{
+    if (StateChanged(g_GLState.activeUnit != unit)) {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        g_GLState.activeUnit = unit;
+    }
+}
+
+// binds to active texture unit
+static void BindTexture(GLenum target, unsigned int handle)
+{
+    unsigned int unit = g_GLState.activeUnit;
+    bool known = unit < MaxTextureUnits;
+    if (StateChanged(!known || g_GLState.textures[unit] != handle)) {
+        glBindTexture(target, handle);
+        if (known) g_GLState.textures[unit] = handle;
+    }
+}
+
+static void ForgetTexture(unsigned int handle)
+{
+    for (int i = 0; i < MaxTextureUnits; i++)
+        if (g_GLState.textures[i] == handle) 
+            g_GLState.textures[i] = ~0u;
+}
+
+static SamplerBinding& GetSamplerBinding(int location)
+{
+    return g_GLState.samplers[(g_GLState.program * 31u + (unsigned int)location) & (SamplerCacheSize - 1)];
+}
+
+static void SetSamplerUnit(int location, int unit)
+{
+    SamplerBinding& binding = GetSamplerBinding(location);
+    bool same = g_GLState.program != ~0u && binding.program == g_GLState.program && 
+                binding.location == location && binding.unit == unit;
+    if (StateChanged(!same)) {
+        glUniform1i(location, unit);
+        binding = { g_GLState.program, location, unit };
+    }
+}
+
+// rSetShaderValue can change sampler uniforms as well
+static void NoteUniformInt(int location, int value)
+{
+    SamplerBinding& binding = GetSamplerBinding(location);
+    if (binding.program == g_GLState.program && binding.location == location)
+        binding.unit = value;
+}
+
+static void UseProgram(unsigned int program)
+{
+    if (StateChanged(g_GLState.program != program)) {
+        glUseProgram(program);
+        g_GLState.program = program;
+    }
+}
+
+static void BindVertexArray(unsigned int vao)
+{
+    if (StateChanged(g_GLState.vertexArray != vao)) {
+        glBindVertexArray(vao);
+        g_GLState.vertexArray = vao;
+        g_GLState.indexBuffer = ~0u; // index buffer binding is vao state
+    }
+}
+
+static void SetCapability(GLenum capability, signed char* cached, bool value)
+{
+    if (StateChanged(*cached != (signed char)value)) {
+        if (value) glEnable(capability); else glDisable(capability);
+        *cached = (signed char)value;
+    }
+}
+
+void rSetStateCacheEnabled(bool enabled)
+{
+    g_StateCacheEnabled = enabled;
+}
+
+bool rIsStateCacheEnabled()
+{
+    return g_StateCacheEnabled;
+}
+
+void rBeginFrameStats()
+{
+    g_LastFrameStateStats = g_StateStats;
+    g_StateStats.issued = g_StateStats.filtered = 0;
+}
+
+rStateStats rGetStateStats()
+{
+    return g_LastFrameStateStats;
+}
+
 /*//////////////////////////////////////////////////////////////////////////*/
 /*                                 Texture                                  */
 /*//////////////////////////////////////////////////////////////////////////*/
@@ -209,7 +365,7 @@ uint8_t rTextureTypeToBytesPerPixel(TextureType type)
 void rCopyTexture(Texture dst, Texture src)
 {
     // note: todo??
-    glBindTexture(GL_TEXTURE_2D, dst.handle);
+    BindTexture(GL_TEXTURE_2D, dst.handle);
     glCopyTexSubImage2D(src.handle, 
                         0, // mip
                         0, // xoffset
@@ -228,7 +384,7 @@ Texture rCreateDepthTexture(int width, int height, DepthType depthType)
     texture.buffer = nullptr;
     texture.type   = TextureType_Depth24Stencil8; // < ??
     glGenTextures(1, &texture.handle);
-    glBindTexture(GL_TEXTURE_2D, texture.handle);
+    BindTexture(GL_TEXTURE_2D, texture.handle);
 
     GLenum glType = depthType == DepthType_32 ? GL_DEPTH_COMPONENT32F : 
                                                 GL_DEPTH_COMPONENT16 + depthType;
@@ -255,7 +411,7 @@ Texture rCreateTexture(int width, int height, void* data, TextureType type, TexF
 {
     Texture texture;
     glGenTextures(1, &texture.handle);
-    glBindTexture(GL_TEXTURE_2D, texture.handle);
+    BindTexture(GL_TEXTURE_2D, texture.handle);
     int wrapMode = (flags & TexFlags_ClampToEdge) ? GL_CLAMP_TO_EDGE : GL_REPEAT;
     bool mipmap     = !!(flags & TexFlags_MipMap);
     bool nearest    = !!(flags & TexFlags_Nearest);
@@ -333,11 +489,85 @@ Texture rCreateTexture(int width, int height, void* data, TextureType type, TexF
     return texture;
 }
 
+static GLenum GetCompressedInternalFormat(TextureType type)
+{
+#ifndef __ANDROID__
+    const GLenum compressedMap[] =
+    {
+        GL_COMPRESSED_RED_RGTC1, // BC4
+        GL_COMPRESSED_RG_RGTC2,  // BC5
+        GL_COMPRESSED_RGBA_S3TC_DXT5_EXT,
+        GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+    };
+    return compressedMap[type - TextureType_CompressedR];
+#else
+    return GL_COMPRESSED_RGBA_ASTC_4x4;
+#endif
+}
+
+Texture rCreateMipmappedTexture(int width, int height, int numMips, TextureType type, TexFlags flags)
+{
+    Texture texture;
+    glGenTextures(1, &texture.handle);
+    BindTexture(GL_TEXTURE_2D, texture.handle);
+    int wrapMode = (flags & TexFlags_ClampToEdge) ? GL_CLAMP_TO_EDGE : GL_REPEAT;
+    bool nearest = !!(flags & TexFlags_Nearest);
+    int magFilter = IsAndroid() && !(flags & TexFlags_Linear) ? GL_NEAREST : GL_LINEAR;
+    int minFilter = numMips > 1 ? GL_LINEAR_MIPMAP_NEAREST : (nearest ? GL_NEAREST : GL_LINEAR);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrapMode);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrapMode);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, nearest ? GL_NEAREST : magFilter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, minFilter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, numMips - 1);
+
+    bool compressed = !!(flags & TexFlags_Compressed);
+    GLenum internalFormat = compressed ? GetCompressedInternalFormat(type) : TextureFormatTable[type].internalFormat;
+    glTexStorage2D(GL_TEXTURE_2D, numMips, internalFormat, width, height);
+
+    texture.width  = width;
+    texture.height = height;
+    texture.buffer = nullptr;
+    texture.type   = type;
+    CHECK_GL_ERROR();
+    return texture;
+}
+
+void rUploadTextureMip(Texture texture, int mip, const void* data, int dataSize)
+{
+    int width  = MAX(texture.width  >> mip, 1);
+    int height = MAX(texture.height >> mip, 1);
+    BindTexture(GL_TEXTURE_2D, texture.handle);
+
+    if (texture.type >= TextureType_CompressedR && texture.type <= TextureType_CompressedRGBA)
+    {
+        glCompressedTexSubImage2D(GL_TEXTURE_2D, mip, 0, 0, width, height, GetCompressedInternalFormat(texture.type), dataSize, data);
+    }
+    else
+    {
+        TextureFormat format = TextureFormatTable[texture.type];
+        glTexSubImage2D(GL_TEXTURE_2D, mip, 0, 0, width, height, format.format, format.type, data);
+    }
+    CHECK_GL_ERROR();
+}
+
+void rCopyTextureMips(Texture dst, int dstMip, Texture src, int srcMip, int numMips)
+{
+    for (int i = 0; i < numMips; i++)
+    {
+        glCopyImageSubData(src.handle, GL_TEXTURE_2D, srcMip + i, 0, 0, 0,
+                           dst.handle, GL_TEXTURE_2D, dstMip + i, 0, 0, 0,
+                           MAX(dst.width >> (dstMip + i), 1), MAX(dst.height >> (dstMip + i), 1), 1);
+    }
+    CHECK_GL_ERROR();
+}
+
 Texture rCreateTexture2DArray(int width, int height, int depth, void* data, TextureType type, TexFlags flags)
 {
     Texture texture;
     glGenTextures(1, &texture.handle);
-    glBindTexture(GL_TEXTURE_2D_ARRAY, texture.handle);
+    BindTexture(GL_TEXTURE_2D_ARRAY, texture.handle);
     int wrapMode = (flags & TexFlags_ClampToEdge) ? GL_CLAMP_TO_EDGE : GL_REPEAT;
     // mipmaps are not implemented
     bool mipmap     = false; // !!(flags & TexFlags_MipMap);
@@ -372,11 +602,19 @@ Texture rCreateTexture2DArray(int width, int height, int depth, void* data, Text
 void rUpdateTexture(Texture texture, void* data)
 {
     TextureFormat format = TextureFormatTable[texture.type];
-    glBindTexture(GL_TEXTURE_2D, texture.handle);
+    BindTexture(GL_TEXTURE_2D, texture.handle);
     glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, texture.width, texture.height, format.format, format.type, data);
     CHECK_GL_WARNING();
 }
 
+void rUpdateTextureRegion(Texture texture, int x, int y, int width, int height, void* data)
+{
+    TextureFormat format = TextureFormatTable[texture.type];
+    BindTexture(GL_TEXTURE_2D, texture.handle);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, format.format, format.type, data);
+    CHECK_GL_WARNING();
+}
+
 static bool IsCompressed(const char* path, int pathLen)
 {
 #ifndef __ANDROID__ 
@@ -452,9 +690,61 @@ void rDeleteTexture(Texture texture)
     {
         stbi_image_free(texture.buffer);
     }
+    ForgetTexture(texture.handle);
     glDeleteTextures(1, &texture.handle); 
 }
 
+bool rTrimTextureMips(Texture* texture, int numMipsToRemove)
+{
+    GLint maxLevel = 0, internalFormat = 0, wrapMode = 0, minFilter = 0, magFilter = 0;
+    BindTexture(GL_TEXTURE_2D, texture->handle);
+    glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, &maxLevel);
+    glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, &wrapMode);
+    glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, &minFilter);
+    glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, &magFilter);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT, &internalFormat);
+
+    // max level is 1000 by default if the texture is created without mips
+    if (numMipsToRemove <= 0 || maxLevel > 16 || numMipsToRemove > maxLevel)
+        return false;
+
+    // glGenerateMipmap might fail with compressed formats, make sure all of the mips are exist
+    GLint lastMipWidth = 0;
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, maxLevel, GL_TEXTURE_WIDTH, &lastMipWidth);
+    if (lastMipWidth == 0)
+        return false;
+
+    int numLevels = maxLevel + 1 - numMipsToRemove;
+    int width  = MAX(texture->width  >> numMipsToRemove, 1);
+    int height = MAX(texture->height >> numMipsToRemove, 1);
+
+    GLuint handle;
+    glGenTextures(1, &handle);
+    BindTexture(GL_TEXTURE_2D, handle);
+    glTexStorage2D(GL_TEXTURE_2D, numLevels, internalFormat, width, height);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrapMode);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrapMode);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, minFilter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, magFilter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, numLevels - 1);
+
+    for (int mip = 0; mip < numLevels; mip++)
+    {
+        glCopyImageSubData(texture->handle, GL_TEXTURE_2D, mip + numMipsToRemove, 0, 0, 0,
+                           handle, GL_TEXTURE_2D, mip, 0, 0, 0,
+                           MAX(width >> mip, 1), MAX(height >> mip, 1), 1);
+    }
+    CHECK_GL_ERROR();
+
+    ForgetTexture(texture->handle);
+    glDeleteTextures(1, &texture->handle);
+    texture->handle = handle;
+    texture->width  = width;
+    texture->height = height;
+    return true;
+}
+
 /*//////////////////////////////////////////////////////////////////////////*/
 /*                                 Frame Buffer                             */
 /*//////////////////////////////////////////////////////////////////////////*/
@@ -600,7 +890,7 @@ GPUMesh rCreateMesh(const void* vertexBuffer, const void* indexBuffer, int numVe
 
     // Generate vertex attribute
     glGenVertexArrays(1, &mesh.vertexLayoutHandle);
-    glBindVertexArray(mesh.vertexLayoutHandle);
+    BindVertexArray(mesh.vertexLayoutHandle);
 
     char* offset = 0;
     for (int i = 0; i < layoutDesc->numLayout; ++i)
@@ -659,8 +949,11 @@ void rCreateMeshFromPrimitive(APrimitive* primitive, GPUMesh* mesh, bool skined)
 
 void rBindMesh(GPUMesh mesh)
 {
-    glBindVertexArray(mesh.vertexLayoutHandle);
-    if (mesh.indexHandle != -1) glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexHandle);
+    BindVertexArray(mesh.vertexLayoutHandle);
+    if (mesh.indexHandle != -1 && StateChanged(g_GLState.indexBuffer != mesh.indexHandle)) {
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexHandle);
+        g_GLState.indexBuffer = mesh.indexHandle;
+    }
     CHECK_GL_ERROR();
 }
 
@@ -670,6 +963,12 @@ void rRenderMeshIndexOffset(GPUMesh mesh, int numIndex, int offset)
     CHECK_GL_ERROR();
 }
 
+void rRenderMeshIndexOffsetInstanced(GPUMesh mesh, int numIndex, int offset, int numInstances)
+{
+    glDrawElementsInstanced(GL_TRIANGLES, numIndex, mesh.indexType, (void*)((size_t)offset * sizeof(uint32)), numInstances);
+    CHECK_GL_ERROR();
+}
+
 void rRenderMeshIndexed(GPUMesh mesh, bool isLine)
 {
     glDrawElements(isLine ? GL_LINES : GL_TRIANGLES, mesh.numIndex, mesh.indexType, nullptr);
@@ -694,8 +993,103 @@ void rRenderGeomPoint(int numPoints, int offset)
     CHECK_GL_ERROR();
 }
 
+/*//////////////////////////////////////////////////////////////////////////*/
+/*                           Multi Draw Indirect                            */
+/*//////////////////////////////////////////////////////////////////////////*/
+
+static GLuint g_DrawIDBuffer = 0; // 0, 1, 2... MaxIndirectDraws, instanced attribute
+
+bool rSupportsMultiDrawIndirect()
+{
+#ifdef __ANDROID__
+    return false;
+#else
+    return glMultiDrawElementsIndirect != nullptr && glVertexAttribDivisor != nullptr;
+#endif
+}
+
+IndirectBuffer rCreateIndirectBuffer(int maxDraws, int drawDataStride)
+{
+    IndirectBuffer buffer = {};
+    ASSERTR(rSupportsMultiDrawIndirect(), return buffer);
+#ifndef __ANDROID__
+    buffer.maxDraws = MIN(maxDraws, MaxIndirectDraws);
+    buffer.drawDataStride = drawDataStride;
+
+    glGenBuffers(1, &buffer.commandHandle);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, buffer.commandHandle);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, buffer.maxDraws * sizeof(DrawElementsIndirectCommand), nullptr, GL_DYNAMIC_DRAW);
+
+    glGenBuffers(1, &buffer.drawDataHandle);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer.drawDataHandle);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, buffer.maxDraws * drawDataStride, nullptr, GL_DYNAMIC_DRAW);
+    CHECK_GL_ERROR();
+#endif
+    return buffer;
+}
+
+void rDeleteIndirectBuffer(IndirectBuffer buffer)
+{
+    if (buffer.commandHandle == 0) return;
+    glDeleteBuffers(1, &buffer.commandHandle);
+    glDeleteBuffers(1, &buffer.drawDataHandle);
+}
+
+void rUploadIndirectBuffer(IndirectBuffer buffer, const DrawElementsIndirectCommand* commands, int numCommands, const void* drawData, int numDrawData)
+{
+#ifndef __ANDROID__
+    ASSERT(numCommands <= buffer.maxDraws && numDrawData <= buffer.maxDraws);
+    // orphan the buffers, so driver doesn't wait for the previous draws
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, buffer.commandHandle);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, buffer.maxDraws * sizeof(DrawElementsIndirectCommand), nullptr, GL_DYNAMIC_DRAW);
+    glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, numCommands * sizeof(DrawElementsIndirectCommand), commands);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer.drawDataHandle);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, buffer.maxDraws * buffer.drawDataStride, nullptr, GL_DYNAMIC_DRAW);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, numDrawData * buffer.drawDataStride, drawData);
+    CHECK_GL_ERROR();
+#endif
+}
+
+void rMeshEnableDrawID(GPUMesh mesh)
+{
+#ifndef __ANDROID__
+    if (g_DrawIDBuffer == 0)
+    {
+        uint* drawIDs = new uint[MaxIndirectDraws];
+        for (uint i = 0; i < MaxIndirectDraws; i++)
+            drawIDs[i] = i;
+
+        glGenBuffers(1, &g_DrawIDBuffer);
+        glBindBuffer(GL_ARRAY_BUFFER, g_DrawIDBuffer);
+        glBufferData(GL_ARRAY_BUFFER, MaxIndirectDraws * sizeof(uint), drawIDs, GL_STATIC_DRAW);
+        delete[] drawIDs;
+    }
+
+    BindVertexArray(mesh.vertexLayoutHandle);
+    glBindBuffer(GL_ARRAY_BUFFER, g_DrawIDBuffer);
+    glVertexAttribIPointer(6, 1, GL_UNSIGNED_INT, sizeof(uint), nullptr);
+    glEnableVertexAttribArray(6);
+    glVertexAttribDivisor(6, 1); // advance once per instance, first instance is baseInstance
+    CHECK_GL_ERROR();
+#endif
+}
+
+void rRenderMeshMultiIndirect(GPUMesh mesh, IndirectBuffer buffer, int firstCommand, int numCommands, int drawDataBinding)
+{
+#ifndef __ANDROID__
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, buffer.commandHandle);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, drawDataBinding, buffer.drawDataHandle);
+    const size_t offset = (size_t)firstCommand * sizeof(DrawElementsIndirectCommand);
+    glMultiDrawElementsIndirect(GL_TRIANGLES, mesh.indexType, (const void*)offset, numCommands, 0);
+    CHECK_GL_ERROR();
+#endif
+}
+
 void rDeleteMesh(GPUMesh mesh)
 {
+    if (g_GLState.vertexArray == mesh.vertexLayoutHandle) 
+        g_GLState.vertexArray = ~0u;
     glDeleteVertexArrays(1, &mesh.vertexLayoutHandle);
     glDeleteBuffers(1, &mesh.vertexHandle);
     glDeleteBuffers(1, &mesh.indexHandle);
@@ -722,7 +1116,7 @@ int rGetUniformLocation(Shader shader, const char* name)
     return glGetUniformLocation(shader.handle, name);
 }
 
-void rSetShaderValue(int   value, int location) { glUniform1i(location, value); CHECK_GL_ERROR(); }
+void rSetShaderValue(int   value, int location) { glUniform1i(location, value); NoteUniformInt(location, value); CHECK_GL_ERROR(); }
 void rSetShaderValue(uint  value, int location) { glUniform1ui(location, value); CHECK_GL_ERROR(); }
 void rSetShaderValue(float value, int location) { glUniform1f(location, value); CHECK_GL_ERROR();  }
 
@@ -781,7 +1175,7 @@ void rSetShaderValue(const void* value, int location, GraphicType type)
 {
     switch (type)
     {
-        case GraphicType_Int:         glUniform1i(location , *(const int*)value);          break;
+        case GraphicType_Int:         glUniform1i(location , *(const int*)value); NoteUniformInt(location, *(const int*)value); break;
         case GraphicType_UnsignedInt: glUniform1ui(location, *(const unsigned int*)value); break;
         case GraphicType_Float:       glUniform1f(location , *(const float*)value);        break;
 
@@ -961,7 +1355,7 @@ Shader rCreateShader(const char* vertexSource, const char* fragmentSource,
 
     glDeleteShader(vertexShader);
     glDeleteShader(fragmentShader);
-    glUseProgram(shaderProgram);
+    UseProgram(shaderProgram);
     CHECK_GL_WARNING();
     // CHECK_GL_ERROR();
     return {shaderProgram};
@@ -1022,6 +1416,14 @@ void rImportShaderSafe(const char* vertexPath, const char* fragmentPath, const c
 
 void rDeleteShader(Shader shader)    
 {
+    // handle can be reused by the next shader
+    if (g_GLState.program == shader.handle)
+        g_GLState.program = ~0u;
+    
+    for (int i = 0; i < SamplerCacheSize; i++)
+        if (g_GLState.samplers[i].program == shader.handle)
+            g_GLState.samplers[i].program = 0;
+
     glDeleteProgram(shader.handle);       
 }
 
@@ -1064,7 +1466,7 @@ static void SetupLineRenderer()
     glGenVertexArrays(1, &lineVao);
     glGenBuffers(1, &lineVbo);
 
-    glBindVertexArray(lineVao);
+    BindVertexArray(lineVao);
 
     glBindBuffer(GL_ARRAY_BUFFER, lineVbo);
     glBufferData(GL_ARRAY_BUFFER, TotalLines * sizeof(LineVertex), lineVertices, GL_DYNAMIC_DRAW);
@@ -1140,7 +1542,7 @@ void rDrawAllLines(float* viewProj)
 
     rBindShader(lineShader);
     rSetShaderValue(viewProj, 0, GraphicType_Matrix4);
-    glBindVertexArray(lineVao);
+    BindVertexArray(lineVao);
     glDrawArrays(GL_LINES, 0, numLines);
     numLines = 0;
 }
@@ -1162,13 +1564,18 @@ static void CreateDefaultShaders()
 
 void rSetClockWise(bool val)
 {
-    glFrontFace(val ? GL_CW : GL_CCW);
+    if (StateChanged(g_GLState.clockWise != (signed char)val)) {
+        glFrontFace(val ? GL_CW : GL_CCW);
+        g_GLState.clockWise = (signed char)val;
+    }
 }
 
 void rInitRenderer()
 {
+    InvalidateStateCache();
     glEnable(GL_CULL_FACE);
     glFrontFace(GL_CCW);
+    g_GLState.clockWise = 0;
     glDepthFunc(GL_LEQUAL);
 
 #if defined(_DEBUG) || defined(DEBUG)
@@ -1190,19 +1597,20 @@ void rInitRenderer()
 
 void rToggleDepthTest(bool val)
 {
-    void(*EnableDisable[2])(unsigned int) = { glDisable, glEnable};
-    EnableDisable[val](GL_DEPTH_TEST);
+    SetCapability(GL_DEPTH_TEST, &g_GLState.depthTest, val);
 }
 
 void rSetDepthWrite(bool val) 
 {
-    glDepthMask(val); 
+    if (StateChanged(g_GLState.depthWrite != (signed char)val)) {
+        glDepthMask(val); 
+        g_GLState.depthWrite = (signed char)val;
+    }
 }
 
 void rSetBlending(bool val)
 {
-    void(*EnableDisable[2])(unsigned int) = { glDisable, glEnable};
-    EnableDisable[val](GL_BLEND);
+    SetCapability(GL_BLEND, &g_GLState.blending, val);
 }
 
 void rSetBlendingFunction(rBlendFunc src, rBlendFunc dst)
@@ -1233,7 +1641,10 @@ void rClearDepthStencil()
 
 void rStencilMask(uint mask)
 {
-    glStencilMask(mask);
+    if (StateChanged(g_GLState.stencilMask != (int)mask)) {
+        glStencilMask(mask);
+        g_GLState.stencilMask = (int)mask;
+    }
 }
 
 void rStencilFunc(rCompare compare, uint ref, uint mask)
@@ -1260,12 +1671,12 @@ void rStencilOperation(rStencilOp op, rStencilOp fail, rStencilOp pass)
 
 void rStencilToggle(bool active)
 {
-    if (active) glEnable(GL_STENCIL_TEST); else glDisable(GL_STENCIL_TEST);
+    SetCapability(GL_STENCIL_TEST, &g_GLState.stencilTest, active);
 }
 
 void rScissorToggle(bool active)
 {
-    if (active) glEnable(GL_SCISSOR_TEST); else glDisable(GL_SCISSOR_TEST);
+    SetCapability(GL_SCISSOR_TEST, &g_GLState.scissorTest, active);
 }
 
 void rScissor(int x, int y, int width, int height)
@@ -1293,11 +1704,11 @@ void rClearColor(float r, float g, float b, float a)
 
 void rRenderFullScreen(Shader fullScreenShader, unsigned int texture)
 {
-    glUseProgram(fullScreenShader.handle);
-    glBindVertexArray(m_EmptyVAO);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glUniform1i(0, 0);// glUniform1i(glGetUniformLocation(fullScreenShader.handle, "tex"), 0);
+    rBindShader(fullScreenShader);
+    BindVertexArray(m_EmptyVAO);
+    SetActiveUnit(0);
+    BindTexture(GL_TEXTURE_2D, texture);
+    SetSamplerUnit(0, 0);// glUniform1i(glGetUniformLocation(fullScreenShader.handle, "tex"), 0);
     glDrawArrays(GL_TRIANGLES, 0, 3);
     CHECK_GL_ERROR();
 }
@@ -1309,38 +1720,38 @@ void rRenderFullScreen(unsigned int texture)
 
 void rRenderFullScreen()
 {
-    glBindVertexArray(m_EmptyVAO);
+    BindVertexArray(m_EmptyVAO);
     glDrawArrays(GL_TRIANGLES, 0, 3);
 }
 
 void rBindShader(Shader shader)
 {
-    glUseProgram(shader.handle);
+    UseProgram(shader.handle);
     currentShader = shader.handle;
     CHECK_GL_ERROR();
 }
 
 void rSetTexture2DArray(Texture texture, int index, unsigned int loc)
 {
-    glActiveTexture(GL_TEXTURE0 + index);
-    glBindTexture(GL_TEXTURE_2D_ARRAY, texture.handle);
-    glUniform1i(loc, index);
+    SetActiveUnit(index);
+    BindTexture(GL_TEXTURE_2D_ARRAY, texture.handle);
+    SetSamplerUnit(loc, index);
     CHECK_GL_ERROR();
 }
 
 void rSetTexture(Texture* texture, int index, unsigned int location)
 {
-    glActiveTexture(GL_TEXTURE0 + index);
-    glBindTexture(GL_TEXTURE_2D, texture->handle);
-    glUniform1i(location, index);
+    SetActiveUnit(index);
+    BindTexture(GL_TEXTURE_2D, texture->handle);
+    SetSamplerUnit(location, index);
     CHECK_GL_ERROR();
 }
 
 void rSetTexture(Texture texture, int index, unsigned int location)
 {
-    glActiveTexture(GL_TEXTURE0 + index);
-    glBindTexture(GL_TEXTURE_2D, texture.handle);
-    glUniform1i(location, index);
+    SetActiveUnit(index);
+    BindTexture(GL_TEXTURE_2D, texture.handle);
+    SetSamplerUnit(location, index);
     CHECK_GL_ERROR();
 }
 
@@ -1386,6 +1797,7 @@ void rDestroyRenderer()
     rDeleteShader(lineShader);
     glDeleteVertexArrays(1, &lineVao);
     glDeleteBuffers(1, &lineVbo);
+    if (g_DrawIDBuffer != 0) glDeleteBuffers(1, &g_DrawIDBuffer);
 
     delete[] g_TextureLoadBuffer;
     g_TextureLoadBuffer = nullptr;
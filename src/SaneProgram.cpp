@@ -1,6 +1,4 @@
 
-#include <thread>
-
 #include "include/Renderer.hpp"
 #include "include/Animation.hpp"
 #include "include/Platform.hpp"
@@ -14,6 +12,7 @@
 #include "include/Editor.hpp"
 #include "include/BVH.hpp"
 #include "include/TLAS.hpp"
+#include "include/JobSystem.hpp"
 
 #include "../ASTL/Additional/Profiler.hpp"
 #include "../ASTL/Math/Color.hpp"
@@ -23,6 +22,7 @@
 #include "../ASTL/Array.hpp"
 #include "../ASTL/String.hpp"
 #include "../ASTL/IO.hpp"
+#include "../ASTL/Random.hpp"
 
 PrefabID SpherePrefab = 0;
 static PrefabID MainScenePrefab = 0;
@@ -30,6 +30,21 @@ static PrefabID MainScenePrefab = 0;
 static PrefabID AnimatedPrefab = 0;
 static bool PauseMenuOpened = false;
 
+// background characters that are playing baked clips of the paladin, see: SceneRenderer::RenderBakedAnimations
+static const char* CrowdClips[] = { "Idle", "Walk" };
+static const int NumCrowdCharacters = 32;
+static BakedAnimInstance CrowdInstances[NumCrowdCharacters];
+
+// characters that are walking around in circles, each one has its own AnimationController.
+// they are evaluated in parallel with EvaluateLocomotionBatch on the simulation thread
+static const int NumAnimatedNPCs = 16;
+static AnimationController  NPCControllers[NumAnimatedNPCs];
+static AnimationController* NPCControllerPtrs[NumAnimatedNPCs];
+static LocomotionInput NPCInputs[NumAnimatedNPCs];
+static float   NPCAngles[NumAnimatedNPCs];     // position on the circle, simulation state
+static Matrix4 NPCSimTransforms[NumAnimatedNPCs]; // written by simulation thread
+static Matrix4 NPCTransforms[NumAnimatedNPCs];    // copied for the renderer in SyncNPCs
+
 // Editor.cpp
 extern int SelectedNodeIndex;
 extern int SelectedNodePrimitiveIndex;
@@ -66,6 +81,120 @@ void PrintPerfFn(const char* text)
 
 static void SetDoubleSidedMaterials(Prefab* mainScene);
 
+// gameplay and animation of the next frame runs on a worker thread while the main thread submits current frame to GL.
+// main thread owns the GL context, simulation only writes to characterController and bone palettes,
+// results are copied to the renderer with SyncWithRenderer after the job is finished (double buffering)
+static JobCounter SimulationJob;
+
+static void InitNPCs(Prefab* prefab)
+{
+    const AnimationController& player = characterController.mAnimController;
+    uint32_t randomState = Random::Seed32();
+
+    for (int i = 0; i < NumAnimatedNPCs; i++)
+    {
+        AnimationController* controller = &NPCControllers[i];
+        CreateAnimationController(prefab, controller, true, 58);
+        // same locomotion grid with the player
+        SmallMemCpy(controller->mLocomotionIndices, player.mLocomotionIndices, sizeof(player.mLocomotionIndices));
+        SmallMemCpy(controller->mLocomotionIndicesInv, player.mLocomotionIndicesInv, sizeof(player.mLocomotionIndicesInv));
+        NPCControllerPtrs[i] = controller;
+        NPCAngles[i] = Random::NextFloat01(Random::PCG2Next(randomState)) * TwoPI;
+        // half of them are walking, others are jogging
+        NPCInputs[i] = { 0.0f, (i & 1) ? 1.0f : 2.0f, 1.0f };
+        NPCSimTransforms[i] = Matrix4::Identity();
+    }
+}
+
+static void DestroyNPCs()
+{
+    for (int i = 0; i < NumAnimatedNPCs; i++)
+        ClearAnimationController(&NPCControllers[i]);
+}
+
+// runs on simulation thread
+static void SimulateNPCs(float deltaTime)
+{
+    const float radius = 6.0f;
+    float scale[3] = { 1.0f, 1.0f, 1.0f };
+
+    for (int i = 0; i < NumAnimatedNPCs; i++)
+    {
+        // walking speed of the clip is about 1.4 m/s, jogging is two times faster
+        float speed = NPCInputs[i].y * 1.4f;
+        NPCAngles[i] = Fract((NPCAngles[i] + speed * deltaTime / radius) / TwoPI) * TwoPI;
+
+        float angle = NPCAngles[i];
+        float center[2] = { -30.0f + float(i % 4) * 14.0f, 8.0f + float(i / 4) * 14.0f };
+        float position[3] = { center[0] + Cos(angle) * radius, 0.65f, center[1] + Sin(angle) * radius };
+        float rotation[4];
+        VecStore(rotation, QFromYAngle(-angle)); // looks to the tangent of the circle
+        NPCSimTransforms[i] = Matrix4::PositionRotationScale(position, rotation, scale);
+    }
+    EvaluateLocomotionBatch(NPCControllerPtrs, NPCInputs, NumAnimatedNPCs);
+}
+
+// main thread, simulation is not running
+static void SyncNPCs()
+{
+    for (int i = 0; i < NumAnimatedNPCs; i++)
+    {
+        AnimationController* controller = &NPCControllers[i];
+        if (controller->mLodScreenSize >= 0.0f)
+            controller->SetLODFromScreenSize(controller->mLodScreenSize);
+        NPCTransforms[i] = NPCSimTransforms[i];
+    }
+}
+
+static void RenderNPCs(bool shadow)
+{
+    using namespace SceneRenderer;
+    if (shadow) RenderShadowOfAnimatedInstances(&g_CurrentScene, AnimatedPrefab, NPCControllerPtrs, NPCTransforms, NumAnimatedNPCs);
+    else        RenderAnimatedInstances(&g_CurrentScene, AnimatedPrefab, NPCControllerPtrs, NPCTransforms, NumAnimatedNPCs);
+}
+
+static void SimulateNextFrame(void* data)
+{
+    const bool isSponza = false;
+    float deltaTime = (float)GetDeltaTime();
+    characterController.Update(deltaTime, isSponza);
+    SimulateNPCs(deltaTime);
+}
+
+// grid of characters behind the player, clips and times are random so they don't move in sync
+static void InitCrowd()
+{
+    BakedAnimations* bake = g_CurrentScene.GetPrefab(AnimatedPrefab)->bakedAnimations;
+    int numClips = bake ? bake->numClips : 0;
+    uint32_t randomState = Random::Seed32();
+
+    float rotation[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+    float scale[3]    = { 1.0f, 1.0f, 1.0f };
+
+    for (int i = 0; i < NumCrowdCharacters; i++)
+    {
+        float position[3] = { -46.0f + float(i % 8) * 2.0f, 0.65f, -24.0f - float(i / 8) * 2.0f };
+        CrowdInstances[i].transform = Matrix4::PositionRotationScale(position, rotation, scale);
+        CrowdInstances[i].clip = numClips > 0 ? i % numClips : 0;
+        CrowdInstances[i].time = Random::NextFloat01(Random::PCG2Next(randomState)) * 10.0f;
+    }
+}
+
+static void UpdateCrowd()
+{
+    for (int i = 0; i < NumCrowdCharacters; i++)
+        CrowdInstances[i].time += (float)GetDeltaTime();
+}
+
+static void RenderCrowd(bool shadow)
+{
+    if (g_CurrentScene.GetPrefab(AnimatedPrefab)->bakedAnimations == nullptr)
+        return;
+    
+    if (shadow) SceneRenderer::RenderShadowOfBakedAnimations(&g_CurrentScene, AnimatedPrefab, CrowdInstances, NumCrowdCharacters);
+    else        SceneRenderer::RenderBakedAnimations(&g_CurrentScene, AnimatedPrefab, CrowdInstances, NumCrowdCharacters);
+}
+
 extern void InitTerrain();
 extern void UpdateTerrain(CameraBase* camera);
 extern void RenderTerrain(CameraBase* camera);
@@ -73,6 +202,7 @@ extern void RenderTerrain(CameraBase* camera);
 // return 1 if success
 int AXStart()
 {
+    InitJobSystem();
     g_CurrentScene.Init();
     InitBVH();
 
@@ -90,11 +220,12 @@ int AXStart()
         return 0;
     }
 
-    if (!g_CurrentScene.ImportPrefab(&AnimatedPrefab, "Assets/Meshes/Paladin/Paladin.gltf", 1.0f))
+    if (!g_CurrentScene.ImportPrefab(&AnimatedPrefab, "Assets/Meshes/Paladin/Paladin.gltf", 1.0f, CrowdClips, ArraySize(CrowdClips)))
     {
         AX_ERROR("gltf scene load failed2");
         return 0;
     }
+    InitCrowd();
     
     uInitialize();
     uSetFloat(uf::TextScale, 0.71f);
@@ -103,10 +234,16 @@ int AXStart()
     MemsetZero(&characterController, sizeof(CharacterController));
     Prefab* paladin = g_CurrentScene.GetPrefab(AnimatedPrefab); 
     characterController.Start(paladin);
+    InitNPCs(paladin);
 
     SceneRenderer::Init();
     InitTerrain();
 
+    // first frame has nothing to overlap with
+    characterController.SyncWithRenderer();
+    SyncNPCs();
+    SimulateNextFrame(nullptr);
+
     wSetWindowResizeCallback(WindowResizeCallback);
     wSetKeyPressCallback(KeyPressCallback);
 
@@ -148,6 +285,7 @@ void AXLoop(bool canRender)
 
     perfTxtPos = { 1100.0f, 500.0f };
     BeginProfile(PrintPerfFn);
+    rBeginFrameStats(); // gl state cache counters of the last frame are ready
     
     uBegin(); // user interface begin
     
@@ -161,17 +299,22 @@ void AXLoop(bool canRender)
     
         currentScene->Update();
     
-        float deltaTime = (float)GetDeltaTime();
-            
-        // animate and control the movement of character
-        const bool isSponza = false;
-        characterController.Update(deltaTime, isSponza);
+        // publish the character that is simulated while previous frame was rendering, then start simulating the next frame.
+        // bone palettes are uploaded before simulation thread writes them again
+        characterController.SyncWithRenderer();
+        SyncNPCs();
         AnimationController* animController = &characterController.mAnimController;
+        UploadBonePalettes(); // one upload for all of the animated characters
+        RunJobAsync(SimulateNextFrame, nullptr, &SimulationJob);
+        UpdateCrowd();
         
         if (true) 
         {
             BeginShadowRendering(currentScene);
                 RenderShadowOfPrefab(currentScene, MainScenePrefab, nullptr);
+                RenderShadowOfSceneContent(currentScene);
+                RenderCrowd(true);
+                RenderNPCs(true);
                 // don't render shadow of character, we will fake it.
                 // RenderShadowOfPrefab(currentScene, AnimatedPrefab, animController);
             EndShadowRendering();
@@ -182,6 +325,9 @@ void AXLoop(bool canRender)
             RenderPrefab(currentScene, MainScenePrefab, nullptr);
             RenderPrefab(currentScene, AnimatedPrefab, animController);
             // RenderPrefab(currentScene, SpherePrefab, nullptr);
+            RenderAllSceneContent(currentScene);
+            RenderCrowd(false);
+            RenderNPCs(false);
         }
         
         RenderTerrain(camera);
@@ -207,6 +353,9 @@ void AXLoop(bool canRender)
     
     uRender(); // < user interface end 
     
+    // input and delta time are changed by the platform after we return
+    WaitJobs(&SimulationJob);
+
     EndAndPrintProfile();
 
     // todo material system
@@ -216,12 +365,15 @@ extern void TerrainDestroy();
 
 void AXExit()
 {
+    WaitJobs(&SimulationJob);
+    DestroyJobSystem();
     DestroyBVH();
     TerrainDestroy();
     uDestroy();
     EditorDestroy();
     
-    g_CurrentScene.Destroy();
     characterController.Destroy();
+    DestroyNPCs();
+    g_CurrentScene.Destroy();
     SceneRenderer::Destroy();
 }
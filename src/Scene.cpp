@@ -8,6 +8,7 @@
 #include "../ASTL/Random.hpp"
 
 #include "include/AssetManager.hpp"
+#include "include/Animation.hpp"
 #include "include/Platform.hpp"
 #include "include/BVH.hpp"
 #include "include/TLAS.hpp"
@@ -27,13 +28,17 @@ void Scene::Destroy()
         Prefab* prefab = &m_LoadedPrefabs[i];
         rDeleteMesh(prefab->bigMesh);
         delete[] prefab->globalNodeTransforms;
+        FreePrimitiveBounds(&prefab->worldBounds);
+        delete[] prefab->skeletonNodes;
+        delete[] prefab->skeletonParents;
+        
+        if (prefab->bakedAnimations) {
+            FreeBakedAnimations(prefab->bakedAnimations);
+            delete prefab->bakedAnimations;
+        }
         delete prefab->tlas;
 
-        if (prefab->gpuTextures) {
-            for (int i = 0; i < prefab->numTextures; i++) {
-                rDeleteTexture(prefab->gpuTextures[i]);
-            }
-        }
+        CloseTexturePack(prefab->texturePack);
 
         for (int s = 0; s < prefab->numSkins; s++)
         {
@@ -49,10 +54,12 @@ void Scene::Destroy()
         }
 
         delete[] prefab->gpuTextures;
+        delete[] prefab->materialUVRects;
 
         FreeSceneBundle((SceneBundle*)prefab);
     }
     m_LoadedPrefabs.Clear();
+    ClearPoseCache();
 }
 
 void Scene::Save(const char* path)
@@ -211,7 +218,65 @@ void Scene::RemoveLight(MeshId id)
     lights.RemoveUnordered(id & 0x7FFFFFFF);
 }
 
-int Scene::ImportPrefab(PrefabID* sceneID, const char* inPath, float scale)
+// small textures are in atlases, we need to remap the uv's of the materials that are using them
+static void CreateMaterialUVRects(Prefab* prefab)
+{
+    if (prefab->numMaterials == 0) 
+        return;
+    
+    prefab->materialUVRects = new xyzw[prefab->numMaterials * 3];
+    
+    for (int i = 0; i < prefab->numMaterials; i++)
+    {
+        AMaterial& material = prefab->materials[i];
+        int metalicRoughnessIndex = material.metallicRoughnessTexture.index;
+        if (metalicRoughnessIndex == UINT16_MAX)
+            metalicRoughnessIndex = material.specularTexture.index;
+
+        // same with RenderPrimitive, albedo and normal indexes are texture indices, metallic roughness is image index
+        int albedoIndex = material.baseColorTexture.index;
+        int normalIndex = material.GetNormalTexture().index;
+        int images[3] = {
+            albedoIndex != UINT16_MAX && albedoIndex < prefab->numTextures ? prefab->textures[albedoIndex].source : -1,
+            normalIndex != UINT16_MAX && normalIndex < prefab->numTextures ? prefab->textures[normalIndex].source : -1,
+            metalicRoughnessIndex != UINT16_MAX ? metalicRoughnessIndex : -1
+        };
+
+        for (int j = 0; j < 3; j++)
+        {
+            xyzw& rect = prefab->materialUVRects[i * 3 + j];
+            rect = { 1.0f, 1.0f, 0.0f, 0.0f };
+            if (images[j] != -1) 
+                GetPackTextureAtlasRect(prefab->texturePack, images[j], &rect.x);
+        }
+    }
+}
+
+static void BakeSelectedClips(Prefab* prefab, const char** bakeClips, int numBakeClips)
+{
+    int clipIndices[32];
+    int numClips = 0;
+    ASSERTR(numBakeClips <= 32, numBakeClips = 32);
+
+    for (int c = 0; c < numBakeClips; c++)
+    {
+        int len = StringLength(bakeClips[c]);
+        int index = -1;
+        for (int a = 0; a < prefab->numAnimations && index == -1; a++)
+            if (StringEqual(prefab->animations[a].name, bakeClips[c], len))
+                index = a;
+
+        if (index == -1) AX_WARN("couldn't find animation to bake %s", bakeClips[c]);
+        else clipIndices[numClips++] = index;
+    }
+
+    // baking needs skeleton hierarchy
+    Prefab::CreateSkeletonHierarchy(prefab);
+    prefab->bakedAnimations = new BakedAnimations();
+    BakeAnimations(prefab, prefab->bakedAnimations, clipIndices, numClips);
+}
+
+int Scene::ImportPrefab(PrefabID* sceneID, const char* inPath, float scale, const char** bakeClips, int numBakeClips)
 {
     // There will be many mesh instances they are going to use ushort
     ASSERT(m_LoadedPrefabs.Size() < UINT16_MAX); 
@@ -264,23 +329,35 @@ int Scene::ImportPrefab(PrefabID* sceneID, const char* inPath, float scale)
 
         // BuildBVH((SceneBundle*)scene);
 
-        parsed &= SaveGLTFBinary((SceneBundle*)scene, path); ASSERT(parsed);
+        if (scene->numSkins > 0 && numBakeClips > 0)
+            BakeSelectedClips(scene, bakeClips, numBakeClips);
+
+        parsed &= SaveGLTFBinary((SceneBundle*)scene, path, scene->bakedAnimations); ASSERT(parsed);
         CompressSaveSceneImages(scene, path); // save textures as binary
     }
     else
     {
-        parsed = LoadSceneBundleBinary(path, (SceneBundle*)scene);
+        BakedAnimations bake = {};
+        parsed = LoadSceneBundleBinary(path, (SceneBundle*)scene, &bake);
+        if (bake.numClips > 0) {
+            scene->bakedAnimations = new BakedAnimations();
+            *scene->bakedAnimations = bake;
+        }
         // BuildBVH(scene);
     }
 
     if (!parsed)
         return 0;
 
+    if (scene->bakedAnimations)
+        UploadBakedAnimations(scene->bakedAnimations);
+
     // Load to GPU
     if (scene->numImages == 0) scene->gpuTextures = nullptr; 
     else scene->gpuTextures = new Texture[scene->numImages]{};
 
-    LoadSceneImages(path, scene->gpuTextures, scene->numImages);
+    scene->texturePack = OpenSceneImages(path, scene->gpuTextures, scene->numImages);
+    CreateMaterialUVRects(scene);
     
     // Load AABB's
     for (int i = 0; i < scene->numMeshes; i++)
@@ -315,6 +392,18 @@ int Scene::ImportPrefab(PrefabID* sceneID, const char* inPath, float scale)
     
     scene->globalNodeTransforms = new Matrix4[scene->numNodes];
     scene->UpdateGlobalNodeTransforms(scene->GetRootNodeIdx(), Matrix4::Identity());
+    scene->UpdateWorldBounds();
+
+    // hierarchy for frustum culling of camera and shadows
+    if (scene->worldBounds.numPrimitives > 0)
+    {
+        scene->tlas = new TLAS(scene);
+        if (scene->tlas->blasCount > 0) 
+            scene->tlas->Build();
+    }
+
+    if (scene->numSkins > 0 && scene->skeletonNodes == nullptr)
+        Prefab::CreateSkeletonHierarchy(scene);
 
     // create big mesh that contains all of the vertices and indices of an scene
     APrimitive primitive  = scene->meshes[0].primitives[0];
@@ -325,6 +414,10 @@ int Scene::ImportPrefab(PrefabID* sceneID, const char* inPath, float scale)
     primitive.indexType   = GraphicType_UnsignedInt;
     bool isSkined = (bool)(scene->skins != nullptr);
     rCreateMeshFromPrimitive(&primitive, &scene->bigMesh, isSkined);
+
+    // primitives are drawn with multi draw indirect when supported, see: SceneRenderer::SubmitDrawItems
+    if (rSupportsMultiDrawIndirect())
+        rMeshEnableDrawID(scene->bigMesh);
     return parsed;
 }
 
@@ -346,6 +439,11 @@ Prefab* Scene::GetPrefab(PrefabID scene)
     return &m_LoadedPrefabs[scene];
 }
 
+Texture Prefab::GetGPUTexture(int index)
+{
+    return RequestPackTexture(texturePack, textures[index].source);
+}
+
 void Prefab::UpdateGlobalNodeTransforms(int nodeIndex, Matrix4 parentMat)
 {
     ANode* node = &nodes[nodeIndex];
@@ -357,6 +455,107 @@ void Prefab::UpdateGlobalNodeTransforms(int nodeIndex, Matrix4 parentMat)
     }
 }
 
+void AllocatePrimitiveBounds(PrimitiveBounds* bounds, int count)
+{
+    int capacity = (count + 3) & ~3;
+    int numWords = (capacity + 63) / 64;
+    // one allocation for all streams
+    size_t size = capacity * (sizeof(float) * 6 + sizeof(int) * 2) + numWords * sizeof(uint64_t);
+    char* buffer = (char*)AllocAligned(size, 16);
+    
+    bounds->numPrimitives = count;
+    bounds->capacity = capacity;
+    bounds->minX = (float*)buffer; buffer += capacity * sizeof(float);
+    bounds->minY = (float*)buffer; buffer += capacity * sizeof(float);
+    bounds->minZ = (float*)buffer; buffer += capacity * sizeof(float);
+    bounds->maxX = (float*)buffer; buffer += capacity * sizeof(float);
+    bounds->maxY = (float*)buffer; buffer += capacity * sizeof(float);
+    bounds->maxZ = (float*)buffer; buffer += capacity * sizeof(float);
+    bounds->nodeIndices      = (int*)buffer; buffer += capacity * sizeof(int);
+    bounds->primitiveIndices = (int*)buffer; buffer += capacity * sizeof(int);
+    bounds->visibility       = (uint64_t*)buffer;
+    MemsetZero(bounds->visibility, numWords * sizeof(uint64_t));
+
+    // empty boxes, culling always rejects them
+    for (int i = count; i < capacity; i++)
+    {
+        bounds->minX[i] = bounds->minY[i] = bounds->minZ[i] = +1e30f;
+        bounds->maxX[i] = bounds->maxY[i] = bounds->maxZ[i] = -1e30f;
+        bounds->nodeIndices[i] = bounds->primitiveIndices[i] = 0;
+    }
+}
+
+void FreePrimitiveBounds(PrimitiveBounds* bounds)
+{
+    FreeAligned(bounds->minX); // all of the bound arrays are in one buffer
+    MemsetZero(bounds, sizeof(PrimitiveBounds));
+}
+
+void SetPrimitiveBounds(PrimitiveBounds* bounds, int index, Vector4x32f localMin, Vector4x32f localMax, const Matrix4& model)
+{
+    // transform the center and extents, instead of 8 corners
+    Vector4x32f center  = VecMul(VecAdd(localMin, localMax), VecSet1(0.5f));
+    Vector4x32f extents = VecSub(localMax, center);
+    center = VecAdd(VecAdd(VecMul(VecSwizzle(center, 0, 0, 0, 0), model.r[0]),
+                           VecMul(VecSwizzle(center, 1, 1, 1, 1), model.r[1])),
+                    VecAdd(VecMul(VecSwizzle(center, 2, 2, 2, 2), model.r[2]), model.r[3]));
+    
+    // |m| * extents
+    Vector4x32f worldExtents = VecAdd(VecAdd(VecMul(VecSwizzle(extents, 0, 0, 0, 0), VecMax(model.r[0], VecNeg(model.r[0]))),
+                                             VecMul(VecSwizzle(extents, 1, 1, 1, 1), VecMax(model.r[1], VecNeg(model.r[1])))),
+                                             VecMul(VecSwizzle(extents, 2, 2, 2, 2), VecMax(model.r[2], VecNeg(model.r[2]))));
+    float vmin[4], vmax[4];
+    VecStore(vmin, VecSub(center, worldExtents));
+    VecStore(vmax, VecAdd(center, worldExtents));
+    bounds->minX[index] = vmin[0], bounds->minY[index] = vmin[1], bounds->minZ[index] = vmin[2];
+    bounds->maxX[index] = vmax[0], bounds->maxY[index] = vmax[1], bounds->maxZ[index] = vmax[2];
+}
+
+static void CreatePrefabBounds(Prefab* prefab)
+{
+    int count = 0;
+    for (int i = 0; i < prefab->numNodes; i++)
+    {
+        ANode& node = prefab->nodes[i];
+        if (node.type == 0 && node.index != -1)
+            count += prefab->meshes[node.index].numPrimitives;
+    }
+
+    PrimitiveBounds& bounds = prefab->worldBounds;
+    AllocatePrimitiveBounds(&bounds, count);
+
+    int index = 0;
+    for (int i = 0; i < prefab->numNodes; i++)
+    {
+        ANode& node = prefab->nodes[i];
+        if (node.type != 0 || node.index == -1)
+            continue;
+        
+        for (int j = 0; j < prefab->meshes[node.index].numPrimitives; j++, index++)
+        {
+            bounds.nodeIndices[index] = i;
+            bounds.primitiveIndices[index] = j;
+        }
+    }
+}
+
+void Prefab::UpdateWorldBounds()
+{
+    if (worldBounds.minX == nullptr)
+        CreatePrefabBounds(this);
+
+    PrimitiveBounds& bounds = worldBounds;
+    for (int i = 0; i < bounds.numPrimitives; i++)
+    {
+        const APrimitive& primitive = meshes[nodes[bounds.nodeIndices[i]].index].primitives[bounds.primitiveIndices[i]];
+        SetPrimitiveBounds(&bounds, i, VecLoad(primitive.min), VecLoad(primitive.max), globalNodeTransforms[bounds.nodeIndices[i]]);
+    }
+
+    // tlas is used for culling, tree structure stays the same only bounds change
+    if (tlas) 
+        tlas->Refit();
+}
+
 int Prefab::FindAnimRootNodeIndex(Prefab* prefab)
 {
     if (prefab->skins == nullptr)
@@ -389,6 +588,31 @@ int Prefab::FindAnimRootNodeIndex(Prefab* prefab)
     return skeletonNode;
 }
 
+void Prefab::CreateSkeletonHierarchy(Prefab* prefab)
+{
+    prefab->skeletonNodes   = new int[prefab->numNodes];
+    prefab->skeletonParents = new int[prefab->numNodes];
+
+    int rootIndex = FindAnimRootNodeIndex(prefab);
+    prefab->skeletonNodes[0]   = rootIndex;
+    prefab->skeletonParents[0] = -1;
+    int count = 1;
+
+    // skeletonNodes array is also the queue of the breadth first traversal
+    for (int i = 0; i < count; i++)
+    {
+        ANode* node = &prefab->nodes[prefab->skeletonNodes[i]];
+        for (int c = 0; c < node->numChildren; c++)
+        {
+            ASSERTR(count < prefab->numNodes, break); // cyclic hierarchy
+            prefab->skeletonNodes[count]   = node->children[c];
+            prefab->skeletonParents[count] = prefab->skeletonNodes[i];
+            count++;
+        }
+    }
+    prefab->numSkeletonNodes = count;
+}
+
 int Prefab::FindNodeFromName(Prefab* prefab, const char* name)
 {
     int len = StringLength(name);
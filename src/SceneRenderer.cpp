@@ -38,6 +38,8 @@
 #include "include/HBAO.hpp"
 #include "include/BVH.hpp"
 #include "include/TLAS.hpp"
+#include "include/OcclusionCulling.hpp"
+#include "include/JobSystem.hpp"
 
 #include "../ASTL/IO.hpp"
 #include "../ASTL/Array.hpp"
@@ -45,6 +47,8 @@
 #include "../ASTL/String.hpp"
 #include "../ASTL/Math/Color.hpp"
 
+#include <math.h> // powf
+
 // from Renderer.cpp
 extern unsigned int g_DefaultTexture;
 
@@ -56,6 +60,21 @@ extern uint g_CurrTriangleFace;
 
 extern void TerrainShowEditor();
 
+namespace ShadowSettings
+{
+    const int ShadowMapSize = 1 << (11 + (!IsAndroid() << 1)); // mobile 2k, pc 4k, atlas of 2x2 cascades
+    const int NumCascades = 4;
+    const int NumDynamicCascades = 2; // closer cascades are re-rendered whenever camera moves, others are cached
+    const int CascadeSize = ShadowMapSize / 2;
+
+    float ShadowDistance = 160.0f; // no shadows after this distance
+    float SplitLambda    = 0.8f;   // 0 uniform splits, 1 logarithmic splits
+    float CasterDistance = 96.0f;  // cascades are extended towards the sun for casters outside of the camera frustum
+    float CacheMargin    = 0.25f;  // cached cascades are fit bigger than needed, relative to radius
+
+    float Bias = 0.001f;
+}
+
 namespace SceneRenderer
 {
     CameraBase*  m_Camera;
@@ -63,7 +82,21 @@ namespace SceneRenderer
     PlayerCamera m_PlayerCamera;
 
     Matrix4      m_ViewProjection;
-    Matrix4      m_LightMatrix;
+    bool         m_CameraUpdated = false; // camera is updated once per frame, before shadows
+
+    struct ShadowCascade
+    {
+        Matrix4  viewProjection; // light view * ortho, used for rendering and culling
+        Matrix4  shadowMatrix;   // world to shadow atlas uv and depth, used in gbuffer shader
+        Vector3f center;         // fitted sphere in world space
+        float    radius;
+        bool     needsRedraw;
+    };
+
+    ShadowCascade m_Cascades[ShadowSettings::NumCascades];
+    float         m_CascadeSplits[ShadowSettings::NumCascades]; // far distance of the cascades in view space
+    Vector3f      m_CascadeSunDir;
+    bool          m_AnyCascadeRedraw = false;
 
     Shader       m_ShadowShader;
     Shader       m_GBufferShader;
@@ -116,8 +149,10 @@ namespace SceneRenderer
     GBuffer m_Gbuffer;
 
     // Gbuffer uniform locations
-    int lAlbedo, lNormalMap, lHasNormalMap, lMetallicMap, lShadowMap, lLightMatrix, 
-        lModel , lHasAnimation, lSunDirG, lViewProj, lAnimTex;
+    int lAlbedoRect, lNormalRect, lMetallicRect; // uv remapping for atlased textures
+    int lAlbedo, lNormalMap, lHasNormalMap, lMetallicMap, lShadowMap, lCascadeSplits, lCameraPos, lCameraForward, 
+        lModel , lHasAnimation, lSunDirG, lViewProj, lAnimTex, lAnimRow, lInstanceTex, lInstanceOffset, lBakedColumnWidth, lIndirect;
+    int lShadowMatrices[ShadowSettings::NumCascades];
 
     // Deferred uniform locations
     int lSunDir, lPlayerPos, lAlbedoTex, lRoughnessTex, lNormalTex, lDepthMap, lInvViewProj, lViewPos, lAmbientOclussionTex;
@@ -152,9 +187,90 @@ namespace SceneRenderer
     int lNumSpotLights;
 
     // Shadow uniform locations
-    int lShadowModel, lShadowLightMatrix;
+    int lShadowModel, lShadowLightMatrix, lShadowHasAnimation, lShadowAnimTex, lShadowAnimRow, lShadowInstanceTex, lShadowInstanceOffset, lShadowBakedColumnWidth;
+    
+    // render queue, RenderPrefab gathers visible primitives here, sorts them and then submits
+    struct DrawItem
+    {
+        uint64_t key;
+        int nodeIndex;
+        int primitiveIndex; // index in mesh primitives
+    };
+
+    Array<DrawItem> m_DrawItems;
+    Array<DrawItem> m_DrawItemsTemp; // radix sort needs second buffer
+
+    // draw items are gathered on worker threads into these, then merged into m_DrawItems. see: GatherDrawItems
+    constexpr int MaxGatherThreads = 8;
+    constexpr int MinGatherItemsPerThread = 512; // visible primitives or instances per list
     
-    Array<KeyValuePair<APrimitive*, Matrix4>> m_DelayedAlphaCutoffs;
+    // mesh instances are from different prefabs, so their materials are requested with the prefab
+    struct MaterialRequest { Prefab* prefab; int material; float screenSize; };
+
+    struct DrawList
+    {
+        Array<DrawItem> items;
+        Array<DrawItem> temp;
+        DrawItem* sorted; // items or temp, result of the radix sort
+        Array<float> materialScreenSizes; // biggest screen size of each material, textures are requested on main thread
+        Array<MaterialRequest> materialRequests; // same as materialScreenSizes for mesh instances
+        float maxScreenSize;
+        int numCulled;
+    };
+    DrawList m_DrawLists[MaxGatherThreads];
+    int m_NumGatheredLists; // lists that are filled in this frame, shown in editor
+
+    // key range of the sorted lists that one merge task outputs, see: MergeDrawLists
+    constexpr int MaxMergeTasks = 16;
+    struct MergeRange
+    {
+        int begin[MaxGatherThreads], end[MaxGatherThreads]; // item range in each list
+        int outOffset; // first index in m_DrawItems
+    };
+    MergeRange m_MergeRanges[MaxMergeTasks];
+    int m_NumMergeLists;
+
+    // per draw data of multi draw indirect, same layout with DrawData in 3DVert.glsl
+    struct IndirectDrawData
+    {
+        Matrix4 model;
+        int info[4]; // x = material index
+    };
+
+    IndirectBuffer m_IndirectBuffer; // handles are zero if multi draw indirect is not supported
+    Array<DrawElementsIndirectCommand> m_IndirectCommands;
+    Array<IndirectDrawData> m_IndirectDrawData;
+
+    PrimitiveBounds m_InstanceBounds = {}; // world bounds of Scene::m_MeshInstances
+
+    // m_InstanceBounds are computed with these, only the instances that are changed are updated
+    struct InstanceLocalBounds { float min[4], max[4]; };
+    Array<InstanceLocalBounds> m_InstanceLocalBounds; // union of the mesh primitives
+    Array<MeshInstance> m_InstanceMeshes;
+    Array<Matrix4> m_InstanceMatrices;
+
+    // model matrices of the visible mesh instances when drawing without multi draw indirect and in shadow pass.
+    // same layout with the first three texels of BakedInstanceData
+    struct MeshInstanceData { float transform[3][4]; };
+    constexpr int MaxMeshInstanceRows = 4096; // height of the texture, more instances are drawn in batches
+    Texture m_MeshInstanceTex;
+    Array<MeshInstanceData> m_MeshInstanceData;
+
+    // per instance data of baked animations, same layout with uInstanceTex in 3DVert.glsl
+    struct BakedInstanceData
+    {
+        float transform[3][4]; // first three columns of the matrix
+        float anim[4]; // x = first frame of the clip, y = number of frames, z = current frame
+    };
+
+    constexpr int MaxBakedInstances = 1024; // height of the instance texture, more instances are drawn in batches
+    Texture m_BakedInstanceTex;
+    Array<BakedInstanceData> m_BakedInstances; // visible instances
+    PrimitiveBounds m_BakedBounds = {};
+
+    // characters that share an animated prefab, each one has its own AnimationController. see: RenderAnimatedInstances
+    PrimitiveBounds m_AnimatedBounds = {};
+    Array<int> m_VisibleAnimated;
     AMaterial m_defaultMaterial;
 
     bool m_ShadowFollowCamera = false;
@@ -165,22 +281,6 @@ namespace SceneRenderer
     Vector3f m_CharacterPos;
 }
 
-namespace ShadowSettings
-{
-    const int ShadowMapSize = 1 << (11 + (!IsAndroid() << 1)); // mobile 2k, pc 4k
-    float OrthoSize   = 128.0f; // sponza 32.0f
-    float NearPlane   = 1.0f;
-    float FarPlane    = 192.0f;
-    
-    float Bias = 0.001f;
-    Vector3f OrthoOffset = { 32.0f, 56.0f, 5.0f };  // < bistro, sponza is 0,0,0
-
-    inline Matrix4 GetOrthoMatrix()
-    {
-        return Matrix4::OrthoRH(-OrthoSize, OrthoSize, -OrthoSize, OrthoSize, NearPlane, FarPlane);
-    }
-}
-
 namespace SceneRenderer 
 {
 
@@ -316,12 +416,29 @@ static void GetUniformLocations()
     lNormalMap      = rGetUniformLocation("uNormalMap");
     lHasNormalMap   = rGetUniformLocation("uHasNormalMap");
     lMetallicMap    = rGetUniformLocation("uMetallicRoughnessMap");
+    lAlbedoRect     = rGetUniformLocation("uAlbedoRect");
+    lNormalRect     = rGetUniformLocation("uNormalRect");
+    lMetallicRect   = rGetUniformLocation("uMetallicRect");
     lShadowMap      = rGetUniformLocation("uShadowMap");
-    lLightMatrix    = rGetUniformLocation("uLightMatrix");
+    lCascadeSplits  = rGetUniformLocation("uCascadeSplits");
+    lCameraPos      = rGetUniformLocation("uCameraPos");
+    lCameraForward  = rGetUniformLocation("uCameraForward");
     lModel          = rGetUniformLocation("uModel");
     lHasAnimation   = rGetUniformLocation("uHasAnimation");
     lViewProj       = rGetUniformLocation("uViewProj");
     lAnimTex        = rGetUniformLocation("uAnimTex");
+    lAnimRow        = rGetUniformLocation("uAnimRow");
+    lInstanceTex    = rGetUniformLocation("uInstanceTex");
+    lInstanceOffset = rGetUniformLocation("uInstanceOffset");
+    lBakedColumnWidth = rGetUniformLocation("uBakedColumnWidth");
+    lIndirect       = rGetUniformLocation("uIndirect");
+
+    char shadowMatrixText[] = "uShadowMatrices[0]";
+    for (int i = 0; i < ShadowSettings::NumCascades; i++)
+    {
+        shadowMatrixText[sizeof(shadowMatrixText) - 3] = '0' + i;
+        lShadowMatrices[i] = rGetUniformLocation(shadowMatrixText);
+    }
 
     rBindShader(m_DeferredPBRShader);
     lPlayerPos                  = rGetUniformLocation("uPlayerPos");
@@ -364,6 +481,12 @@ static void GetUniformLocations()
     // shadow locations
     lShadowModel       = rGetUniformLocation(m_ShadowShader, "model");
     lShadowLightMatrix = rGetUniformLocation(m_ShadowShader, "lightMatrix");
+    lShadowHasAnimation     = rGetUniformLocation(m_ShadowShader, "uHasAnimation");
+    lShadowAnimTex          = rGetUniformLocation(m_ShadowShader, "uAnimTex");
+    lShadowAnimRow          = rGetUniformLocation(m_ShadowShader, "uAnimRow");
+    lShadowInstanceTex      = rGetUniformLocation(m_ShadowShader, "uInstanceTex");
+    lShadowInstanceOffset   = rGetUniformLocation(m_ShadowShader, "uInstanceOffset");
+    lShadowBakedColumnWidth = rGetUniformLocation(m_ShadowShader, "uBakedColumnWidth");
     
     rBindShader(m_MLAAShader);
     uMLAAColorTex   = rGetUniformLocation("uColorTex"); 
@@ -539,12 +662,160 @@ void Init()
     uint8_t whiteTexData[8 * 8];
     FillN(whiteTexData, (uint8_t)0xff, 8 * 8);
     m_WhiteTexture = rCreateTexture(8, 8, whiteTexData, TextureType_R8, TexFlags_ClampToEdge);
+
+    if (rSupportsMultiDrawIndirect())
+        m_IndirectBuffer = rCreateIndirectBuffer(MaxIndirectDraws, sizeof(IndirectDrawData));
+
+    m_BakedInstanceTex = rCreateTexture(4, MaxBakedInstances, nullptr, TextureType_RGBA32F, TexFlags_RawData);
+    m_MeshInstanceTex  = rCreateTexture(3, MaxMeshInstanceRows, nullptr, TextureType_RGBA32F, TexFlags_RawData);
     
     m_Initialized = true;
 }
 
+// camera is updated before shadows because cascades are fit to camera frustum, 
+// BeginRendering doesn't update it again in the same frame
+static void UpdateCamera()
+{
+    if (m_CameraUpdated) return;
+    m_Camera->Update();
+    m_ViewProjection = m_Camera->view * m_Camera->projection;
+    m_CameraUpdated = true;
+}
+
+/*//////////////////////////////////////////////////////////////////////////*/
+/*                            Shadow Cascades                               */
+/*//////////////////////////////////////////////////////////////////////////*/
+
+// practical split scheme, blend of logarithmic and uniform splits
+static void CalculateCascadeSplits(float nearClip, float farClip, float* outSplits)
+{
+    for (int i = 0; i < ShadowSettings::NumCascades; i++)
+    {
+        float p = float(i + 1) / float(ShadowSettings::NumCascades);
+        float logSplit     = nearClip * powf(farClip / nearClip, p);
+        float uniformSplit = nearClip + (farClip - nearClip) * p;
+        outSplits[i] = uniformSplit + (logSplit - uniformSplit) * ShadowSettings::SplitLambda;
+    }
+}
+
+// bounding sphere of the camera frustum slice between near and far distances
+static void FitSphereToFrustumSlice(float sliceNear, float sliceFar, Vector4x32f* outCenter, float* outRadius)
+{
+    float tanHalfFov = Tan(m_Camera->verticalFOV * DegToRad * 0.5f);
+    float aspect = (float)m_Camera->viewportSize.x / (float)MAX(m_Camera->viewportSize.y, 1);
+    Vector4x32f position = VecSetR(m_Camera->position.x, m_Camera->position.y, m_Camera->position.z, 1.0f);
+    Vector4x32f front    = VecSetR(m_Camera->Front.x, m_Camera->Front.y, m_Camera->Front.z, 0.0f);
+    Vector4x32f right    = VecSetR(m_Camera->Right.x, m_Camera->Right.y, m_Camera->Right.z, 0.0f);
+    Vector4x32f up       = VecSetR(m_Camera->Up.x   , m_Camera->Up.y   , m_Camera->Up.z   , 0.0f);
+
+    Vector4x32f corners[8];
+    Vector4x32f center = VecZero();
+    for (int i = 0; i < 8; i++)
+    {
+        float distance = i & 4 ? sliceFar : sliceNear;
+        float x = (i & 1 ? 1.0f : -1.0f) * distance * tanHalfFov * aspect;
+        float y = (i & 2 ? 1.0f : -1.0f) * distance * tanHalfFov;
+        corners[i] = VecAdd(VecAdd(position, VecMul(front, VecSet1(distance))), 
+                            VecAdd(VecMul(right, VecSet1(x)), VecMul(up, VecSet1(y))));
+        center = VecAdd(center, corners[i]);
+    }
+    center = VecMul(center, VecSet1(1.0f / 8.0f));
+
+    float radius = 0.0f;
+    for (int i = 0; i < 8; i++)
+        radius = MAX(radius, Vec3Lenf(VecSub(corners[i], center)));
+    
+    // quantize the radius so small camera rotations doesn't change the size of the cascade
+    *outRadius = Floor(radius * 16.0f + 1.0f) / 16.0f;
+    *outCenter = center;
+}
+
+static void FitCascade(int index, Vector4x32f center, float radius, const Matrix4& lightView)
+{
+    ShadowCascade& cascade = m_Cascades[index];
+    Vec3Store(&cascade.center.x, center);
+    cascade.radius = radius;
+
+    // snap to shadow map texels in light space, otherwise shadow edges are flickering while camera moves
+    float lightSpace[4];
+    VecStore(lightSpace, Vector3Transform(center, lightView.r));
+    float texelSize = (radius * 2.0f) / (float)ShadowSettings::CascadeSize;
+    lightSpace[0] = Floor(lightSpace[0] / texelSize) * texelSize;
+    lightSpace[1] = Floor(lightSpace[1] / texelSize) * texelSize;
+    
+    // light looks towards -z, extend near plane to the sun for the casters outside of the camera frustum
+    Matrix4 ortho = Matrix4::OrthoRH(lightSpace[0] - radius, lightSpace[0] + radius, 
+                                     lightSpace[1] - radius, lightSpace[1] + radius, 
+                                     -lightSpace[2] - radius - ShadowSettings::CasterDistance, -lightSpace[2] + radius);
+    cascade.viewProjection = lightView * ortho;
+
+    // ndc to the cascade's quarter of the atlas, xy: [-1, 1] -> [offset, offset + 0.5] z: [-1, 1] -> [0, 1]
+    float offsetX = (index & 1) * 0.5f + 0.25f;
+    float offsetY = (index >> 1) * 0.5f + 0.25f;
+    Matrix4 atlas = Matrix4::Identity();
+    atlas.r[0] = VecSetR(0.25f, 0.0f , 0.0f, 0.0f);
+    atlas.r[1] = VecSetR(0.0f , 0.25f, 0.0f, 0.0f);
+    atlas.r[2] = VecSetR(0.0f , 0.0f , 0.5f, 0.0f);
+    atlas.r[3] = VecSetR(offsetX, offsetY, 0.5f, 1.0f);
+    cascade.shadowMatrix = cascade.viewProjection * atlas;
+}
+
+// fits cascades to the camera frustum, decides which cascades are going to be rendered this frame.
+// dynamic cascades are rendered every frame because characters move even if the camera doesn't.
+// cached cascades are fit bigger than needed, they are re-rendered when the camera leaves the area that they cover.
+// only one cached cascade is re-rendered per frame, unless redrawAll is true
+static void UpdateShadowCascades(Vector3f sunDir, bool redrawAll)
+{
+    redrawAll |= Vec3Lenf(VecSub(VecSetR(sunDir.x, sunDir.y, sunDir.z, 0.0f), 
+                                 VecSetR(m_CascadeSunDir.x, m_CascadeSunDir.y, m_CascadeSunDir.z, 0.0f))) > 0.0001f;
+    m_CascadeSunDir = sunDir;
+
+    float shadowDistance = MIN(ShadowSettings::ShadowDistance, m_Camera->farClip);
+    CalculateCascadeSplits(m_Camera->nearClip, shadowDistance, m_CascadeSplits);
+
+    Matrix4 lightView = Matrix4::LookAtRH(Vector3f::Zero(), -sunDir, Vector3f::Up());
+    bool cachedRedrawn = false;
+    m_AnyCascadeRedraw = false;
+
+    for (int i = 0; i < ShadowSettings::NumCascades; i++)
+    {
+        ShadowCascade& cascade = m_Cascades[i];
+        float sliceNear = i == 0 ? m_Camera->nearClip : m_CascadeSplits[i - 1];
+        
+        Vector4x32f center; float radius;
+        FitSphereToFrustumSlice(sliceNear, m_CascadeSplits[i], &center, &radius);
+
+        // cached cascades: if new sphere is inside of the old one, old shadow map still covers the slice
+        float moved = Vec3Lenf(VecSub(center, VecSetR(cascade.center.x, cascade.center.y, cascade.center.z, 1.0f)));
+        bool covered = moved + radius <= cascade.radius + 0.001f;
+        bool isDynamic = i < ShadowSettings::NumDynamicCascades;
+        
+        cascade.needsRedraw = redrawAll || isDynamic || (!covered && !cachedRedrawn);
+        if (!cascade.needsRedraw) 
+            continue;
+
+        cachedRedrawn |= !isDynamic;
+        m_AnyCascadeRedraw = true;
+        if (!isDynamic) radius *= 1.0f + ShadowSettings::CacheMargin;
+        FitCascade(i, center, radius, lightView);
+    }
+}
+
+static void SetShadowUniforms()
+{
+    for (int i = 0; i < ShadowSettings::NumCascades; i++)
+        rSetShaderValue(m_Cascades[i].shadowMatrix.GetPtr(), lShadowMatrices[i], GraphicType_Matrix4);
+    
+    rSetShaderValue(m_CascadeSplits, lCascadeSplits, GraphicType_Vector4f);
+    rSetShaderValue(&m_Camera->position.x, lCameraPos, GraphicType_Vector3f);
+    rSetShaderValue(&m_Camera->Front.x, lCameraForward, GraphicType_Vector3f);
+    rSetTexture(m_ShadowTexture, 3, lShadowMap);
+}
+
 void BeginRendering()
 {
+    m_NumGatheredLists = 0;
+
     if (GetKeyPressed('L'))
     {
         if (m_Camera == &m_PlayerCamera) 
@@ -567,18 +838,83 @@ void BeginRendering()
     rClearDepthStencil();
     rStencilMask(0); // < don't draw anything to stencil
 
-    m_Camera->Update();
-    m_ViewProjection = m_Camera->view * m_Camera->projection;
+    UpdateCamera();
 
+    OcclusionBeginFrame(m_ViewProjection);
+    BeginTextureStreamingFrame();
     rBindShader(m_GBufferShader);
 
     rSetShaderValue(m_ViewProjection.GetPtr(), lViewProj, GraphicType_Matrix4);
-    rSetShaderValue(m_LightMatrix.GetPtr(), lLightMatrix, GraphicType_Matrix4);
+    SetShadowUniforms();
+}
 
-    // shadow uniforms
-    rSetShaderValue(m_LightMatrix.GetPtr(), lLightMatrix, GraphicType_Matrix4);
+/*//////////////////////////////////////////////////////////////////////////*/
+/*                            Frustum Culling                               */
+/*//////////////////////////////////////////////////////////////////////////*/
 
-    rSetTexture(m_ShadowTexture, 3, lShadowMap);
+enum FrustumPlane_
+{
+    FrustumPlane_Left, FrustumPlane_Right, FrustumPlane_Bottom, FrustumPlane_Top, FrustumPlane_Far, 
+    FrustumPlane_Near // last, so shadow culling can skip it by testing 5 planes
+};
+
+// gribb-hartmann, planes are not normalized because we only need the sign of the distance
+// matrix is row vector convention so we are using the columns
+static void ExtractFrustumPlanes(const Matrix4& viewProjection, float outPlanes[6][4])
+{
+    Matrix4 columns = Matrix4::Transpose(viewProjection);
+    VecStore(outPlanes[FrustumPlane_Left]  , VecAdd(columns.r[3], columns.r[0]));
+    VecStore(outPlanes[FrustumPlane_Right] , VecSub(columns.r[3], columns.r[0]));
+    VecStore(outPlanes[FrustumPlane_Bottom], VecAdd(columns.r[3], columns.r[1]));
+    VecStore(outPlanes[FrustumPlane_Top]   , VecSub(columns.r[3], columns.r[1]));
+    VecStore(outPlanes[FrustumPlane_Far]   , VecSub(columns.r[3], columns.r[2]));
+    VecStore(outPlanes[FrustumPlane_Near]  , VecAdd(columns.r[3], columns.r[2]));
+}
+
+// tests 4 boxes against a plane at once, for each plane we only test the corner that is furthest along the normal (p-vertex)
+// if it is behind any of the planes box is culled. results are written to bounds.visibility
+static int CullPrimitiveBounds(PrimitiveBounds& bounds, const float planes[][4], int numPlanes)
+{
+    int numVisible = 0;
+
+    for (int i = 0; i < bounds.capacity; i += 4)
+    {
+        Vector4x32f minX = VecLoad(bounds.minX + i), maxX = VecLoad(bounds.maxX + i);
+        Vector4x32f minY = VecLoad(bounds.minY + i), maxY = VecLoad(bounds.maxY + i);
+        Vector4x32f minZ = VecLoad(bounds.minZ + i), maxZ = VecLoad(bounds.maxZ + i);
+        Vector4x32f distance = VecSet1(1e30f);
+
+        for (int p = 0; p < numPlanes; p++)
+        {
+            const float* plane = planes[p];
+            Vector4x32f x = VecMul(plane[0] >= 0.0f ? maxX : minX, VecSet1(plane[0]));
+            Vector4x32f y = VecMul(plane[1] >= 0.0f ? maxY : minY, VecSet1(plane[1]));
+            Vector4x32f z = VecMul(plane[2] >= 0.0f ? maxZ : minZ, VecSet1(plane[2]));
+            distance = VecMin(distance, VecAdd(VecAdd(x, y), VecAdd(z, VecSet1(plane[3]))));
+        }
+
+        float distances[4];
+        VecStore(distances, distance);
+        uint64_t mask = 0;
+        for (int j = 0; j < 4; j++)
+            mask |= uint64_t(distances[j] >= 0.0f) << j;
+
+        bounds.visibility[i >> 6] |= mask << (i & 63);
+        numVisible += PopCount32((uint32_t)mask);
+    }
+    return numVisible;
+}
+
+// fills prefab->worldBounds.visibility, uses the tlas if prefab has one, otherwise tests all of the boxes
+static int CullPrefab(Prefab* prefab, const float planes[][4], int numPlanes)
+{
+    PrimitiveBounds& bounds = prefab->worldBounds;
+    MemsetZero(bounds.visibility, ((bounds.capacity + 63) / 64) * sizeof(uint64_t));
+
+    if (prefab->tlas != nullptr)
+        return prefab->tlas->CullFrustum(planes, numPlanes, bounds.visibility);
+    else
+        return CullPrimitiveBounds(bounds, planes, numPlanes);
 }
 
 static void RenderShadowOfNode(ANode* node, Prefab* prefab, Matrix4 parentMat)
@@ -608,10 +944,13 @@ static void RenderShadowOfNode(ANode* node, Prefab* prefab, Matrix4 parentMat)
     }
 }
 
-static void RenderShadows(Prefab* prefab, DirectionalLight& sunLight, AnimationController* animSystem)
+static void RenderShadows(Prefab* prefab, const Matrix4& lightMatrix, AnimationController* animSystem)
 {
     int hasAnimation = (int)(animSystem != nullptr);
-    if (hasAnimation) rSetTexture(animSystem->mMatrixTex, 0, rGetUniformLocation("uAnimTex"));
+    if (hasAnimation) {
+        rSetTexture(GetBonePaletteTexture(), 0, rGetUniformLocation("uAnimTex"));
+        rSetShaderValue(animSystem->mPaletteRow, rGetUniformLocation("uAnimRow"));
+    }
     rSetShaderValue(hasAnimation, rGetUniformLocation("uHasAnimation"));
 
     bool hasScene = prefab->numScenes > 0;
@@ -625,70 +964,78 @@ static void RenderShadows(Prefab* prefab, DirectionalLight& sunLight, AnimationC
     }
     else
     {
-        AScene defaultScene = prefab->scenes[prefab->defaultSceneIndex];
-        int numNodes = defaultScene.numNodes;
+        // casters between the light and the shadow frustum still cast shadows into it, 
+        // so near plane is not tested, it extends the boxes towards the light
+        float planes[6][4];
+        ExtractFrustumPlanes(lightMatrix, planes);
+        CullPrefab(prefab, planes, FrustumPlane_Near);
 
-        static Queue<int> nodeQueue = {};
-        nodeQueue.Enqueue(hasScene ? defaultScene.nodes[0] : 0);
+        const PrimitiveBounds& bounds = prefab->worldBounds;
+        int numWords = (bounds.capacity + 63) / 64;
+        int lastNode = -1;
 
-        while (!nodeQueue.Empty())
+        for (int w = 0; w < numWords; w++)
         {
-            int nodeIndex = nodeQueue.Dequeue();
-            ANode* node = prefab->nodes + nodeIndex;
-            Matrix4 model = prefab->globalNodeTransforms[nodeIndex];
-            rSetShaderValue(model.GetPtr(), lShadowModel, GraphicType_Matrix4);
-
-            AMesh* mesh = prefab->meshes + node->index;
-            if (node->type == 0 && node->index != -1)
-            for (int i = 0; i < mesh->numPrimitives; i++)
-            {
-                APrimitive* primitive = mesh->primitives + i;
-                rRenderMeshIndexOffset(prefab->bigMesh, primitive->numIndices, primitive->indexOffset); 
-            }
-            
-            for (int i = 0; i < node->numChildren; i++)
+            for (uint64_t bits = bounds.visibility[w]; bits != 0; bits &= bits - 1)
             {
-                nodeQueue.Enqueue(node->children[i]);
+                int i = (w << 6) + TrailingZeroCount64(bits);
+                int nodeIndex = bounds.nodeIndices[i];
+                // primitives of the same node are next to each other
+                if (nodeIndex != lastNode)
+                {
+                    rSetShaderValue(prefab->globalNodeTransforms[nodeIndex].GetPtr(), lShadowModel, GraphicType_Matrix4);
+                    lastNode = nodeIndex;
+                }
+                APrimitive& primitive = prefab->meshes[prefab->nodes[nodeIndex].index].primitives[bounds.primitiveIndices[i]];
+                if (primitive.numIndices > 0)
+                    rRenderMeshIndexOffset(prefab->bigMesh, primitive.numIndices, primitive.indexOffset); 
             }
         }
-        nodeQueue.Reset(); // reset without deallocating
     }
 }
 
 void BeginShadowRendering(Scene* scene)
 {
-    if (m_RedrawShadows != 0) return;
+    UpdateCamera();
+    UpdateShadowCascades(scene->m_SunLight.dir, m_RedrawShadows == 0);
+    if (!m_AnyCascadeRedraw) return;
     
-    DirectionalLight sunLight = scene->m_SunLight;
     rBindShader(m_ShadowShader);
     rBindFrameBuffer(m_ShadowFrameBuffer);
-    rSetViewportSize(ShadowSettings::ShadowMapSize, ShadowSettings::ShadowMapSize);
-    rClearDepth();
-
-    Vector3f offset = ShadowSettings::OrthoOffset; // m_ShadowFollowCamera ? m_Camera.targetPos : Vector3f::Zero();
-    Matrix4 view  = Matrix4::LookAtRH(sunLight.dir * 90.0f + offset, -sunLight.dir, Vector3f::Up());
-    Matrix4 ortho = ShadowSettings::GetOrthoMatrix();
-    m_LightMatrix = view * ortho;
-
-    rSetShaderValue(m_LightMatrix.GetPtr(), lShadowLightMatrix, GraphicType_Matrix4);
-
     rBeginShadow();
+
+    // clear only the cascades that we are going to render, others are cached
+    rScissorToggle(true);
+    for (int i = 0; i < ShadowSettings::NumCascades; i++)
+    {
+        if (!m_Cascades[i].needsRedraw) continue;
+        rScissor((i & 1) * ShadowSettings::CascadeSize, (i >> 1) * ShadowSettings::CascadeSize, 
+                 ShadowSettings::CascadeSize, ShadowSettings::CascadeSize);
+        rClearDepth();
+    }
+    rScissorToggle(false);
 }
 
 void RenderShadowOfPrefab(Scene* scene, PrefabID prefabID, AnimationController* animSystem)
 {
-    if (m_RedrawShadows == 0)// || prefab->firstTimeRender == 0)
-    {
-        Prefab* prefab = scene->GetPrefab(prefabID);
-        DirectionalLight sunLight = scene->m_SunLight;
+    if (!m_AnyCascadeRedraw) return;
     
-        RenderShadows(prefab, sunLight, animSystem);
+    Prefab* prefab = scene->GetPrefab(prefabID);
+    for (int i = 0; i < ShadowSettings::NumCascades; i++)
+    {
+        const ShadowCascade& cascade = m_Cascades[i];
+        if (!cascade.needsRedraw) continue;
+        
+        rSetViewportSizeAndOffset(ShadowSettings::CascadeSize, ShadowSettings::CascadeSize,
+                                  (i & 1) * ShadowSettings::CascadeSize, (i >> 1) * ShadowSettings::CascadeSize);
+        rSetShaderValue(cascade.viewProjection.GetPtr(), lShadowLightMatrix, GraphicType_Matrix4);
+        RenderShadows(prefab, cascade.viewProjection, animSystem);
     }
 }
 
 void EndShadowRendering()
 {
-    if (m_RedrawShadows == 0)// || prefab->firstTimeRender == 0)
+    if (m_AnyCascadeRedraw)
     {
         rEndShadow();
         rUnbindFrameBuffer();
@@ -708,7 +1055,7 @@ bool ShouldReRender()
     return should;
 }
 
-static void RenderPrimitive(AMaterial& material, Prefab* prefab, APrimitive& primitive)
+static void SetMaterial(AMaterial& material, Prefab* prefab, APrimitive& primitive)
 {
     int baseColorIndex = material.baseColorTexture.index;
     if (prefab->numTextures > 0 && baseColorIndex != UINT16_MAX)
@@ -727,7 +1074,7 @@ static void RenderPrimitive(AMaterial& material, Prefab* prefab, APrimitive& pri
         metalicRoughnessIndex = material.specularTexture.index;
 
     if (prefab->textures && metalicRoughnessIndex != UINT16_MAX && prefab->gpuTextures[metalicRoughnessIndex].width != 0)
-        rSetTexture(prefab->gpuTextures[metalicRoughnessIndex], 2, lMetallicMap);
+        rSetTexture(RequestPackTexture(prefab->texturePack, metalicRoughnessIndex), 2, lMetallicMap);
     else
     if (!IsAndroid())
     {
@@ -735,207 +1082,931 @@ static void RenderPrimitive(AMaterial& material, Prefab* prefab, APrimitive& pri
         texture.handle = g_DefaultTexture;
         rSetTexture(texture, 2, lMetallicMap);
     }
-    int offset = primitive.indexOffset;
-    rRenderMeshIndexOffset(prefab->bigMesh, primitive.numIndices, offset);
+
+    static const xyzw identityRects[3] = { {1.0f, 1.0f, 0.0f, 0.0f}, {1.0f, 1.0f, 0.0f, 0.0f}, {1.0f, 1.0f, 0.0f, 0.0f} };
+    bool hasRects = prefab->materialUVRects && primitive.material != UINT16_MAX;
+    const xyzw* rects = hasRects ? prefab->materialUVRects + primitive.material * 3 : identityRects;
+    rSetShaderValue(&rects[0].x, lAlbedoRect, GraphicType_Vector4f);
+    rSetShaderValue(&rects[1].x, lNormalRect, GraphicType_Vector4f);
+    rSetShaderValue(&rects[2].x, lMetallicRect, GraphicType_Vector4f);
 }
 
 
 static int numCulled = 0;
 
-// Renders to gbuffer
-void RenderPrefab(Scene* scene, PrefabID prefabID, AnimationController* animSystem)
+// texture streaming uses screen space size of the primitives to determine which mips are needed
+// convert local Bounds to global bounds
+// todo move this to scene.cpp 
+static void GetWorldBounds(const APrimitive& primitive, const Matrix4& model, Vector4x32f* outMin, Vector4x32f* outMax)
 {
-    Prefab* prefab = scene->GetPrefab(prefabID);
-    const int hasAnimation = (int)(prefab->numSkins > 0 && animSystem != nullptr);
-
-    rBindShader(m_GBufferShader);
-    rSetShaderValue(hasAnimation, lHasAnimation);
-    rSetShaderValue(&scene->m_SunLight.dir.x, lSunDirG, GraphicType_Vector3f);
-
-    rBindMesh(prefab->bigMesh);
+    Vector4x32f vmin = VecSet1(1e30f);  
+    Vector4x32f vmax = VecSet1(-1e30f); 
 
-    int numNodes  = prefab->numNodes;
-    bool hasScene = prefab->numScenes > 0;
-    AScene defaultScene;
-    if (hasScene)
+    for (int i = 0; i < 8; i++)
     {
-        defaultScene = prefab->scenes[prefab->defaultSceneIndex];
-        numNodes = defaultScene.numNodes;
+        Vector4x32f point = VecSetR(i & 1 ? primitive.max[0] : primitive.min[0],
+                                    i & 2 ? primitive.max[1] : primitive.min[1],
+                                    i & 4 ? primitive.max[2] : primitive.min[2], 1.0f);
+        point = Vector3Transform(point, model.r);
+        vmin = VecMin(vmin, point);
+        vmax = VecMax(vmax, point);
     }
+    *outMin = vmin;
+    *outMax = vmax;
+}
 
-    if (hasAnimation)
-    {
-        rSetTexture(animSystem->mMatrixTex, 4, lAnimTex);
-    }
-        
-    static Queue<int> nodeQueue = {};
-    nodeQueue.Enqueue(hasScene ? defaultScene.nodes[0] : 0);
+// approximate size of the bounds on screen in pixels
+static float CalculateScreenSize(Vector4x32f vmin, Vector4x32f vmax)
+{
+    Vector4x32f center = VecMul(VecAdd(vmin, vmax), VecSet1(0.5f));
+    float radius   = Vec3Lenf(VecSub(vmax, vmin)) * 0.5f;
+    float distance = Vec3Lenf(VecSub(center, VecLoad(m_Camera->position.arr))) - radius;
+    distance = MAX(distance, m_Camera->nearClip);
 
-    while (!nodeQueue.Empty())
-    {
-        int nodeIndex = nodeQueue.Dequeue();
-        ANode& node = prefab->nodes[nodeIndex];
-        Matrix4 model = prefab->globalNodeTransforms[nodeIndex]; // Matrix4::PositionRotationScale(node.translation, node.rotation, node.scale) * parentMat;
+    float tanHalfFov = Tan(m_Camera->verticalFOV * DegToRad * 0.5f);
+    return (radius / (distance * tanHalfFov)) * (float)m_Camera->viewportSize.y;
+}
 
-        // if node is not mesh skip (camera or empty node)
-        AMesh* mesh = prefab->meshes + node.index;
+static void RequestMaterialTextures(Prefab* prefab, AMaterial& material, float screenSize)
+{
+    if (prefab->texturePack == nullptr)
+        return;
 
-        // Random::PCG pcg;
-        // Random::PCGInitialize(pcg, 0x675890u);
-        // Vector3f corners[8];
+    int baseColorIndex = material.baseColorTexture.index;
+    if (baseColorIndex != UINT16_MAX && baseColorIndex < prefab->numTextures)
+        RequestTextureScreenSize(prefab->texturePack, prefab->textures[baseColorIndex].source, screenSize);
 
-        if (node.type == 0 && node.index != -1)
-        for (int j = 0; j < mesh->numPrimitives; ++j)
-        {
-            APrimitive& primitive = mesh->primitives[j];
-            bool hasMaterial = prefab->materials && primitive.material != UINT16_MAX;
-            AMaterial material = hasMaterial ? prefab->materials[primitive.material] : m_defaultMaterial;
+    int normalIndex = material.GetNormalTexture().index;
+    if (normalIndex != UINT16_MAX && normalIndex < prefab->numTextures)
+        RequestTextureScreenSize(prefab->texturePack, prefab->textures[normalIndex].source, screenSize);
+
+    // same with SetMaterial, metallic roughness is indexed directly
+    int metalicRoughnessIndex = material.metallicRoughnessTexture.index;
+    if (metalicRoughnessIndex == UINT16_MAX)
+        metalicRoughnessIndex = material.specularTexture.index;
 
-            Vector4x32f vmin = VecSet1(1e30f);  
-            Vector4x32f vmax = VecSet1(-1e30f); 
+    if (metalicRoughnessIndex != UINT16_MAX)
+        RequestTextureScreenSize(prefab->texturePack, metalicRoughnessIndex, screenSize);
+}
 
-            // convert local Bounds to global bounds
-            // todo move this to scene.cpp 
-            for (int i = 0; i < 8; i++)
-            {
-                Vector4x32f point = VecSetR(i & 1 ? primitive.max[0] : primitive.min[0],
-                                      i & 2 ? primitive.max[1] : primitive.min[1],
-                                      i & 4 ? primitive.max[2] : primitive.min[2], 1.0f);
-                point = Vector3Transform(point, model.r);
-                vmin = VecMin(vmin, point);
-                vmax = VecMax(vmax, point);
-            }
+/*//////////////////////////////////////////////////////////////////////////*/
+/*                              Render Queue                                */
+/*//////////////////////////////////////////////////////////////////////////*/
 
-            // float rnd = Random::NextFloat01(Random::PCGNext(pcg));
-            // GetAABBCorners(corners, vmin, vmax);
-            // rDrawCube(corners, HUEToRGBU32(0.1f));
+enum DrawPass_
+{
+    DrawPass_Opaque    = 0, 
+    DrawPass_AlphaMask = 1  // rendered after opaque meshes, for early z
+};
 
-            bool shouldDraw = true;
-            bool culled = CheckAABBCulled(vmin, vmax, m_Camera->frustumPlanes, model);
-            shouldDraw &= culled;
-            numCulled += culled == false;
+enum DrawFlags_
+{
+    DrawFlags_Outline     = 1,
+    DrawFlags_DoubleSided = 2,
+    DrawFlags_NormalMap   = 4
+};
+
+// most significant bits are changing the most expensive states, sorted items are grouped by them
+// | pass 4 | shader 4 | material 16 | flags 3 | depth 24 | unused 13 |
+static uint64_t MakeDrawKey(uint64_t pass, uint64_t shader, uint64_t material, uint64_t flags, float distance)
+{
+    // front to back, quantized between near and far clip
+    float depth01 = Clamp01((distance - m_Camera->nearClip) / (m_Camera->farClip - m_Camera->nearClip));
+    uint64_t depth = (uint64_t)(depth01 * 16777215.0f);
+    return pass << 60 | shader << 56 | material << 40 | flags << 37 | depth << 13;
+}
 
-            shouldDraw &= primitive.numIndices != 0;
-            bool isAlpha = (material.alphaMode == AMaterialAlphaMode_Mask ||
-                material.alphaMode == AMaterialAlphaMode_Blend);
+// LSD radix sort with 8 bit digits, returns items or temp whichever has the sorted result.
+// passes that all of the keys have the same digit are skipped (unused bits, pass and shader most of the time)
+static DrawItem* RadixSortDrawItems(DrawItem* items, DrawItem* temp, int count)
+{
+    if (count == 0) return items;
 
-            // if alpha blended render after all meshes for performance
-            if (shouldDraw && isAlpha) {
-                m_DelayedAlphaCutoffs.EmplaceBack(mesh->primitives + j, model);
-                shouldDraw = false;
-            }
+    uint32_t histograms[8][256];
+    MemsetZero(histograms, sizeof(histograms));
 
-            if (shouldDraw) {
-                rStencilMask(primitive.hasOutline ? 0xFF : 0x00);
-                // SetMaterial(&material);
-                rSetShaderValue(model.GetPtr(), lModel, GraphicType_Matrix4);
-                RenderPrimitive(material, prefab, primitive);
+    for (int i = 0; i < count; i++)
+    {
+        uint64_t key = items[i].key;
+        for (int d = 0; d < 8; d++)
+            histograms[d][(key >> (d * 8)) & 0xFF]++;
+    }
 
-                if (material.doubleSided)
-                {
-                    rSetClockWise(true);
-                    RenderPrimitive(material, prefab, primitive);
-                    rSetClockWise(false);
-                }
-            }
+    DrawItem* src = items;
+    DrawItem* dst = temp;
+    for (int d = 0; d < 8; d++)
+    {
+        int shift = d * 8;
+        uint32_t* histogram = histograms[d];
+        if (histogram[(src[0].key >> shift) & 0xFF] == (uint32_t)count)
+            continue;
+
+        uint32_t offset = 0;
+        for (int i = 0; i < 256; i++)
+        {
+            uint32_t histCount = histogram[i];
+            histogram[i] = offset;
+            offset += histCount;
         }
 
-        for (int i = 0; i < node.numChildren; i++)
+        for (int i = 0; i < count; i++)
         {
-            nodeQueue.Enqueue(node.children[i]);
+            dst[histogram[(src[i].key >> shift) & 0xFF]++] = src[i];
         }
+        Swap(src, dst);
     }
+    return src;
+}
 
-    nodeQueue.Reset(); // reset without deallocating
-
-    // Render alpha masked meshes after opaque meshes, to make sure performance is good. (early z)
-    if (m_DelayedAlphaCutoffs.Size() > 0)
+// gathers visible primitives in [beginWord, endWord) of the visibility bits into thread local list and sorts it.
+// runs on worker threads, so it doesn't request textures, max screen size of each material is stored instead
+static void GatherDrawItemsRange(void* data, int task, int beginWord, int endWord)
+{
+    Prefab* prefab = (Prefab*)data;
+    DrawList* list = &m_DrawLists[task];
+    PrimitiveBounds& bounds = prefab->worldBounds;
+    Vector4x32f cameraPos = VecLoad(m_Camera->position.arr);
+
+    list->items.Resize(0);
+    list->maxScreenSize = 0.0f;
+    list->numCulled = 0;
+    list->materialScreenSizes.Resize(prefab->numMaterials);
+    MemsetZero(list->materialScreenSizes.Data(), sizeof(float) * prefab->numMaterials);
+
+    for (int w = beginWord; w < endWord; w++)
     {
-        rBindShader(m_GBufferShaderAlpha);
-        // shadow uniforms
-        rSetShaderValue(m_LightMatrix.GetPtr(), lLightMatrix, GraphicType_Matrix4);
-        rSetShaderValue(m_ViewProjection.GetPtr(), lViewProj, GraphicType_Matrix4);
+        // iterate over visible bits only
+        for (uint64_t bits = bounds.visibility[w]; bits != 0; bits &= bits - 1)
+        {
+            int i = (w << 6) + TrailingZeroCount64(bits);
+            int nodeIndex = bounds.nodeIndices[i];
+            int primitiveIndex = bounds.primitiveIndices[i];
 
-        rSetTexture(m_ShadowTexture, 3, lShadowMap);
+            ANode& node = prefab->nodes[nodeIndex];
+            APrimitive& primitive = prefab->meshes[node.index].primitives[primitiveIndex];
+            if (primitive.numIndices == 0)
+                continue;
 
-        // todo we need parent matrix instead of primitive pointer
-        for (int i = 0; i < m_DelayedAlphaCutoffs.Size(); i++)
-        {
-            KeyValuePair<APrimitive*, Matrix4> alphaCutoff = m_DelayedAlphaCutoffs[i];
+            Vector4x32f vmin = VecSetR(bounds.minX[i], bounds.minY[i], bounds.minZ[i], 1.0f);
+            Vector4x32f vmax = VecSetR(bounds.maxX[i], bounds.maxY[i], bounds.maxZ[i], 1.0f);
 
-            APrimitive& primitive = *alphaCutoff.key;
-            rStencilMask(primitive.hasOutline ? 0xFF : 0x00);
+            if (!OcclusionIsOccluder(prefab, i) && !OcclusionTestAABB(vmin, vmax)) {
+                list->numCulled++;
+                continue;
+            }
 
             bool hasMaterial = prefab->materials && primitive.material != UINT16_MAX;
-            AMaterial material = hasMaterial ? prefab->materials[primitive.material] : m_defaultMaterial;
+            AMaterial& material = hasMaterial ? prefab->materials[primitive.material] : m_defaultMaterial;
 
-            rSetShaderValue(alphaCutoff.value.GetPtr(), lModel, GraphicType_Matrix4); // < set model matrix
-            RenderPrimitive(material, prefab, primitive);
-            if (material.doubleSided)
-            {
-                rSetClockWise(true);
-                RenderPrimitive(material, prefab, primitive);
-                rSetClockWise(false);
+            float screenSize = CalculateScreenSize(vmin, vmax);
+            list->maxScreenSize = MAX(list->maxScreenSize, screenSize);
+            if (hasMaterial) {
+                float& materialScreenSize = list->materialScreenSizes[primitive.material];
+                materialScreenSize = MAX(materialScreenSize, screenSize);
             }
+
+            bool isAlpha = (material.alphaMode == AMaterialAlphaMode_Mask ||
+                            material.alphaMode == AMaterialAlphaMode_Blend);
+            
+            uint64_t flags = 0;
+            if (primitive.hasOutline)  flags |= DrawFlags_Outline;
+            if (material.doubleSided)  flags |= DrawFlags_DoubleSided;
+            if (EnumHasBit(primitive.attributes, AAttribType_TANGENT)) flags |= DrawFlags_NormalMap;
+
+            Vector4x32f center = VecMul(VecAdd(vmin, vmax), VecSet1(0.5f));
+            float distance = Vec3Lenf(VecSub(center, cameraPos));
+            uint64_t pass = isAlpha ? DrawPass_AlphaMask : DrawPass_Opaque;
+
+            DrawItem item;
+            item.key = MakeDrawKey(pass, pass, hasMaterial ? primitive.material : 0xFFFF, flags, distance);
+            item.nodeIndex = nodeIndex;
+            item.primitiveIndex = primitiveIndex;
+            list->items.Add(item);
         }
-        m_DelayedAlphaCutoffs.Resize(0);
     }
 
-    rStencilMask(0x00);
+    int numItems = list->items.Size();
+    list->temp.Resize(numItems);
+    list->sorted = RadixSortDrawItems(list->items.Data(), list->temp.Data(), numItems);
 }
 
-void RenderOutlined(Scene* scene, unsigned short prefabID, int nodeIndex, int primitiveIndex, AnimationController* animSystem)
+// merges the ranges of the sorted lists into out, number of lists is small so we pick the smallest head linearly
+static void MergeDrawListRange(const MergeRange& range, int numLists, DrawItem* out)
 {
-    Prefab* prefab = scene->GetPrefab(prefabID);
-    const int hasAnimation = (int)(prefab->numSkins > 0 && animSystem != nullptr);    
-
-    rBindMesh(prefab->bigMesh);
+    int heads[MaxGatherThreads];
+    int total = 0;
+    for (int l = 0; l < numLists; l++)
+    {
+        heads[l] = range.begin[l];
+        total += range.end[l] - range.begin[l];
+    }
 
-    ANode& node = prefab->nodes[nodeIndex];
-    if (node.type != 0 || node.index == -1) return;
+    for (int i = 0; i < total; i++)
+    {
+        int best = -1;
+        for (int l = 0; l < numLists; l++)
+        {
+            if (heads[l] < range.end[l] && (best == -1 || m_DrawLists[l].sorted[heads[l]].key < m_DrawLists[best].sorted[heads[best]].key))
+                best = l;
+        }
+        out[i] = m_DrawLists[best].sorted[heads[best]++];
+    }
+}
 
-    AMesh* mesh = prefab->meshes + node.index;
-    APrimitive& primitive = mesh->primitives[primitiveIndex];
-    AMaterial& material = prefab->materials[primitive.material];
+// each task merges one of the m_MergeRanges
+static void MergeDrawListsRange(void* data, int task, int begin, int end)
+{
+    for (int r = begin; r < end; r++)
+        MergeDrawListRange(m_MergeRanges[r], m_NumMergeLists, m_DrawItems.Data() + m_MergeRanges[r].outOffset);
+}
 
-    Matrix4 model = prefab->globalNodeTransforms[nodeIndex];
+// index of the first item that has key greater or equal to the key
+static int LowerBoundDrawKey(const DrawItem* items, int count, uint64_t key)
+{
+    int low = 0;
+    while (count > 0)
+    {
+        int half = count >> 1;
+        if (items[low + half].key < key) {
+            low += half + 1;
+            count -= half + 1;
+        }
+        else count = half;
+    }
+    return low;
+}
 
-    // draw outline, bigger mesh growth done in vertex shader
-    rToggleDepthTest(false);
-    rBindShader(m_OutlineShader);
-    rSetShaderValue(model.GetPtr(), rGetUniformLocation("uModel"), GraphicType_Matrix4);
-    rSetShaderValue(m_ViewProjection.GetPtr(), rGetUniformLocation("uViewProj"), GraphicType_Matrix4);
+// merges sorted thread lists into m_DrawItems. key space is split with the keys of the biggest list,
+// each task finds its key range in all lists with binary search, so tasks are writing to different parts of the output
+static DrawItem* MergeDrawLists(int numLists, int* outCount)
+{
+    if (numLists == 1) {
+        *outCount = m_DrawLists[0].items.Size();
+        return m_DrawLists[0].sorted;
+    }
 
-    rStencilFunc(rNOTEQUAL, 1, 0xFF);
-    rStencilMask(0x00);
+    int total = 0, biggest = 0;
+    for (int l = 0; l < numLists; l++)
+    {
+        total += m_DrawLists[l].items.Size();
+        if (m_DrawLists[l].items.Size() > m_DrawLists[biggest].items.Size())
+            biggest = l;
+    }
+    m_DrawItems.Resize(total);
+    m_NumMergeLists = numLists;
 
-    int offset = primitive.indexOffset;
-    rRenderMeshIndexOffset(prefab->bigMesh, primitive.numIndices, offset);
+    constexpr int MinItemsPerMergeTask = 2048;
+    int numTasks = MIN(MIN(total / MinItemsPerMergeTask, MaxMergeTasks), GetNumJobThreads());
+    numTasks = MAX(numTasks, 1);
 
-    if (material.doubleSided)
+    const DrawList& splitList = m_DrawLists[biggest];
+    int outOffset = 0;
+    for (int t = 0; t < numTasks; t++)
     {
-        rSetClockWise(true);
-        rRenderMeshIndexOffset(prefab->bigMesh, primitive.numIndices, offset);
-        rSetClockWise(false);
-    }
+        MergeRange& range = m_MergeRanges[t];
+        range.outOffset = outOffset;
+        // splitter is the key at the t'th quantile of the biggest list, last task takes the rest
+        bool isLast = t == numTasks - 1;
+        uint64_t endKey = isLast ? 0 : splitList.sorted[(int)((int64_t)splitList.items.Size() * (t + 1) / numTasks)].key;
 
-    rStencilFunc(rALWAYS, 1, 0xFF);   
-    rStencilMask(0x00);
+        for (int l = 0; l < numLists; l++)
+        {
+            const DrawList& list = m_DrawLists[l];
+            range.begin[l] = t == 0 ? 0 : m_MergeRanges[t - 1].end[l];
+            range.end[l] = isLast ? list.items.Size() : LowerBoundDrawKey(list.sorted, list.items.Size(), endKey);
+            range.end[l] = MAX(range.end[l], range.begin[l]);
+            outOffset += range.end[l] - range.begin[l];
+        }
+    }
 
-    rToggleDepthTest(true);
-    rStencilToggle(false);
+    ParallelRange(MergeDrawListsRange, nullptr, numTasks, numTasks);
+    *outCount = total;
+    return m_DrawItems.Data();
 }
 
-static bool MeshInstanceIndexCompare(MeshInstance* a, MeshInstance* b)
+// gathers visible primitives of the prefab, returns sorted draw items. 
+// visibility words are split between worker threads, each thread fills and sorts its own list, then lists are merged
+static DrawItem* GatherDrawItems(Prefab* prefab, int* outCount, float* outMaxScreenSize)
 {
-    return a->meshIndex < b->meshIndex;
+    PrimitiveBounds& bounds = prefab->worldBounds;
+    float planes[6][4];
+    ExtractFrustumPlanes(m_ViewProjection, planes);
+    int numVisible = CullPrefab(prefab, planes, 6);
+    numCulled += bounds.numPrimitives - numVisible;
+
+    // big visible primitives are drawn to software depth buffer, 
+    // they occlude this and the next prefabs that are rendered in this frame
+    OcclusionRasterizePrefab(prefab);
+
+    int numWords = (bounds.capacity + 63) / 64;
+    int numThreads = MIN(numVisible / MinGatherItemsPerThread, MaxGatherThreads);
+    numThreads = MIN(numThreads, GetNumJobThreads());
+    // each task fills the draw list with the same index
+    numThreads = ParallelRange(GatherDrawItemsRange, prefab, numWords, numThreads);
+    m_NumGatheredLists += numThreads;
+
+    // texture streaming isn't thread safe, request once per material with the biggest screen size
+    float maxScreenSize = 0.0f; // used for animation LOD
+    for (int m = 0; m < prefab->numMaterials; m++)
+    {
+        float screenSize = 0.0f;
+        for (int l = 0; l < numThreads; l++)
+            screenSize = MAX(screenSize, m_DrawLists[l].materialScreenSizes[m]);
+
+        if (screenSize > 0.0f)
+            RequestMaterialTextures(prefab, prefab->materials[m], screenSize);
+    }
+
+    for (int l = 0; l < numThreads; l++)
+    {
+        numCulled += m_DrawLists[l].numCulled;
+        maxScreenSize = MAX(maxScreenSize, m_DrawLists[l].maxScreenSize);
+    }
+    *outMaxScreenSize = maxScreenSize;
+    return MergeDrawLists(numThreads, outCount);
 }
 
-void InitRayTracing(Prefab* scene)
+// binds the shader of the pass, opaque shader is bound by RenderPrefab
+static void BeginDrawPass(uint64_t pass, int indirect)
 {
-    #if 0
-    int numMatrices = scene->numNodes << 2;
-    int numInstances = scene->tlas->numNodesUsed;
+    if (pass == DrawPass_AlphaMask)
+    {
+        rBindShader(m_GBufferShaderAlpha);
+        rSetShaderValue(m_ViewProjection.GetPtr(), lViewProj, GraphicType_Matrix4);
+        SetShadowUniforms();
+    }
+    rSetShaderValue(indirect, lIndirect);
+}
+
+static APrimitive& GetDrawItemPrimitive(Prefab* prefab, const DrawItem& item)
+{
+    ANode& node = prefab->nodes[item.nodeIndex];
+    return prefab->meshes[node.index].primitives[item.primitiveIndex];
+}
+
+// draws sorted items, states that are same with the previous item are not set again
+static void SubmitDrawItems(Prefab* prefab, const DrawItem* items, int count)
+{
+    uint64_t lastPass     = ~0ull;
+    uint64_t lastMaterial = ~0ull;
+    int      lastNode     = -1;
+    int      lastStencil  = -1;
+
+    for (int i = 0; i < count; i++)
+    {
+        const DrawItem& item = items[i];
+        uint64_t pass     = item.key >> 60;
+        uint64_t material = item.key >> 37; // material and flags, normal map flag changes the uniforms as well
+        uint64_t flags    = (item.key >> 37) & 7;
+
+        if (pass != lastPass)
+        {
+            BeginDrawPass(pass, 0);
+            // shader is changed, uniforms has to be set again
+            lastMaterial = ~0ull;
+            lastNode     = -1;
+            lastPass     = pass;
+        }
+
+        APrimitive& primitive = GetDrawItemPrimitive(prefab, item);
+        bool hasMaterial = prefab->materials && primitive.material != UINT16_MAX;
+        AMaterial& mat = hasMaterial ? prefab->materials[primitive.material] : m_defaultMaterial;
+
+        int stencil = (flags & DrawFlags_Outline) ? 0xFF : 0x00;
+        if (stencil != lastStencil) {
+            rStencilMask(stencil);
+            lastStencil = stencil;
+        }
+
+        if (material != lastMaterial) {
+            SetMaterial(mat, prefab, primitive);
+            lastMaterial = material;
+        }
+
+        if (item.nodeIndex != lastNode) {
+            rSetShaderValue(prefab->globalNodeTransforms[item.nodeIndex].GetPtr(), lModel, GraphicType_Matrix4);
+            lastNode = item.nodeIndex;
+        }
+
+        rRenderMeshIndexOffset(prefab->bigMesh, primitive.numIndices, primitive.indexOffset);
+        if (flags & DrawFlags_DoubleSided)
+        {
+            rSetClockWise(true);
+            rRenderMeshIndexOffset(prefab->bigMesh, primitive.numIndices, primitive.indexOffset);
+            rSetClockWise(false);
+        }
+    }
+}
+
+// items with same pass, material and flags are one bucket, each bucket is drawn with one multi draw call
+static void SubmitDrawItemsIndirect(Prefab* prefab, const DrawItem* items, int count)
+{
+    m_IndirectCommands.Resize(count);
+    m_IndirectDrawData.Resize(count);
+
+    for (int i = 0; i < count; i++)
+    {
+        APrimitive& primitive = GetDrawItemPrimitive(prefab, items[i]);
+        DrawElementsIndirectCommand& command = m_IndirectCommands[i];
+        command.count         = primitive.numIndices;
+        command.instanceCount = 1;
+        command.firstIndex    = primitive.indexOffset;
+        command.baseVertex    = 0;
+        command.baseInstance  = i; // aDrawID in shader
+
+        IndirectDrawData& drawData = m_IndirectDrawData[i];
+        drawData.model = prefab->globalNodeTransforms[items[i].nodeIndex];
+        drawData.info[0] = primitive.material;
+        drawData.info[1] = drawData.info[2] = drawData.info[3] = 0;
+    }
+    rUploadIndirectBuffer(m_IndirectBuffer, m_IndirectCommands.Data(), count, m_IndirectDrawData.Data(), count);
+
+    uint64_t lastPass = ~0ull;
+    int bucketStart = 0;
+    for (int i = 1; i <= count; i++)
+    {
+        uint64_t bucketKey = items[bucketStart].key >> 37; // pass, shader, material and flags
+        if (i < count && (items[i].key >> 37) == bucketKey)
+            continue;
+
+        uint64_t pass  = items[bucketStart].key >> 60;
+        uint64_t flags = bucketKey & 7;
+        if (pass != lastPass) {
+            BeginDrawPass(pass, 1);
+            lastPass = pass;
+        }
+
+        APrimitive& primitive = GetDrawItemPrimitive(prefab, items[bucketStart]);
+        bool hasMaterial = prefab->materials && primitive.material != UINT16_MAX;
+        AMaterial& material = hasMaterial ? prefab->materials[primitive.material] : m_defaultMaterial;
+
+        rStencilMask((flags & DrawFlags_Outline) ? 0xFF : 0x00);
+        SetMaterial(material, prefab, primitive);
+        
+        const int drawDataBinding = 2; // binding in 3DVert.glsl
+        rRenderMeshMultiIndirect(prefab->bigMesh, m_IndirectBuffer, bucketStart, i - bucketStart, drawDataBinding);
+        if (flags & DrawFlags_DoubleSided)
+        {
+            rSetClockWise(true);
+            rRenderMeshMultiIndirect(prefab->bigMesh, m_IndirectBuffer, bucketStart, i - bucketStart, drawDataBinding);
+            rSetClockWise(false);
+        }
+        bucketStart = i;
+    }
+}
+
+// Renders to gbuffer
+void RenderPrefab(Scene* scene, PrefabID prefabID, AnimationController* animSystem)
+{
+    Prefab* prefab = scene->GetPrefab(prefabID);
+    const int hasAnimation = (int)(prefab->numSkins > 0 && animSystem != nullptr);
+
+    rBindShader(m_GBufferShader);
+    rSetShaderValue(hasAnimation, lHasAnimation);
+    rSetShaderValue(&scene->m_SunLight.dir.x, lSunDirG, GraphicType_Vector3f);
+
+    rBindMesh(prefab->bigMesh);
+
+    if (hasAnimation)
+    {
+        rSetTexture(GetBonePaletteTexture(), 4, lAnimTex);
+        rSetShaderValue(animSystem->mPaletteRow, lAnimRow);
+    }
+    
+    int numItems;
+    float maxScreenSize;
+    DrawItem* sorted = GatherDrawItems(prefab, &numItems, &maxScreenSize);
+
+    // animation is evaluated on simulation thread, LOD is applied by CharacterController::SyncWithRenderer
+    if (hasAnimation)
+        animSystem->mLodScreenSize = maxScreenSize;
+    
+    // GLES doesn't have multi draw indirect
+    if (m_IndirectBuffer.commandHandle != 0 && numItems <= m_IndirectBuffer.maxDraws)
+        SubmitDrawItemsIndirect(prefab, sorted, numItems);
+    else
+        SubmitDrawItems(prefab, sorted, numItems);
+
+    rStencilMask(0x00);
+}
+
+/*//////////////////////////////////////////////////////////////////////////*/
+/*                          Baked Animations                                */
+/*//////////////////////////////////////////////////////////////////////////*/
+
+// root node of the animated prefab is moved by the CharacterController, instances that share the prefab
+// shouldn't follow the player. multiply the global node transforms with this to get them relative to the root placement,
+// scale of the root node is kept because it is not part of the placement
+static Matrix4 GetInverseRootPlacement(Prefab* prefab)
+{
+    int rootIndex = prefab->skeletonNodes[0];
+    float position[3] = { 0.0f, 0.0f, 0.0f };
+    float rotation[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+    Matrix4 rootScale = Matrix4::PositionRotationScale(position, rotation, prefab->nodes[rootIndex].scale);
+    return Matrix4::InverseTransform(prefab->globalNodeTransforms[rootIndex]) * rootScale;
+}
+
+// bind pose bounds of the meshes in prefab space, padded because animated limbs go out of the bind pose
+static void GetBakedPrefabBounds(Prefab* prefab, Vector4x32f* outMin, Vector4x32f* outMax)
+{
+    Matrix4 invRoot = GetInverseRootPlacement(prefab);
+    Vector4x32f localMin = VecSet1(+1e30f);
+    Vector4x32f localMax = VecSet1(-1e30f);
+    for (int nodeIndex = 0; nodeIndex < prefab->numNodes; nodeIndex++)
+    {
+        ANode& node = prefab->nodes[nodeIndex];
+        if (node.type != 0 || node.index == -1) 
+            continue;
+
+        AMesh& mesh = prefab->meshes[node.index];
+        for (int j = 0; j < mesh.numPrimitives; j++)
+        {
+            Vector4x32f vmin, vmax;
+            GetWorldBounds(mesh.primitives[j], prefab->globalNodeTransforms[nodeIndex] * invRoot, &vmin, &vmax);
+            localMin = VecMin(localMin, vmin);
+            localMax = VecMax(localMax, vmax);
+        }
+    }
+    Vector4x32f padding = VecMul(VecSub(localMax, localMin), VecSet1(0.25f));
+    *outMin = VecSub(localMin, padding);
+    *outMax = VecAdd(localMax, padding);
+}
+
+// culls the instances and writes the visible ones to m_BakedInstances, returns max screen size of the visible instances
+static float CullBakedInstances(Prefab* prefab, const BakedAnimInstance* instances, int numInstances, 
+                                const float planes[][4], int numPlanes, bool testOcclusion)
+{
+    BakedAnimations* bake = prefab->bakedAnimations;
+    if (m_BakedBounds.minX == nullptr || m_BakedBounds.numPrimitives != numInstances)
+    {
+        if (m_BakedBounds.minX != nullptr)
+            FreePrimitiveBounds(&m_BakedBounds);
+        AllocatePrimitiveBounds(&m_BakedBounds, numInstances);
+    }
+
+    Vector4x32f localMin, localMax;
+    GetBakedPrefabBounds(prefab, &localMin, &localMax);
+
+    PrimitiveBounds& bounds = m_BakedBounds;
+    for (int i = 0; i < numInstances; i++)
+        SetPrimitiveBounds(&bounds, i, localMin, localMax, instances[i].transform);
+    MemsetZero(bounds.visibility, ((bounds.capacity + 63) / 64) * sizeof(uint64_t));
+    CullPrimitiveBounds(bounds, planes, numPlanes);
+
+    float maxScreenSize = 0.0f;
+    m_BakedInstances.Resize(0);
+    for (int i = 0; i < numInstances; i++)
+    {
+        if (!(bounds.visibility[i >> 6] & (1ull << (i & 63))))
+        {
+            numCulled++;
+            continue;
+        }
+
+        Vector4x32f vmin = VecSetR(bounds.minX[i], bounds.minY[i], bounds.minZ[i], 1.0f);
+        Vector4x32f vmax = VecSetR(bounds.maxX[i], bounds.maxY[i], bounds.maxZ[i], 1.0f);
+        if (testOcclusion)
+        {
+            if (!OcclusionTestAABB(vmin, vmax)) {
+                numCulled++;
+                continue;
+            }
+            maxScreenSize = MAX(maxScreenSize, CalculateScreenSize(vmin, vmax));
+        }
+
+        const BakedAnimInstance& instance = instances[i];
+        ASSERTR(instance.clip >= 0 && instance.clip < bake->numClips, continue);
+        BakedClip clip = bake->clips[instance.clip];
+
+        BakedInstanceData data;
+        Matrix4 columns = Matrix4::Transpose(instance.transform);
+        VecStore(data.transform[0], columns.r[0]);
+        VecStore(data.transform[1], columns.r[1]);
+        VecStore(data.transform[2], columns.r[2]);
+        data.anim[0] = (float)clip.firstFrame;
+        data.anim[1] = (float)clip.numFrames;
+        data.anim[2] = Fract(instance.time * BakedAnimSampleRate / (float)clip.numFrames) * (float)clip.numFrames;
+        data.anim[3] = 0.0f;
+        m_BakedInstances.Add(data);
+    }
+    return maxScreenSize;
+}
+
+// draws the m_BakedInstances, each primitive of the prefab is one instanced draw per batch of MaxBakedInstances
+// shader and the uniforms has to be set. gbuffer sets the materials
+static void SubmitBakedInstances(Prefab* prefab, int modelLocation, bool gbuffer)
+{
+    rBindMesh(prefab->bigMesh);
+    Matrix4 invRoot = GetInverseRootPlacement(prefab);
+
+    for (int start = 0; start < m_BakedInstances.Size(); start += MaxBakedInstances)
+    {
+        int count = MIN(m_BakedInstances.Size() - start, MaxBakedInstances);
+        rUpdateTextureRegion(m_BakedInstanceTex, 0, 0, 4, count, m_BakedInstances.Data() + start);
+
+        for (int nodeIndex = 0; nodeIndex < prefab->numNodes; nodeIndex++)
+        {
+            ANode& node = prefab->nodes[nodeIndex];
+            if (node.type != 0 || node.index == -1) 
+                continue;
+
+            Matrix4 model = prefab->globalNodeTransforms[nodeIndex] * invRoot;
+            rSetShaderValue(model.GetPtr(), modelLocation, GraphicType_Matrix4);
+            AMesh* mesh = prefab->meshes + node.index;
+
+            for (int j = 0; j < mesh->numPrimitives; ++j)
+            {
+                APrimitive& primitive = mesh->primitives[j];
+                if (primitive.numIndices == 0)
+                    continue;
+
+                bool doubleSided = false;
+                if (gbuffer)
+                {
+                    bool hasMaterial = prefab->materials && primitive.material != UINT16_MAX;
+                    AMaterial& material = hasMaterial ? prefab->materials[primitive.material] : m_defaultMaterial;
+                    SetMaterial(material, prefab, primitive);
+                    doubleSided = material.doubleSided;
+                }
+
+                rRenderMeshIndexOffsetInstanced(prefab->bigMesh, primitive.numIndices, primitive.indexOffset, count);
+                if (doubleSided)
+                {
+                    rSetClockWise(true);
+                    rRenderMeshIndexOffsetInstanced(prefab->bigMesh, primitive.numIndices, primitive.indexOffset, count);
+                    rSetClockWise(false);
+                }
+            }
+        }
+    }
+}
+
+void RenderBakedAnimations(Scene* scene, PrefabID prefabID, const BakedAnimInstance* instances, int numInstances)
+{
+    Prefab* prefab = scene->GetPrefab(prefabID);
+    BakedAnimations* bake = prefab->bakedAnimations;
+    ASSERTR(bake != nullptr && bake->numClips > 0, return);
+
+    float planes[6][4];
+    ExtractFrustumPlanes(m_ViewProjection, planes);
+    float screenSize = CullBakedInstances(prefab, instances, numInstances, planes, 6, true);
+    if (m_BakedInstances.Size() == 0)
+        return;
+
+    for (int i = 0; i < prefab->numMaterials; i++)
+        RequestMaterialTextures(prefab, prefab->materials[i], screenSize);
+
+    // alpha masked materials are not supported, crowds are opaque
+    rBindShader(m_GBufferShader);
+    rSetShaderValue(2, lHasAnimation); // 2 means baked animation
+    rSetShaderValue(0, lIndirect);
+    rSetShaderValue(&scene->m_SunLight.dir.x, lSunDirG, GraphicType_Vector3f);
+    rSetShaderValue(bake->numJoints * 3, lBakedColumnWidth);
+    rSetTexture(bake->texture, 4, lAnimTex);
+    rSetTexture(m_BakedInstanceTex, 5, lInstanceTex);
+    rStencilMask(0x00);
+
+    SubmitBakedInstances(prefab, lModel, true);
+}
+
+void RenderShadowOfBakedAnimations(Scene* scene, PrefabID prefabID, const BakedAnimInstance* instances, int numInstances)
+{
+    if (!m_AnyCascadeRedraw) return;
+    
+    Prefab* prefab = scene->GetPrefab(prefabID);
+    BakedAnimations* bake = prefab->bakedAnimations;
+    ASSERTR(bake != nullptr && bake->numClips > 0, return);
+
+    rSetShaderValue(2, lShadowHasAnimation);
+    rSetShaderValue(bake->numJoints * 3, lShadowBakedColumnWidth);
+    rSetTexture(bake->texture, 0, lShadowAnimTex);
+    rSetTexture(m_BakedInstanceTex, 1, lShadowInstanceTex);
+
+    for (int i = 0; i < ShadowSettings::NumCascades; i++)
+    {
+        const ShadowCascade& cascade = m_Cascades[i];
+        if (!cascade.needsRedraw) continue;
+
+        // near plane is not tested, casters between the light and the cascade cast shadows into it
+        float planes[6][4];
+        ExtractFrustumPlanes(cascade.viewProjection, planes);
+        CullBakedInstances(prefab, instances, numInstances, planes, FrustumPlane_Near, false);
+        if (m_BakedInstances.Size() == 0)
+            continue;
+
+        rSetViewportSizeAndOffset(ShadowSettings::CascadeSize, ShadowSettings::CascadeSize,
+                                  (i & 1) * ShadowSettings::CascadeSize, (i >> 1) * ShadowSettings::CascadeSize);
+        rSetShaderValue(cascade.viewProjection.GetPtr(), lShadowLightMatrix, GraphicType_Matrix4);
+        SubmitBakedInstances(prefab, lShadowModel, false);
+    }
+}
+
+/*//////////////////////////////////////////////////////////////////////////*/
+/*                          Animated Instances                              */
+/*//////////////////////////////////////////////////////////////////////////*/
+
+// culls the characters with padded bind pose bounds, writes indices of the visible ones to m_VisibleAnimated
+static void CullAnimatedInstances(Prefab* prefab, const Matrix4* transforms, int count, 
+                                  const float planes[][4], int numPlanes)
+{
+    if (m_AnimatedBounds.minX == nullptr || m_AnimatedBounds.numPrimitives != count)
+    {
+        if (m_AnimatedBounds.minX != nullptr)
+            FreePrimitiveBounds(&m_AnimatedBounds);
+        AllocatePrimitiveBounds(&m_AnimatedBounds, count);
+    }
+
+    Vector4x32f localMin, localMax;
+    GetBakedPrefabBounds(prefab, &localMin, &localMax);
+
+    PrimitiveBounds& bounds = m_AnimatedBounds;
+    for (int i = 0; i < count; i++)
+        SetPrimitiveBounds(&bounds, i, localMin, localMax, transforms[i]);
+    MemsetZero(bounds.visibility, ((bounds.capacity + 63) / 64) * sizeof(uint64_t));
+    CullPrimitiveBounds(bounds, planes, numPlanes);
+
+    m_VisibleAnimated.Resize(0);
+    for (int i = 0; i < count; i++)
+    {
+        if (bounds.visibility[i >> 6] & (1ull << (i & 63))) m_VisibleAnimated.Add(i);
+        else numCulled++;
+    }
+}
+
+// draws all primitives of the prefab placed with transform, shader, bone palette and the row has to be set
+static void SubmitAnimatedInstance(Prefab* prefab, const Matrix4& invRoot, const Matrix4& transform, int modelLocation, bool gbuffer)
+{
+    for (int nodeIndex = 0; nodeIndex < prefab->numNodes; nodeIndex++)
+    {
+        ANode& node = prefab->nodes[nodeIndex];
+        if (node.type != 0 || node.index == -1) 
+            continue;
+
+        Matrix4 model = prefab->globalNodeTransforms[nodeIndex] * invRoot * transform;
+        rSetShaderValue(model.GetPtr(), modelLocation, GraphicType_Matrix4);
+        AMesh* mesh = prefab->meshes + node.index;
+
+        for (int j = 0; j < mesh->numPrimitives; ++j)
+        {
+            APrimitive& primitive = mesh->primitives[j];
+            if (primitive.numIndices == 0)
+                continue;
+
+            bool doubleSided = false;
+            if (gbuffer)
+            {
+                bool hasMaterial = prefab->materials && primitive.material != UINT16_MAX;
+                AMaterial& material = hasMaterial ? prefab->materials[primitive.material] : m_defaultMaterial;
+                SetMaterial(material, prefab, primitive);
+                doubleSided = material.doubleSided;
+            }
+
+            rRenderMeshIndexOffset(prefab->bigMesh, primitive.numIndices, primitive.indexOffset);
+            if (doubleSided)
+            {
+                rSetClockWise(true);
+                rRenderMeshIndexOffset(prefab->bigMesh, primitive.numIndices, primitive.indexOffset);
+                rSetClockWise(false);
+            }
+        }
+    }
+}
+
+void RenderAnimatedInstances(Scene* scene, PrefabID prefabID, AnimationController** controllers, const Matrix4* transforms, int count)
+{
+    Prefab* prefab = scene->GetPrefab(prefabID);
+    float planes[6][4];
+    ExtractFrustumPlanes(m_ViewProjection, planes);
+    CullAnimatedInstances(prefab, transforms, count, planes, 6);
+
+    // culled characters are updated with lowest LOD
+    for (int i = 0; i < count; i++)
+        controllers[i]->mLodScreenSize = 0.0f;
+
+    float maxScreenSize = 0.0f;
+    int numVisible = 0;
+    const PrimitiveBounds& bounds = m_AnimatedBounds;
+    for (int v = 0; v < m_VisibleAnimated.Size(); v++)
+    {
+        int i = m_VisibleAnimated[v];
+        Vector4x32f vmin = VecSetR(bounds.minX[i], bounds.minY[i], bounds.minZ[i], 1.0f);
+        Vector4x32f vmax = VecSetR(bounds.maxX[i], bounds.maxY[i], bounds.maxZ[i], 1.0f);
+        if (!OcclusionTestAABB(vmin, vmax)) {
+            numCulled++;
+            continue;
+        }
+        // animation is evaluated on simulation thread, LOD is applied before the next simulation step
+        float screenSize = CalculateScreenSize(vmin, vmax);
+        controllers[i]->mLodScreenSize = screenSize;
+        maxScreenSize = MAX(maxScreenSize, screenSize);
+        m_VisibleAnimated[numVisible++] = i;
+    }
+    m_VisibleAnimated.Resize(numVisible);
+    if (numVisible == 0)
+        return;
+
+    for (int i = 0; i < prefab->numMaterials; i++)
+        RequestMaterialTextures(prefab, prefab->materials[i], maxScreenSize);
+
+    rBindShader(m_GBufferShader);
+    rSetShaderValue(1, lHasAnimation);
+    rSetShaderValue(0, lIndirect);
+    rSetShaderValue(&scene->m_SunLight.dir.x, lSunDirG, GraphicType_Vector3f);
+    rSetTexture(GetBonePaletteTexture(), 4, lAnimTex);
+    rStencilMask(0x00);
+    rBindMesh(prefab->bigMesh);
+
+    Matrix4 invRoot = GetInverseRootPlacement(prefab);
+    for (int v = 0; v < numVisible; v++)
+    {
+        int i = m_VisibleAnimated[v];
+        rSetShaderValue(controllers[i]->mPaletteRow, lAnimRow);
+        SubmitAnimatedInstance(prefab, invRoot, transforms[i], lModel, true);
+    }
+}
+
+void RenderShadowOfAnimatedInstances(Scene* scene, PrefabID prefabID, AnimationController** controllers, const Matrix4* transforms, int count)
+{
+    if (!m_AnyCascadeRedraw) return;
+
+    Prefab* prefab = scene->GetPrefab(prefabID);
+    Matrix4 invRoot = GetInverseRootPlacement(prefab);
+    rSetShaderValue(1, lShadowHasAnimation);
+    rSetTexture(GetBonePaletteTexture(), 0, lShadowAnimTex);
+    rBindMesh(prefab->bigMesh);
+
+    for (int c = 0; c < ShadowSettings::NumCascades; c++)
+    {
+        const ShadowCascade& cascade = m_Cascades[c];
+        if (!cascade.needsRedraw) continue;
+
+        // near plane is not tested, casters between the light and the cascade cast shadows into it
+        float planes[6][4];
+        ExtractFrustumPlanes(cascade.viewProjection, planes);
+        CullAnimatedInstances(prefab, transforms, count, planes, FrustumPlane_Near);
+        if (m_VisibleAnimated.Size() == 0)
+            continue;
+
+        rSetViewportSizeAndOffset(ShadowSettings::CascadeSize, ShadowSettings::CascadeSize,
+                                  (c & 1) * ShadowSettings::CascadeSize, (c >> 1) * ShadowSettings::CascadeSize);
+        rSetShaderValue(cascade.viewProjection.GetPtr(), lShadowLightMatrix, GraphicType_Matrix4);
+        
+        for (int v = 0; v < m_VisibleAnimated.Size(); v++)
+        {
+            int i = m_VisibleAnimated[v];
+            rSetShaderValue(controllers[i]->mPaletteRow, lShadowAnimRow);
+            SubmitAnimatedInstance(prefab, invRoot, transforms[i], lShadowModel, false);
+        }
+    }
+}
+
+void RenderOutlined(Scene* scene, unsigned short prefabID, int nodeIndex, int primitiveIndex, AnimationController* animSystem)
+{
+    Prefab* prefab = scene->GetPrefab(prefabID);
+    const int hasAnimation = (int)(prefab->numSkins > 0 && animSystem != nullptr);    
+
+    rBindMesh(prefab->bigMesh);
+
+    ANode& node = prefab->nodes[nodeIndex];
+    if (node.type != 0 || node.index == -1) return;
+
+    AMesh* mesh = prefab->meshes + node.index;
+    APrimitive& primitive = mesh->primitives[primitiveIndex];
+    AMaterial& material = prefab->materials[primitive.material];
+
+    Matrix4 model = prefab->globalNodeTransforms[nodeIndex];
+
+    // draw outline, bigger mesh growth done in vertex shader
+    rToggleDepthTest(false);
+    rBindShader(m_OutlineShader);
+    rSetShaderValue(model.GetPtr(), rGetUniformLocation("uModel"), GraphicType_Matrix4);
+    rSetShaderValue(m_ViewProjection.GetPtr(), rGetUniformLocation("uViewProj"), GraphicType_Matrix4);
+
+    rStencilFunc(rNOTEQUAL, 1, 0xFF);
+    rStencilMask(0x00);
+
+    int offset = primitive.indexOffset;
+    rRenderMeshIndexOffset(prefab->bigMesh, primitive.numIndices, offset);
+
+    if (material.doubleSided)
+    {
+        rSetClockWise(true);
+        rRenderMeshIndexOffset(prefab->bigMesh, primitive.numIndices, offset);
+        rSetClockWise(false);
+    }
+
+    rStencilFunc(rALWAYS, 1, 0xFF);   
+    rStencilMask(0x00);
+
+    rToggleDepthTest(true);
+    rStencilToggle(false);
+}
+
+void InitRayTracing(Prefab* scene)
+{
+    #if 0
+    int numMatrices = scene->numNodes << 2;
+    int numInstances = scene->tlas->numNodesUsed;
     int numTLASNodes = scene->tlas->numNodesUsed << 1;
     int numBLASNodes = g_TotalBVHNodesUsed << 1;
     int numTriangles = g_CurrTriangleFace;
@@ -1010,31 +2081,429 @@ void RayTraceShadows(Prefab* scene)
     #endif
 }
 
-void RenderAllSceneContent(Scene* scene)
+/*//////////////////////////////////////////////////////////////////////////*/
+/*                          Mesh Instances                                  */
+/*//////////////////////////////////////////////////////////////////////////*/
+
+static bool MatricesEqual(const Matrix4& a, const Matrix4& b)
+{
+    const float* pa = a.GetPtr();
+    const float* pb = b.GetPtr();
+    for (int i = 0; i < 16; i++)
+        if (pa[i] != pb[i]) return false;
+    return true;
+}
+
+// world bounds of scene->m_MeshInstances, nodeIndices are the instance indices.
+// scene doesn't tell us which matrices are changed, so we compare with the matrices of the last update,
+// comparing is cheaper than transforming 8 corners and most of the props are static
+static void UpdateInstanceBounds(Scene* scene)
 {
-    #if 0
-    MeshInstance* instances = scene->m_MeshInstances.Data();
     const int numInstances = scene->m_MeshInstances.Size();
-    
-    QuickSortFn(instances, 0, numInstances - 1, MeshInstanceIndexCompare);
-    
+    bool updateAll = false;
+    if (m_InstanceBounds.minX == nullptr || m_InstanceBounds.numPrimitives != numInstances)
+    {
+        if (m_InstanceBounds.minX != nullptr)
+            FreePrimitiveBounds(&m_InstanceBounds);
+        AllocatePrimitiveBounds(&m_InstanceBounds, numInstances);
+        m_InstanceLocalBounds.Resize(numInstances);
+        m_InstanceMeshes.Resize(numInstances);
+        m_InstanceMatrices.Resize(numInstances);
+        updateAll = true;
+    }
+
+    for (int i = 0; i < numInstances; i++)
+    {
+        MeshInstance instance = scene->m_MeshInstances[i];
+        const Matrix4& matrix = scene->m_Matrices[i];
+        // removed meshes are swapped with the last one, so mesh of the index can change without count change
+        bool meshChanged = updateAll || m_InstanceMeshes[i].sceneExtIndex != instance.sceneExtIndex ||
+                                        m_InstanceMeshes[i].meshIndex != instance.meshIndex;
+
+        if (!meshChanged && MatricesEqual(m_InstanceMatrices[i], matrix))
+            continue;
+
+        InstanceLocalBounds& local = m_InstanceLocalBounds[i];
+        if (meshChanged)
+        {
+            AMesh& mesh = scene->GetPrefab(instance.sceneExtIndex)->meshes[instance.meshIndex];
+            // union of the primitives in local space
+            Vector4x32f localMin = VecSet1(+1e30f);
+            Vector4x32f localMax = VecSet1(-1e30f);
+            for (int j = 0; j < mesh.numPrimitives; j++)
+            {
+                localMin = VecMin(localMin, VecLoad(mesh.primitives[j].min));
+                localMax = VecMax(localMax, VecLoad(mesh.primitives[j].max));
+            }
+            VecStore(local.min, localMin);
+            VecStore(local.max, localMax);
+            m_InstanceMeshes[i] = instance;
+        }
+
+        SetPrimitiveBounds(&m_InstanceBounds, i, VecLoad(local.min), VecLoad(local.max), matrix);
+        m_InstanceBounds.nodeIndices[i] = i;
+        m_InstanceBounds.primitiveIndices[i] = 0;
+        m_InstanceMatrices[i] = matrix;
+    }
+}
+
+// | pass 4 | prefab 16 | mesh 16 | primitive 16 | unused 12 |
+// sorted items with the same key are instances of the same primitive, each run is one instanced draw.
+// gathers visible instances in [beginWord, endWord) into thread local list and sorts it, runs on worker threads
+static void GatherInstanceDrawItemsRange(void* data, int task, int beginWord, int endWord)
+{
+    Scene* scene = (Scene*)data;
+    DrawList* list = &m_DrawLists[task];
+    PrimitiveBounds& bounds = m_InstanceBounds;
+
+    list->items.Resize(0);
+    list->materialRequests.Resize(0);
+    list->numCulled = 0;
+
+    for (int w = beginWord; w < endWord; w++)
     {
-        rBindShader(m_GBufferShader);
-        rSetShaderValue(&scene->m_SunLight.dir.x, lSunDirG, GraphicType_Vector3f);
-        rSetShaderValue(hasAnimation, lHasAnimation);
+        for (uint64_t bits = bounds.visibility[w]; bits != 0; bits &= bits - 1)
+        {
+            int i = (w << 6) + TrailingZeroCount64(bits);
+            Vector4x32f vmin = VecSetR(bounds.minX[i], bounds.minY[i], bounds.minZ[i], 1.0f);
+            Vector4x32f vmax = VecSetR(bounds.maxX[i], bounds.maxY[i], bounds.maxZ[i], 1.0f);
+
+            if (!OcclusionTestAABB(vmin, vmax)) {
+                list->numCulled++;
+                continue;
+            }
+
+            MeshInstance instance = scene->m_MeshInstances[i];
+            Prefab* prefab = scene->GetPrefab(instance.sceneExtIndex);
+            AMesh& mesh = prefab->meshes[instance.meshIndex];
+            float screenSize = CalculateScreenSize(vmin, vmax);
+
+            for (int j = 0; j < mesh.numPrimitives; j++)
+            {
+                APrimitive& primitive = mesh.primitives[j];
+                if (primitive.numIndices == 0)
+                    continue;
+
+                bool hasMaterial = prefab->materials && primitive.material != UINT16_MAX;
+                AMaterial& material = hasMaterial ? prefab->materials[primitive.material] : m_defaultMaterial;
+                if (hasMaterial)
+                    list->materialRequests.Add({ prefab, primitive.material, screenSize });
+
+                bool isAlpha = (material.alphaMode == AMaterialAlphaMode_Mask ||
+                                material.alphaMode == AMaterialAlphaMode_Blend);
+                uint64_t pass = isAlpha ? DrawPass_AlphaMask : DrawPass_Opaque;
+
+                DrawItem item;
+                item.key = pass << 60 | (uint64_t)instance.sceneExtIndex << 44 | (uint64_t)instance.meshIndex << 28 | (uint64_t)j << 12;
+                item.nodeIndex = i;
+                item.primitiveIndex = j;
+                list->items.Add(item);
+            }
+        }
+    }
+
+    int numItems = list->items.Size();
+    list->temp.Resize(numItems);
+    list->sorted = RadixSortDrawItems(list->items.Data(), list->temp.Data(), numItems);
+}
+
+// culls the mesh instances and returns sorted draw items, same as GatherDrawItems
+static DrawItem* GatherInstanceDrawItems(Scene* scene, int* outCount)
+{
+    UpdateInstanceBounds(scene);
+
+    PrimitiveBounds& bounds = m_InstanceBounds;
+    MemsetZero(bounds.visibility, ((bounds.capacity + 63) / 64) * sizeof(uint64_t));
     
+    float planes[6][4];
+    ExtractFrustumPlanes(m_ViewProjection, planes);
+    int numVisible = CullPrimitiveBounds(bounds, planes, 6);
+    numCulled += bounds.numPrimitives - numVisible;
+
+    int numWords = (bounds.capacity + 63) / 64;
+    int numThreads = MIN(numVisible / MinGatherItemsPerThread, MaxGatherThreads);
+    numThreads = MIN(numThreads, GetNumJobThreads());
+    numThreads = ParallelRange(GatherInstanceDrawItemsRange, scene, numWords, numThreads);
+    m_NumGatheredLists += numThreads;
+
+    // texture streaming isn't thread safe
+    for (int l = 0; l < numThreads; l++)
+    {
+        const DrawList& list = m_DrawLists[l];
+        for (int r = 0; r < list.materialRequests.Size(); r++)
+        {
+            const MaterialRequest& request = list.materialRequests[r];
+            RequestMaterialTextures(request.prefab, request.prefab->materials[request.material], request.screenSize);
+        }
+        numCulled += list.numCulled;
+    }
+    return MergeDrawLists(numThreads, outCount);
+}
+
+static APrimitive& GetInstanceDrawItemPrimitive(Scene* scene, const DrawItem& item, Prefab** outPrefab)
+{
+    MeshInstance instance = scene->m_MeshInstances[item.nodeIndex];
+    *outPrefab = scene->GetPrefab(instance.sceneExtIndex);
+    return (*outPrefab)->meshes[instance.meshIndex].primitives[item.primitiveIndex];
+}
+
+// sets material and mesh of the run, returns draw flags
+static int BeginInstanceRun(Scene* scene, const DrawItem& item, Prefab** lastPrefab)
+{
+    Prefab* prefab;
+    APrimitive& primitive = GetInstanceDrawItemPrimitive(scene, item, &prefab);
+    if (prefab != *lastPrefab) {
         rBindMesh(prefab->bigMesh);
-    
-        Matrix4 viewProjection = m_Camera.view * m_Camera.projection;
-        rSetShaderValue(viewProjection.GetPtr(), lViewProj, GraphicType_Matrix4);
-        rSetShaderValue(m_LightMatrix.GetPtr(), lLightMatrix, GraphicType_Matrix4);
+        *lastPrefab = prefab;
     }
-    
-    for (const MeshInstance& instance : scene->m_MeshInstances.Size())
+
+    bool hasMaterial = prefab->materials && primitive.material != UINT16_MAX;
+    AMaterial& material = hasMaterial ? prefab->materials[primitive.material] : m_defaultMaterial;
+    SetMaterial(material, prefab, primitive);
+    rStencilMask(primitive.hasOutline ? 0xFF : 0x00);
+    return material.doubleSided ? DrawFlags_DoubleSided : 0;
+}
+
+// writes model matrices of the items to the rows of m_MeshInstanceTex in the same order.
+// returns the number of uploaded items, at most MaxMeshInstanceRows. rest is uploaded with the next call
+static int UploadInstanceMatrices(Scene* scene, const DrawItem* items, int count)
+{
+    count = MIN(count, MaxMeshInstanceRows);
+    m_MeshInstanceData.Resize(count);
+    for (int i = 0; i < count; i++)
+    {
+        Matrix4 columns = Matrix4::Transpose(scene->m_Matrices[items[i].nodeIndex]);
+        VecStore(m_MeshInstanceData[i].transform[0], columns.r[0]);
+        VecStore(m_MeshInstanceData[i].transform[1], columns.r[1]);
+        VecStore(m_MeshInstanceData[i].transform[2], columns.r[2]);
+    }
+    rUpdateTextureRegion(m_MeshInstanceTex, 0, 0, 3, count, m_MeshInstanceData.Data());
+    return count;
+}
+
+// GLES doesn't have multi draw indirect, matrices of the visible instances are uploaded to m_MeshInstanceTex
+// and each run of the same primitive is one instanced draw, uInstanceOffset is the first row of the run
+static void SubmitInstanceDrawItems(Scene* scene, const DrawItem* items, int count)
+{
+    uint64_t lastPass = ~0ull;
+    Prefab* lastPrefab = nullptr;
+
+    for (int chunkStart = 0; chunkStart < count;)
+    {
+        const DrawItem* chunk = items + chunkStart;
+        int chunkCount = UploadInstanceMatrices(scene, chunk, count - chunkStart);
+
+        int runStart = 0;
+        for (int i = 0; i < chunkCount; i++)
+        {
+            if (i + 1 < chunkCount && (chunk[i + 1].key >> 12) == (chunk[runStart].key >> 12))
+                continue;
+
+            const DrawItem& item = chunk[runStart];
+            uint64_t pass = item.key >> 60;
+            if (pass != lastPass) {
+                BeginDrawPass(pass, 0);
+                // alpha pass binds its own shader, so instancing uniforms are set for each pass
+                rSetShaderValue(3, lHasAnimation); // 3 means instanced static mesh
+                rSetTexture(m_MeshInstanceTex, 5, lInstanceTex);
+                lastPass = pass;
+            }
+
+            int flags = BeginInstanceRun(scene, item, &lastPrefab);
+            Prefab* prefab;
+            APrimitive& primitive = GetInstanceDrawItemPrimitive(scene, item, &prefab);
+            int numInstances = i + 1 - runStart;
+            rSetShaderValue(runStart, lInstanceOffset);
+
+            rRenderMeshIndexOffsetInstanced(prefab->bigMesh, primitive.numIndices, primitive.indexOffset, numInstances);
+            if (flags & DrawFlags_DoubleSided)
+            {
+                rSetClockWise(true);
+                rRenderMeshIndexOffsetInstanced(prefab->bigMesh, primitive.numIndices, primitive.indexOffset, numInstances);
+                rSetClockWise(false);
+            }
+            runStart = i + 1;
+        }
+        chunkStart += chunkCount;
+    }
+
+    // alpha shader is shared with the prefabs and they don't set uHasAnimation
+    if (lastPass == DrawPass_AlphaMask)
+        rSetShaderValue(0, lHasAnimation);
+}
+
+// each run of the same primitive is one command, instanceCount is length of the run and
+// baseInstance is the first matrix of the run in draw data, so aDrawID becomes the instance index.
+// items are submitted in chunks of maxDraws, runs that cross a chunk are split in to two commands
+static void SubmitInstanceDrawItemsIndirect(Scene* scene, const DrawItem* items, int count)
+{
+    const int drawDataBinding = 2; // binding in 3DVert.glsl
+    const int maxDraws = m_IndirectBuffer.maxDraws;
+    uint64_t lastPass = ~0ull;
+    Prefab* lastPrefab = nullptr;
+
+    for (int chunkStart = 0; chunkStart < count; chunkStart += maxDraws)
     {
+        int chunkCount = MIN(count - chunkStart, maxDraws);
+        const DrawItem* chunk = items + chunkStart;
         
+        m_IndirectDrawData.Resize(chunkCount);
+        m_IndirectCommands.Resize(0);
+
+        int runStart = 0;
+        for (int i = 0; i < chunkCount; i++)
+        {
+            IndirectDrawData& drawData = m_IndirectDrawData[i];
+            drawData.model = scene->m_Matrices[chunk[i].nodeIndex];
+            drawData.info[0] = drawData.info[1] = drawData.info[2] = drawData.info[3] = 0;
+
+            if (i + 1 < chunkCount && (chunk[i + 1].key >> 12) == (chunk[runStart].key >> 12))
+                continue;
+
+            Prefab* prefab;
+            APrimitive& primitive = GetInstanceDrawItemPrimitive(scene, chunk[runStart], &prefab);
+
+            DrawElementsIndirectCommand command;
+            command.count         = primitive.numIndices;
+            command.instanceCount = i + 1 - runStart;
+            command.firstIndex    = primitive.indexOffset;
+            command.baseVertex    = 0;
+            command.baseInstance  = runStart;
+            m_IndirectCommands.Add(command);
+            runStart = i + 1;
+        }
+        rUploadIndirectBuffer(m_IndirectBuffer, m_IndirectCommands.Data(), m_IndirectCommands.Size(),
+                              m_IndirectDrawData.Data(), chunkCount);
+
+        for (int c = 0; c < m_IndirectCommands.Size(); c++)
+        {
+            const DrawItem& item = chunk[m_IndirectCommands[c].baseInstance];
+            uint64_t pass = item.key >> 60;
+            if (pass != lastPass) {
+                BeginDrawPass(pass, 1);
+                lastPass = pass;
+            }
+
+            int flags = BeginInstanceRun(scene, item, &lastPrefab);
+            rRenderMeshMultiIndirect(lastPrefab->bigMesh, m_IndirectBuffer, c, 1, drawDataBinding);
+            if (flags & DrawFlags_DoubleSided)
+            {
+                rSetClockWise(true);
+                rRenderMeshMultiIndirect(lastPrefab->bigMesh, m_IndirectBuffer, c, 1, drawDataBinding);
+                rSetClockWise(false);
+            }
+        }
+    }
+}
+
+// draws scene->m_MeshInstances to gbuffer, instances are culled and sorted by (prefab, mesh, primitive)
+// then each primitive is drawn once with instancing. props that placed thousands of times cost one draw per primitive
+void RenderAllSceneContent(Scene* scene)
+{
+    if (scene->m_MeshInstances.Size() == 0)
+        return;
+
+    int numItems;
+    DrawItem* sorted = GatherInstanceDrawItems(scene, &numItems);
+
+    rBindShader(m_GBufferShader);
+    rSetShaderValue(0, lHasAnimation);
+    rSetShaderValue(&scene->m_SunLight.dir.x, lSunDirG, GraphicType_Vector3f);
+
+    if (m_IndirectBuffer.commandHandle != 0)
+        SubmitInstanceDrawItemsIndirect(scene, sorted, numItems);
+    else
+        SubmitInstanceDrawItems(scene, sorted, numItems);
+
+    rStencilMask(0x00);
+}
+
+// each run of the same mesh is one instanced draw per primitive, shadow shader has to be set for instancing
+static void SubmitInstanceShadows(Scene* scene, const DrawItem* items, int count)
+{
+    Prefab* lastPrefab = nullptr;
+    for (int chunkStart = 0; chunkStart < count;)
+    {
+        const DrawItem* chunk = items + chunkStart;
+        int chunkCount = UploadInstanceMatrices(scene, chunk, count - chunkStart);
+
+        int runStart = 0;
+        for (int i = 0; i < chunkCount; i++)
+        {
+            if (i + 1 < chunkCount && chunk[i + 1].key == chunk[runStart].key)
+                continue;
+
+            MeshInstance instance = scene->m_MeshInstances[chunk[runStart].nodeIndex];
+            Prefab* prefab = scene->GetPrefab(instance.sceneExtIndex);
+            if (prefab != lastPrefab) {
+                rBindMesh(prefab->bigMesh);
+                lastPrefab = prefab;
+            }
+            rSetShaderValue(runStart, lShadowInstanceOffset);
+
+            int numInstances = i + 1 - runStart;
+            AMesh& mesh = prefab->meshes[instance.meshIndex];
+            for (int j = 0; j < mesh.numPrimitives; j++)
+            {
+                APrimitive& primitive = mesh.primitives[j];
+                if (primitive.numIndices > 0)
+                    rRenderMeshIndexOffsetInstanced(prefab->bigMesh, primitive.numIndices, primitive.indexOffset, numInstances);
+            }
+            runStart = i + 1;
+        }
+        chunkStart += chunkCount;
+    }
+}
+
+// draws scene->m_MeshInstances into the cascades that are going to be redrawn, 
+// call between BeginShadowRendering and EndShadowRendering
+void RenderShadowOfSceneContent(Scene* scene)
+{
+    if (!m_AnyCascadeRedraw || scene->m_MeshInstances.Size() == 0)
+        return;
+
+    UpdateInstanceBounds(scene);
+    PrimitiveBounds& bounds = m_InstanceBounds;
+    int numWords = (bounds.capacity + 63) / 64;
+    rSetShaderValue(3, lShadowHasAnimation); // 3 means instanced static mesh
+    rSetTexture(m_MeshInstanceTex, 1, lShadowInstanceTex);
+
+    for (int c = 0; c < ShadowSettings::NumCascades; c++)
+    {
+        const ShadowCascade& cascade = m_Cascades[c];
+        if (!cascade.needsRedraw) continue;
+
+        // near plane is not tested, casters between the light and the cascade cast shadows into it
+        float planes[6][4];
+        ExtractFrustumPlanes(cascade.viewProjection, planes);
+        MemsetZero(bounds.visibility, numWords * sizeof(uint64_t));
+        if (CullPrimitiveBounds(bounds, planes, FrustumPlane_Near) == 0)
+            continue;
+
+        // | prefab 16 | mesh 16 |, runs of the same mesh are drawn with instancing
+        m_DrawItems.Resize(0);
+        for (int w = 0; w < numWords; w++)
+        {
+            for (uint64_t bits = bounds.visibility[w]; bits != 0; bits &= bits - 1)
+            {
+                int i = (w << 6) + TrailingZeroCount64(bits);
+                MeshInstance instance = scene->m_MeshInstances[i];
+                DrawItem item;
+                item.key = (uint64_t)instance.sceneExtIndex << 44 | (uint64_t)instance.meshIndex << 28;
+                item.nodeIndex = i;
+                item.primitiveIndex = 0;
+                m_DrawItems.Add(item);
+            }
+        }
+        int numItems = m_DrawItems.Size();
+        m_DrawItemsTemp.Resize(numItems);
+        DrawItem* sorted = RadixSortDrawItems(m_DrawItems.Data(), m_DrawItemsTemp.Data(), numItems);
+
+        rSetViewportSizeAndOffset(ShadowSettings::CascadeSize, ShadowSettings::CascadeSize,
+                                  (c & 1) * ShadowSettings::CascadeSize, (c >> 1) * ShadowSettings::CascadeSize);
+        rSetShaderValue(cascade.viewProjection.GetPtr(), lShadowLightMatrix, GraphicType_Matrix4);
+        SubmitInstanceShadows(scene, sorted, numItems);
     }
-    #endif
 }
 
 static void LightingPass()
@@ -1126,6 +2595,7 @@ static void GodRaysPass()
 void EndRendering(bool renderToBackBuffer)
 {
     // RayTraceShadows(mainScene);
+    m_CameraUpdated = false;
 
     Vector2i windowSize;
     wGetWindowSize(&windowSize.x, &windowSize.y);
@@ -1182,6 +2652,15 @@ void Destroy()
 
     rDeleteTexture(m_ShadowTexture);
     rDeleteFrameBuffer(m_ShadowFrameBuffer);
+    rDeleteIndirectBuffer(m_IndirectBuffer);
+    if (m_InstanceBounds.minX != nullptr)
+        FreePrimitiveBounds(&m_InstanceBounds);
+    if (m_BakedBounds.minX != nullptr)
+        FreePrimitiveBounds(&m_BakedBounds);
+    if (m_AnimatedBounds.minX != nullptr)
+        FreePrimitiveBounds(&m_AnimatedBounds);
+    rDeleteTexture(m_BakedInstanceTex);
+    rDeleteTexture(m_MeshInstanceTex);
     HBAODestroy();
 }
 
@@ -1220,13 +2699,12 @@ void ShowEditor(float offset, bool* open)
 
     if (uBeginWindow("Graphics", 23455u + (uint)offset, position, scale, open))
     {
-        if (uFloatFieldW("Ortho Size", &ShadowSettings::OrthoSize, 16.0f, 512.0f, 0.5f))
+        if (uFloatFieldW("Shadow Distance", &ShadowSettings::ShadowDistance, 16.0f, 512.0f, 0.5f))
         {
             m_RedrawShadows = 1;
         }
-    
-        static int orthoIndex = 0;
-        if (uFloatVecFieldW("Ortho Offset", &ShadowSettings::OrthoOffset.x, 3, &orthoIndex, -200.0f, +200.0f, 0.2f))
+
+        if (uFloatFieldW("Cascade Split", &ShadowSettings::SplitLambda, 0.0f, 1.0f, 0.01f))
         {
             m_RedrawShadows = 1;
         }
@@ -1236,7 +2714,7 @@ void ShowEditor(float offset, bool* open)
             m_RedrawShadows = 1;
         }
 
-        if (uFloatFieldW("Far Plane", &ShadowSettings::FarPlane, 8.0f, 256.0f, 0.04f))
+        if (uFloatFieldW("Caster Distance", &ShadowSettings::CasterDistance, 8.0f, 256.0f, 0.04f))
         {
             m_RedrawShadows = 1;
         }
@@ -1244,6 +2722,31 @@ void ShowEditor(float offset, bool* open)
         uSeperatorW(uGetColor(uColor::SelectedBorder), uTriEffect_None, 0.95f);
 
         HBAOEdit();
+
+        OcclusionEdit();
+
+        bool stateCache = rIsStateCacheEnabled();
+        if (uCheckBoxW("GL State Cache", &stateCache, true))
+        {
+            rSetStateCacheEnabled(stateCache);
+        }
+
+        // counters of the last frame, fields are read only. editing them doesn't change anything
+        rStateStats stateStats = rGetStateStats();
+        uIntFieldW("GL Calls Issued", &stateStats.issued, 0, INT32_MAX, 0.0f);
+        uIntFieldW("GL Calls Filtered", &stateStats.filtered, 0, INT32_MAX, 0.0f);
+        // number of draw lists that are gathered in parallel, more than one per prefab means gathering is split between threads
+        int numDrawLists = m_NumGatheredLists;
+        uIntFieldW("Draw Lists", &numDrawLists, 0, INT32_MAX, 0.0f);
+
+        #if !AX_GAME_BUILD
+        // used while importing scenes, higher values gives smaller texture files
+        float rdoLambda = GetTextureRDOLambda();
+        if (uFloatFieldW("Texture RDO", &rdoLambda, 0.0f, 8.0f, 0.05f))
+        {
+            SetTextureRDOLambda(rdoLambda);
+        }
+        #endif
      
         TerrainShowEditor();
 
@@ -15,66 +15,34 @@ extern BVHNode* g_BVHNodes;
 TLAS::TLAS(Prefab* scene)
 {
     this->prefab = scene;
+    this->numNodesUsed = 0;
     
+    // world bounds of the primitives are already calculated with Prefab::UpdateWorldBounds
+    const PrimitiveBounds& bounds = scene->worldBounds;
     int numPrimitives = 0;
-    for (int m = 0; m < scene->numMeshes; m++)
+    for (int i = 0; i < bounds.numPrimitives; i++)
     {
-        numPrimitives += scene->meshes[m].numPrimitives;
+        const ANode& node = scene->nodes[bounds.nodeIndices[i]];
+        numPrimitives += scene->meshes[node.index].primitives[bounds.primitiveIndices[i]].numIndices != 0;
     }
     
     instances = new BVHInstance[numPrimitives];
     int primitiveIndex = 0;
     
-    // copy a pointer to the array of bottom level 
-    Queue<int> nodeStack = {};
-    nodeStack.Enqueue(scene->GetRootNodeIdx());
-    
-    // iterate over scene nodes
-    while (!nodeStack.Empty())
+    for (int i = 0; i < bounds.numPrimitives; i++)
     {
-        int nodeIndex = nodeStack.Dequeue();
-        // nodeStack.pop();
-        ANode& node = scene->nodes[nodeIndex];
-        AMesh amesh = scene->meshes[node.index];
-        Matrix4 model = scene->globalNodeTransforms[nodeIndex];
-        
-        if (node.type == 0 && node.index != -1)
-        for (int j = 0; j < amesh.numPrimitives; ++j)
-        {
-            APrimitive& primitive = amesh.primitives[j];
-            if (primitive.numIndices == 0) continue;
+        int nodeIndex = bounds.nodeIndices[i];
+        APrimitive& primitive = scene->meshes[scene->nodes[nodeIndex].index].primitives[bounds.primitiveIndices[i]];
+        if (primitive.numIndices == 0) continue;
             
-            BVHInstance* instance = &instances[primitiveIndex++];
-            BVHNode* bvh = &g_BVHNodes[primitive.bvhNodeIndex];
-            instance->bvhIndex = primitive.bvhNodeIndex;
-            instance->nodeIndex = nodeIndex;
-            instance->primitiveIndex = j;
-            // calculate world-space bounds using the new matrix
-            instance->bounds = AABB();
-        
-            Vector4x32f vmin = VecSet1(1e30f);  
-            Vector4x32f vmax = VecSet1(-1e30f); 
-
-            // convert local Bounds to global bounds
-            for (int i = 0; i < 8; i++)
-            {
-                Vector4x32f point = VecSetR(i & 1 ? primitive.max[0] : primitive.min[0],
-                                      i & 2 ? primitive.max[1] : primitive.min[1],
-                                      i & 4 ? primitive.max[2] : primitive.min[2], 1.0f);
-                point = Vector4Transform(point, model.r);
-                vmin = VecMin(vmin, point);
-                vmax = VecMax(vmax, point);
-            }
-
-            instance->bounds.grow(vmin);
-            instance->bounds.grow(vmax);
-            instance->centeroid = (instance->bounds.bmin3 + instance->bounds.bmax3) * 0.5f;
-        }
-
-        for (int j = 0; j < node.numChildren; j++)
-        {
-            nodeStack.Enqueue(node.children[j]);
-        }
+        BVHInstance* instance = &instances[primitiveIndex++];
+        instance->bvhIndex = primitive.bvhNodeIndex;
+        instance->nodeIndex = nodeIndex;
+        instance->primitiveIndex = bounds.primitiveIndices[i];
+        instance->boundsIndex = i;
+        instance->bounds.bmin = VecSetR(bounds.minX[i], bounds.minY[i], bounds.minZ[i], 1.0f);
+        instance->bounds.bmax = VecSetR(bounds.maxX[i], bounds.maxY[i], bounds.maxZ[i], 1.0f);
+        instance->centeroid = (instance->bounds.bmin3 + instance->bounds.bmax3) * 0.5f;
     }
 
     blasCount = numPrimitives;
@@ -333,4 +301,95 @@ void TLAS::TraverseBVH(const Ray& ray, uint rootNode, Triout* out)
     }
 }
 
+void TLAS::Refit()
+{
+    const PrimitiveBounds& bounds = prefab->worldBounds;
+    for (uint i = 0; i < blasCount; i++)
+    {
+        BVHInstance* instance = instances + i;
+        uint b = instance->boundsIndex;
+        instance->bounds.bmin = VecSetR(bounds.minX[b], bounds.minY[b], bounds.minZ[b], 1.0f);
+        instance->bounds.bmax = VecSetR(bounds.maxX[b], bounds.maxY[b], bounds.maxZ[b], 1.0f);
+        instance->centeroid = (instance->bounds.bmin3 + instance->bounds.bmax3) * 0.5f;
+    }
+
+    // children are always allocated after the parent, so reverse order visits children first
+    for (int i = (int)numNodesUsed - 1; i >= 0; i--)
+    {
+        TLASNode* node = tlasNodes + i;
+        if (node->instanceCount > 0) 
+        {
+            Vector4x32f centeroidMin, centeroidMax; 
+            UpdateNodeBounds(i, &centeroidMin, &centeroidMax);
+            continue;
+        }
+        // don't use minv and maxv directly, w components are leftFirst and instanceCount
+        const TLASNode* left  = tlasNodes + node->leftFirst;
+        const TLASNode* right = left + 1;
+        Vec3Store(&node->aabbMin.x, VecMin(left->minv, right->minv));
+        Vec3Store(&node->aabbMax.x, VecMax(left->maxv, right->maxv));
+    }
+}
+
+// returns false if box is behind one of the planes, clears the bits of the planes that box is completely in front of
+static bool FrustumTestAABB(const float planes[][4], const float* bmin, const float* bmax, uint& planeMask)
+{
+    for (uint mask = planeMask; mask != 0; mask &= mask - 1)
+    {
+        int p = TrailingZeroCount32(mask);
+        const float* plane = planes[p];
+        // furthest corner along the normal (p-vertex) and the closest one (n-vertex)
+        float pDist = plane[3], nDist = plane[3];
+        for (int i = 0; i < 3; i++)
+        {
+            bool positive = plane[i] >= 0.0f;
+            pDist += plane[i] * (positive ? bmax[i] : bmin[i]);
+            nDist += plane[i] * (positive ? bmin[i] : bmax[i]);
+        }
+        if (pDist < 0.0f) return false;
+        if (nDist >= 0.0f) planeMask &= ~(1u << p);
+    }
+    return true;
+}
+
+int TLAS::CullFrustum(const float planes[][4], int numPlanes, uint64_t* visibility)
+{
+    if (numNodesUsed == 0) return 0;
+
+    struct StackItem { uint nodeIndex, planeMask; };
+    StackItem stack[64];
+    int stackSize = 0;
+    int numVisible = 0;
+    stack[stackSize++] = { 0u, (1u << numPlanes) - 1u };
+
+    while (stackSize > 0)
+    {
+        StackItem item = stack[--stackSize];
+        const TLASNode* node = tlasNodes + item.nodeIndex;
+        uint planeMask = item.planeMask;
+
+        if (!FrustumTestAABB(planes, &node->aabbMin.x, &node->aabbMax.x, planeMask))
+            continue;
 
+        uint instanceCount = node->instanceCount, leftFirst = node->leftFirst;
+        if (instanceCount > 0) // is leaf 
+        {
+            for (uint i = leftFirst; i < leftFirst + instanceCount; i++)
+            {
+                const BVHInstance* instance = instances + i;
+                uint instanceMask = planeMask;
+                if (!FrustumTestAABB(planes, &instance->bounds.bmin3.x, &instance->bounds.bmax3.x, instanceMask))
+                    continue;
+                
+                visibility[instance->boundsIndex >> 6] |= 1ull << (instance->boundsIndex & 63);
+                numVisible++;
+            }
+            continue;
+        }
+
+        ASSERT(stackSize + 2 <= 64);
+        stack[stackSize++] = { leftFirst + 1, planeMask };
+        stack[stackSize++] = { leftFirst, planeMask };
+    }
+    return numVisible;
+}
@@ -3,6 +3,7 @@
 #include "include/Platform.hpp"
 #include "include/UI.hpp"
 #include "include/Camera.hpp"
+#include "include/AssetManager.hpp"
 
 #include "../ASTL/Math/Matrix.hpp"
 #include "../ASTL/IO.hpp"
@@ -23,7 +24,6 @@ static GPUMesh mTreeMesh;
 
 // From Texture.cpp
 extern void CompressSaveImages(char* path, const char** images, int numImages);
-extern void LoadSceneImages(char* path, Texture* textures, int numImages);
 
 static Texture mLayers[3 * 3];
 
@@ -120,7 +120,7 @@ void TerrainCreateShaders()
         DeleteShaders();
     }
     else {
-        mGreyNoiseTexture = rImportTexture("Assets/Textures/ShadertoyGreyNoise.png");
+        mGreyNoiseTexture = ImportSharedTexture("Assets/Textures/ShadertoyGreyNoise.png", TexFlags_None);
         LoadTerrainLayerTextures();
         LoadTreeTextures();
     }
@@ -506,6 +506,14 @@ void TerrainDestroy()
     rDeleteTexture(mNormalTexture);    
     rDeleteTexture(mNormalTexture1);
     rDeleteTexture(mTestTexture2d);
+    ReleaseTexture(mGreyNoiseTexture);
+
+    // layer textures are shared with prefabs that are using the same images
+    for (int i = 0; i < ArraySize(mLayers); i++)
+        ReleaseTexture(mLayers[i]);
+
+    for (int i = 0; i < ArraySize(mTreeLogTextures); i++)
+        ReleaseTexture(mTreeLogTextures[i]);
     DeleteShaders();
 }
 
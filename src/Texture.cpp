@@ -5,6 +5,9 @@
 *    using BCn texture compression on Windows                               *
 *    and using ASTC texture compression for storing textures on android     *
 *    also compressing further with zstd to reduce the size on disk.         *
+*    each mip of the images has its own zstd frame and an offset table at  *
+*    the header so scene textures and their mips can be loaded when they   *
+*    are first used.                                                        *
 *                                                                           *
 *  Textures and Corresponding Formats:                                      *
 *    R  = BC4                                                               *
@@ -21,6 +24,7 @@
 
 #include <thread>
 #include <bitset>
+#include <math.h> // log10 for psnr
 
 #include "include/AssetManager.hpp"
 #include "include/Scene.hpp"
@@ -30,6 +34,7 @@
 #include "../ASTL/String.hpp"
 #include "../ASTL/Math/Math.hpp"
 #include "../ASTL/Array.hpp"
+#include "../ASTL/HashMap.hpp"
 #include "../ASTL/Additional/GLTFParser.hpp"
 #include "../ASTL/IO.hpp"
 #include "../ASTL/MultiThreading/ParallelFor.hpp"
@@ -56,10 +61,221 @@ namespace {
         int width, height;
         int numComp;
         int isNormal;
+        int atlasPage; // -1 if this image is not in an atlas
+        short atlasX, atlasY;
     };
+
+    const int MaxPackMips = 8;
+
+    // each mip of the image has its own zstd frame, so we can decompress textures and mips individually
+    struct ImagePackEntry
+    {
+        uint64_t offset; // from the begining of the file
+        uint64_t compressedSize; // sum of the mip frames
+        uint64_t decompressedSize;
+        uint64_t contentHash; // hash of the encoded image, same textures in different packs are loaded once
+        uint32_t mipCompressedSizes[MaxPackMips]; // mip frames are stored after each other, starting from the base level
+    };
+
+    struct ImageResidency
+    {
+        uint8_t  residentMip;   // highest resolution mip that is on gpu
+        uint8_t  requiredMip;   // smallest mip requested this frame, NotRequested if not drawn
+        uint32_t lastUsedFrame; // for LRU eviction
+    };
+}
+
+// lazily loaded texture pack, images are uploaded to gpu when they are first requested
+struct TexturePack
+{
+    AFile file; // kept open for random access
+    int numImages;
+    int numLoaded;
+    ImageInfo* infos;
+    ImagePackEntry* entries;
+    ImageResidency* residency;
+    Texture* textures;
+    int numAtlasPages;
+    Texture* atlasPages; // small images are packed into these
+};
+
+const int g_AXTextureVersion = 12355;
+
+// images smaller or equal to 128x128 are not compressed, they are packed into RGBA8 atlases
+static const int AtlasSize    = 1024;
+static const int AtlasPadding = 1;
+
+// 1x1 grey texture, bound until the real texture is loaded
+static Texture g_TexturePlaceholder = {};
+
+// loading too many textures in one frame causes hitches, rest of them will be loaded next frames
+static const int MaxTextureLoadsPerFrame = 4;
+static int g_NumTextureLoadsThisFrame = 0;
+
+// small images are not compressed and doesn't have mips, compressed images are stored with their mips
+static int GetNumMips(ImageInfo info)
+{
+    bool notCompressed = info.width <= 128 && info.height <= 128;
+    if (notCompressed) return 1;
+    // 512->4, 1024->5, 2048->5
+    int numMips = MIN(MAX((int)Log2((unsigned)info.width) >> 1, 1), MaxPackMips);
+    // smallest mip has to be at least one block
+    while (numMips > 1 && (MIN(info.width, info.height) >> (numMips - 1)) < 4)
+        numMips--;
+    return numMips;
+}
+
+// size of the single mip in the pack and in gpu memory
+static uint64_t GetMipDataSize(ImageInfo info, int mip, bool isMobile)
+{
+    uint64_t width  = (uint64_t)MAX(info.width  >> mip, 1);
+    uint64_t height = (uint64_t)MAX(info.height >> mip, 1);
+    bool notCompressed = info.width <= 128 && info.height <= 128;
+    if (notCompressed) return width * height * info.numComp;
+    // 4x4 blocks, BC4 is 8 byte per block, BC5, DXT5 and ASTC4x4 are 16 byte per block
+    uint64_t blockSize = (info.numComp == 1 && !isMobile) ? 8 : 16;
+    return ((width + 3) >> 2) * ((height + 3) >> 2) * blockSize;
+}
+
+/*//////////////////////////////////////////////////////////////////////////*/
+/*                          Texture Streaming                               */
+/*//////////////////////////////////////////////////////////////////////////*/
+
+static const uint8_t NotRequested = 0xFF;
+// we are not dropping mips of the textures that are smaller than this
+static const int MinStreamingSize = 64;
+static const uint64_t DefaultTextureBudget = IsAndroid() ? (256ull << 20) : (1024ull << 20);
+
+static Array<TexturePack*> g_TexturePacks = {};
+static uint64_t g_TextureBudget = DefaultTextureBudget;
+static uint64_t g_TextureMemoryUsage = 0;
+static uint32_t g_StreamingFrame = 0;
+
+/*//////////////////////////////////////////////////////////////////////////*/
+/*                          Texture Registry                                */
+/*//////////////////////////////////////////////////////////////////////////*/
+
+// textures that has the same content are shared between prefabs, terrain and editor
+struct SharedTexture
+{
+    uint64_t hash; // zero if the texture is released
+    Texture  texture;
+    int      refCount;
+};
+
+static HashMap<uint64_t, SharedTexture> g_SharedTextures = {};
+// gl handle to content hash, zero if the texture is not shared
+static HashMap<unsigned int, uint64_t> g_SharedTextureHandles = {};
+
+// simple 64 bit hash, only used for texture contents
+static uint64_t HashTextureData(const unsigned char* data, uint64_t size, uint64_t seed)
+{
+    uint64_t hash = seed ^ (size * 0x9E3779B97F4A7C15ull);
+    uint64_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t k;
+        SmallMemCpy(&k, data + i, 8);
+        k *= 0x87C37B91114253D5ull;
+        k  = (k << 31) | (k >> 33);
+        k *= 0x4CF5AD432745937Full;
+        hash ^= k;
+        hash  = ((hash << 27) | (hash >> 37)) * 5 + 0x52DCE729;
+    }
+    
+    for (; i < size; i++)
+        hash = (hash ^ data[i]) * 0x100000001B3ull;
+    
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static SharedTexture* FindSharedTexture(uint64_t hash)
+{
+    if (hash == 0) return nullptr;
+    SharedTexture& shared = g_SharedTextures[hash];
+    // make sure that this is the same content, not only the same bucket
+    return shared.hash == hash && shared.refCount > 0 ? &shared : nullptr;
+}
+
+static SharedTexture* FindSharedTextureHandle(unsigned int handle)
+{
+    return FindSharedTexture(g_SharedTextureHandles[handle]);
+}
+
+// increases reference count and returns true if texture with same content is loaded before
+static bool AcquireSharedTexture(uint64_t hash, Texture* texture)
+{
+    SharedTexture* shared = FindSharedTexture(hash);
+    if (shared == nullptr) return false;
+    shared->refCount++;
+    *texture = shared->texture;
+    return true;
 }
 
-const int g_AXTextureVersion = 12351;
+static void RegisterSharedTexture(uint64_t hash, Texture texture)
+{
+    if (hash == 0) return;
+    g_SharedTextures[hash] = { hash, texture, 1 };
+    g_SharedTextureHandles[texture.handle] = hash;
+}
+
+static bool IsTextureShared(unsigned int handle)
+{
+    SharedTexture* shared = FindSharedTextureHandle(handle);
+    return shared != nullptr && shared->refCount > 1;
+}
+
+// texture is recreated with streaming, update the registry so next users get the new texture
+static void UpdateSharedTexture(unsigned int oldHandle, Texture texture)
+{
+    SharedTexture* shared = FindSharedTextureHandle(oldHandle);
+    if (shared == nullptr) return;
+    shared->texture = texture;
+    g_SharedTextureHandles[oldHandle] = 0;
+    g_SharedTextureHandles[texture.handle] = shared->hash;
+}
+
+bool ReleaseTexture(const Texture& texture)
+{
+    if (!IsTextureLoaded(texture)) 
+        return false; // placeholder is never deleted
+    
+    SharedTexture* shared = FindSharedTextureHandle(texture.handle);
+    if (shared != nullptr)
+    {
+        if (--shared->refCount > 0)
+            return false;
+        shared->hash = 0;
+        g_SharedTextureHandles[texture.handle] = 0; // gl might reuse the handle
+    }
+    rDeleteTexture(texture);
+    return true;
+}
+
+Texture ImportSharedTexture(const char* path, int flags)
+{
+    uint64_t hash = 0;
+    AFile file = AFileOpen(path, AOpenFlag_ReadBinary);
+    if (AFileExist(file))
+    {
+        uint64_t size = AFileSize(file);
+        ScopedPtr<unsigned char> data = new unsigned char[size];
+        AFileRead(data.ptr, size, file);
+        hash = HashTextureData(data.ptr, size, (uint64_t)flags);
+    }
+    AFileClose(file);
+    
+    Texture texture;
+    if (AcquireSharedTexture(hash, &texture))
+        return texture;
+    
+    texture = rImportTexture(path, flags);
+    RegisterSharedTexture(hash, texture);
+    return texture;
+}
 
 // note: maybe we will need to check for data changed or not.
 bool IsTextureLastVersion(const char* path)
@@ -162,7 +378,229 @@ static void CompressBC5(const unsigned char* RESTRICT src, unsigned char* bc5, i
     }
 }
 
-uint64_t ASTCCompress(unsigned char* buffer, unsigned char* image, int dim_x, int dim_y)
+/*//////////////////////////////////////////////////////////////////////////*/
+/*                    Rate Distortion Optimization                          */
+/*//////////////////////////////////////////////////////////////////////////*/
+
+// BC blocks are made of 8 byte units, BC4 unit is single channel, BC1 unit is rgb565 color.
+// rdo replaces the unit with one of the recently used units (or their selectors) if error increase
+// is small compared to bits that we save, repeated patterns are compressed better with zstd.
+// lambda zero disables rdo, only measures the psnr. editor can change it from graphics window before importing
+static float g_TextureRDOLambda = 1.0f;
+
+static const int   RDOWindow          = 64;   // number of recent units that we try
+static const float RDOMaxMSEIncrease  = 12.0f; // per pixel, per channel. bounds the psnr loss
+static const float RDOFreshUnitBits   = 64.0f;
+static const float RDOMatchUnitBits   = 12.0f; // zstd match of 8 bytes
+static const float RDOSelectorMatchBits = 32.0f; // literal endpoints + 6 byte match
+
+struct RDOHistory
+{
+    uint64_t units[RDOWindow];
+    int count, next;
+};
+
+void SetTextureRDOLambda(float lambda)
+{
+    g_TextureRDOLambda = MAX(lambda, 0.0f);
+}
+
+float GetTextureRDOLambda()
+{
+    return g_TextureRDOLambda;
+}
+
+static void DecodeBC4Unit(uint64_t unit, unsigned char* out)
+{
+    int r0 = int(unit & 0xFF), r1 = int((unit >> 8) & 0xFF);
+    int palette[8] = { r0, r1 };
+    if (r0 > r1) {
+        for (int i = 1; i < 7; i++) palette[i + 1] = ((7 - i) * r0 + i * r1) / 7;
+    }
+    else {
+        for (int i = 1; i < 5; i++) palette[i + 1] = ((5 - i) * r0 + i * r1) / 5;
+        palette[6] = 0, palette[7] = 255;
+    }
+    for (int i = 0; i < 16; i++)
+        out[i] = (unsigned char)palette[(unit >> (16 + i * 3)) & 7];
+}
+
+// color part of DXT5 block is always 4 color mode
+static void DecodeBC1Unit(uint64_t unit, unsigned char* out)
+{
+    int colors[4][3];
+    for (int c = 0; c < 2; c++)
+    {
+        uint32_t rgb565 = uint32_t(unit >> (c * 16)) & 0xFFFF;
+        colors[c][0] = ((rgb565 >> 11) & 31) * 255 / 31;
+        colors[c][1] = ((rgb565 >> 5)  & 63) * 255 / 63;
+        colors[c][2] = ((rgb565 >> 0)  & 31) * 255 / 31;
+    }
+    for (int j = 0; j < 3; j++)
+    {
+        colors[2][j] = (2 * colors[0][j] + colors[1][j]) / 3;
+        colors[3][j] = (colors[0][j] + 2 * colors[1][j]) / 3;
+    }
+    for (int i = 0; i < 16; i++)
+    {
+        int index = int(unit >> (32 + i * 2)) & 3;
+        out[i * 3 + 0] = (unsigned char)colors[index][0];
+        out[i * 3 + 1] = (unsigned char)colors[index][1];
+        out[i * 3 + 2] = (unsigned char)colors[index][2];
+    }
+}
+
+// sum of squared errors, original is 16 pixels with numChannels
+static float UnitError(uint64_t unit, bool isColor, const unsigned char* original, int numChannels)
+{
+    unsigned char decoded[16 * 3];
+    if (isColor) DecodeBC1Unit(unit, decoded);
+    else         DecodeBC4Unit(unit, decoded);
+
+    float error = 0.0f;
+    for (int i = 0; i < 16 * numChannels; i++)
+    {
+        float diff = float(decoded[i]) - float(original[i]);
+        error += diff * diff;
+    }
+    return error;
+}
+
+// returns squared error of the chosen unit
+static float RDOUnit(uint64_t* unit, bool isColor, const unsigned char* original, RDOHistory& history)
+{
+    const int numChannels = isColor ? 3 : 1;
+    // BC4 endpoints are 2 bytes, BC1 endpoints are 4 bytes
+    const uint64_t endpointMask = isColor ? 0xFFFFFFFFull : 0xFFFFull;
+    float currentError = UnitError(*unit, isColor, original, numChannels);
+    float bestError = currentError;
+    
+    if (g_TextureRDOLambda > 0.0f)
+    {
+        float maxError = currentError + RDOMaxMSEIncrease * 16.0f * numChannels;
+        float bestCost = currentError + g_TextureRDOLambda * RDOFreshUnitBits;
+        uint64_t bestUnit = *unit;
+        bool matched = false;
+
+        for (int i = 0; i < history.count; i++)
+        {
+            uint64_t candidate = history.units[i];
+            float error = UnitError(candidate, isColor, original, numChannels);
+            float cost  = error + g_TextureRDOLambda * RDOMatchUnitBits;
+            if (error <= maxError && cost < bestCost) {
+                bestCost = cost, bestError = error, bestUnit = candidate, matched = true;
+            }
+
+            // keep our endpoints, use selectors of the candidate
+            candidate = (*unit & endpointMask) | (candidate & ~endpointMask);
+            error = UnitError(candidate, isColor, original, numChannels);
+            cost  = error + g_TextureRDOLambda * RDOSelectorMatchBits;
+            if (error <= maxError && cost < bestCost) {
+                bestCost = cost, bestError = error, bestUnit = candidate, matched = false;
+            }
+        }
+        *unit = bestUnit;
+        if (matched) return bestError; // already in history
+    }
+    
+    history.units[history.next] = *unit;
+    history.next  = (history.next + 1) % RDOWindow;
+    history.count = MIN(history.count + 1, RDOWindow);
+    return bestError;
+}
+
+static void GatherBlock(const unsigned char* src, int width, int numComp, int x, int y, int channel, int numChannels, unsigned char* out)
+{
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 4; j++)
+            for (int c = 0; c < numChannels; c++)
+                *out++ = src[((y + i) * width + x + j) * numComp + channel + c];
+}
+
+// applies rdo to BC4, BC5 or DXT5 texture and returns the psnr of the compressed texture
+// numComp: 1 = BC4, 2 = BC5, 4 = DXT5. hasAlpha is false if alpha of the DXT5 texture is not used
+static float RDOCompressedTexture(const unsigned char* src, unsigned char* compressed, int width, int height, int numComp, bool hasAlpha)
+{
+    // each channel has its own history, red units doesn't match with green units anyway
+    RDOHistory colorHistory{}, channelHistory[2]{};
+    unsigned char original[16 * 3];
+    uint64_t* unit = (uint64_t*)compressed;
+    double sumError = 0.0;
+
+    for (int y = 0; y < height; y += 4)
+    {
+        for (int x = 0; x < width; x += 4)
+        {
+            if (numComp == 4) // DXT5, alpha unit + color unit
+            {
+                GatherBlock(src, width, 4, x, y, 3, 1, original);
+                float alphaError = RDOUnit(unit++, false, original, channelHistory[0]);
+                sumError += hasAlpha ? alphaError : 0.0f;
+                GatherBlock(src, width, 4, x, y, 0, 3, original);
+                sumError += RDOUnit(unit++, true, original, colorHistory);
+                continue;
+            }
+
+            // BC4 or BC5, each channel is a BC4 unit
+            for (int c = 0; c < numComp; c++)
+            {
+                GatherBlock(src, width, numComp, x, y, c, 1, original);
+                sumError += RDOUnit(unit++, false, original, channelHistory[c]);
+            }
+        }
+    }
+
+    int numChannels = numComp == 4 ? (hasAlpha ? 4 : 3) : numComp;
+    double mse = sumError / (double(width) * double(height) * numChannels);
+    if (mse <= 0.0) return 99.0f;
+    return (float)(10.0 * log10((255.0 * 255.0) / mse));
+}
+
+// compresses the image and its mips with BC4 (numComp 1), BC5 (numComp 2) or DXT5 (numComp 4), returns number of bytes written.
+// we have to generate the mips on cpu because glGenerateMipmap doesn't work with compressed formats
+static uint64_t CompressBCnWithMips(const unsigned char* src, unsigned char* dst, int width, int height, int numComp, bool hasAlpha, int numMips, float* psnr)
+{
+    const stbir_pixel_layout numCompToLayout[5] = { STBIR_1CHANNEL, STBIR_1CHANNEL, STBIR_2CHANNEL, STBIR_RGB, STBIR_RGBA };
+    uint64_t mipBufferSize = uint64_t(MAX(width >> 1, 1)) * uint64_t(MAX(height >> 1, 1)) * numComp;
+    ScopedPtr<unsigned char> mipBuffer = new unsigned char[mipBufferSize * 2];
+    unsigned char* mipImages[2] = { mipBuffer.ptr, mipBuffer.ptr + mipBufferSize };
+    const unsigned char* image = src;
+    unsigned char* dstStart = dst;
+
+    for (int mip = 0; mip < numMips; mip++)
+    {
+        int mipWidth  = MAX(width  >> mip, 1);
+        int mipHeight = MAX(height >> mip, 1);
+        if (mip > 0)
+        {
+            int prevWidth  = MAX(width  >> (mip - 1), 1);
+            int prevHeight = MAX(height >> (mip - 1), 1);
+            // ping pong between two buffers, previous mip is the source
+            unsigned char* resized = mipImages[mip & 1];
+            if (!stbir_resize(image, prevWidth, prevHeight, prevWidth * numComp, 
+                              resized, mipWidth, mipHeight, mipWidth * numComp,
+                              numCompToLayout[numComp], STBIR_TYPE_UINT8, STBIR_EDGE_CLAMP, STBIR_FILTER_MITCHELL)) {
+                AX_WARN("stbir_resize failed while generating mip %i", mip);
+            }
+            image = resized;
+        }
+
+        if (numComp == 1)
+            CompressBC4(image, dst, mipWidth, mipHeight);
+        else if (numComp == 2)
+            CompressBC5(image, dst, mipWidth, mipHeight);
+        else
+            CompressDxt5((const uint32_t*)image, (uint64_t*)dst, (mipWidth >> 2) * (mipHeight >> 2), mipWidth);
+        
+        float mipPSNR = RDOCompressedTexture(image, dst, mipWidth, mipHeight, numComp, hasAlpha);
+        if (mip == 0) *psnr = mipPSNR;
+        
+        dst += ((mipWidth + 3) >> 2) * ((mipHeight + 3) >> 2) * (numComp == 1 ? 8 : 16);
+    }
+    return uint64_t(dst - dstStart);
+}
+
+uint64_t ASTCCompress(unsigned char* buffer, unsigned char* image, int dim_x, int dim_y, int numMips)
 {
     astcenc_profile profile = ASTCENC_PRF_LDR;
     
@@ -211,7 +649,7 @@ uint64_t ASTCCompress(unsigned char* buffer, unsigned char* image, int dim_x, in
     unsigned int blocks_y = (src->dim_y + config.block_y - 1) / config.block_y;
     unsigned int blocks_z = (src->dim_z + config.block_z - 1) / config.block_z;
     size_t bufferSize = blocks_x * blocks_y * blocks_z * 16;
-    int numMips = MAX((int)Log2((unsigned)src->dim_x) >> 1, 1) - 1;
+    numMips--; // first one is the base level
     
     unsigned char* compressBuffer = new unsigned char[(src->dim_x * src->dim_y * 4) >> 1];
     unsigned char* cb = compressBuffer;
@@ -247,7 +685,7 @@ uint64_t ASTCCompress(unsigned char* buffer, unsigned char* image, int dim_x, in
         
         src->dim_x >>= 1;
         src->dim_y >>= 1;
-        bufferSize = src->dim_x * src->dim_y;
+        bufferSize = ((src->dim_x + 3) >> 2) * ((src->dim_y + 3) >> 2) * 16;
     } while (true);
     
     
@@ -303,14 +741,18 @@ static void SaveSceneImagesGeneric(Prefab* scene, char* path, const bool isMobil
     }
     ScopedPtr<ImageInfo> imageInfos = new ImageInfo[numImages];
     ScopedPtr<uint64_t>  currentCompressions = new uint64_t[numImages];
+    ScopedPtr<float>     imagePSNR = new float[numImages]; // zero if not measured
     uint64_t beforeCompressedSize = 0;
     
     for (int i = 0; i < numImages; i++)
     {
+        imagePSNR[i] = 0.0f;
         ImageInfo info;
         info.width    = 0, info.height = 0;
         info.numComp  = 4;
         info.isNormal = isNormalMap[i];
+        info.atlasPage = -1;
+        info.atlasX = info.atlasY = 0;
 
         bool imageInvalid = images[i].path == nullptr || !FileExist(images[i].path);
         
@@ -338,28 +780,10 @@ static void SaveSceneImagesGeneric(Prefab* scene, char* path, const bool isMobil
         currentCompressions[currentInfo] = beforeCompressedSize;
         imageInfos[currentInfo++] = info;
         
-        int isBC1 = (isMobile == false) && (info.numComp == 1);
-        int imageSize = (info.width * info.height) >> isBC1;
-        
-        bool isUncompressed = info.width <= 128 && info.height <= 128;
-        if (isUncompressed)
-        {
-            imageSize = info.width * info.height * info.numComp;
-            isBC1 = false;
-        }
-
-        // we have got to include mipmap sizes if mobile
-        if (isMobile && !isUncompressed)
-        {
-            // 512->3, 1024->4, 2049->5
-            int numMips = MAX(Log2((unsigned int)info.width) >> 1u, 1u) - 1;
-            while (numMips--)
-            {
-                info.width  >>= 1;
-                info.height >>= 1;
-                imageSize += info.width * info.height;
-            }
-        }
+        // compressed images are stored with their mips
+        uint64_t imageSize = 0;
+        for (int mip = 0; mip < GetNumMips(info); mip++)
+            imageSize += GetMipDataSize(info, mip, isMobile);
     
         beforeCompressedSize += imageSize;
     }
@@ -426,34 +850,29 @@ static void SaveSceneImagesGeneric(Prefab* scene, char* path, const bool isMobil
                     textureLoadBuffer.Resize(imageSize * 4);// reallocates the empty buffer
                 }
 
-                uint64_t numBytes = ASTCCompress(currentCompression, stbImage.ptr, info.width, info.height);
+                uint64_t numBytes = ASTCCompress(currentCompression, stbImage.ptr, info.width, info.height, GetNumMips(info));
                 ASSERT(numBytes != 1);
                 currentCompression += numBytes;
                 continue;
             }
             
+            int numMips = GetNumMips(info);
+            float* psnr = imagePSNR.ptr + i;
+
             if (isNormalMap[i] || isMetallicRoughnessMap[i]) // both are rg only textures
             {
                 if (info.numComp == 3) MakeRGTextureFromRGB(stbImage.ptr, imageSize);
                 if (info.numComp == 4) MakeRGTextureFromRGBA(stbImage.ptr, imageSize);
                 imageInfos.ptr[i].numComp = 2;
 
-                CompressBC5(stbImage.ptr, textureLoadBuffer.Data(), info.width, info.height);
-                SmallMemCpy(currentCompression, textureLoadBuffer.Data(), imageSize);
-                currentCompression += imageSize; 
+                currentCompression += CompressBCnWithMips(stbImage.ptr, currentCompression, info.width, info.height, 2, false, numMips, psnr);
                 continue;
             }
             
-            uint32_t numBlocks = (info.width >> 2) * (info.height >> 2); // 4x4 blocks, divide by 4 each axis
-
-            if (info.numComp == 1)
+            if (info.numComp == 1 || info.numComp == 2)
             {
-                CompressBC4(stbImage.ptr, textureLoadBuffer.Data(), info.width, info.height);
-                imageSize >>= 1; // 0.5 byte per pixel
-            }
-            else if (info.numComp == 2)
-            {
-                CompressBC5(stbImage.ptr, textureLoadBuffer.Data(), info.width, info.height);
+                // BC4 or BC5
+                currentCompression += CompressBCnWithMips(stbImage.ptr, currentCompression, info.width, info.height, info.numComp, false, numMips, psnr);
             }
             else if (info.numComp == 3)
             {
@@ -462,15 +881,12 @@ static void SaveSceneImagesGeneric(Prefab* scene, char* path, const bool isMobil
                 stbImage.ptr = textureLoadBuffer.TakeOwnership();
                 textureLoadBuffer.Resize(imageSize * 4);// reallocates the empty buffer
                 // this is an rgba format, but use it for rgb textures as well, because there are not any better format for this I guess(quality, and compression vise)
-                CompressDxt5((const uint32_t*)stbImage.ptr, (uint64_t*)textureLoadBuffer.Data(), numBlocks, info.width);
+                currentCompression += CompressBCnWithMips(stbImage.ptr, currentCompression, info.width, info.height, 4, false, numMips, psnr);
             }
             else if (info.numComp == 4)
             {
-                CompressDxt5((const uint32_t*)stbImage.ptr, (uint64_t*)textureLoadBuffer.Data(), numBlocks, info.width);
+                currentCompression += CompressBCnWithMips(stbImage.ptr, currentCompression, info.width, info.height, 4, true, numMips, psnr);
             }
-            
-            SmallMemCpy(currentCompression, textureLoadBuffer.Data(), imageSize);
-            currentCompression += imageSize;
     	}
     };
     int numTask = numImages;
@@ -500,103 +916,592 @@ static void SaveSceneImagesGeneric(Prefab* scene, char* path, const bool isMobil
         threads[i].join();
     }
     
-    AFile file = AFileOpen(path, AOpenFlag_WriteBinary);
-    AFileWrite(&g_AXTextureVersion, sizeof(int), file);
-    AFileWrite(imageInfos.ptr, numImages * sizeof(ImageInfo), file);
+    // pack small textures into atlases, this way we have less texture binds and less gl objects
+    Array<unsigned char*> atlasPages = {};
+    Array<int> atlasPageHeights = {}; // pages are trimmed to used height, small scenes don't need full page
+    {
+        ScopedPtr<int> smallImages = new int[numImages];
+        int numSmallImages = 0;
+        for (int i = 0; i < numImages; i++)
+        {
+            ImageInfo info = imageInfos[i];
+            if (info.width > 0 && info.width <= 128 && info.height <= 128)
+                smallImages[numSmallImages++] = i;
+        }
+        
+        // sort by height, for better shelf packing
+        for (int i = 1; i < numSmallImages; i++)
+        {
+            for (int j = i; j > 0 && imageInfos[smallImages[j]].height > imageInfos[smallImages[j - 1]].height; j--)
+                Swap(smallImages[j], smallImages[j - 1]);
+        }
+        
+        int shelfX = AtlasSize, shelfY = AtlasSize, shelfHeight = 0;
+        
+        for (int s = 0; s < numSmallImages; s++)
+        {
+            int index = smallImages[s];
+            ImageInfo& info = imageInfos.ptr[index];
+            int width  = info.width  + AtlasPadding * 2;
+            int height = info.height + AtlasPadding * 2;
+            
+            if (shelfX + width > AtlasSize) {
+                shelfX = 0;
+                shelfY += shelfHeight;
+                shelfHeight = 0;
+            }
+            
+            if (shelfY + height > AtlasSize) {
+                unsigned char* page = new unsigned char[AtlasSize * AtlasSize * 4];
+                MemsetZero(page, AtlasSize * AtlasSize * 4);
+                atlasPages.Add(page);
+                atlasPageHeights.Add(0);
+                shelfX = shelfY = shelfHeight = 0;
+            }
+            
+            // copy the image with padding, padding is filled with edge pixels
+            const unsigned char* src = toCompressionBuffer + currentCompressions[index];
+            unsigned char* page = atlasPages.Back();
+            
+            for (int y = 0; y < height; y++)
+            {
+                int srcY = Clamp(y - AtlasPadding, 0, info.height - 1);
+                for (int x = 0; x < width; x++)
+                {
+                    int srcX = Clamp(x - AtlasPadding, 0, info.width - 1);
+                    const unsigned char* pixel = src + (srcY * info.width + srcX) * info.numComp;
+                    unsigned char* dst = page + ((shelfY + y) * AtlasSize + shelfX + x) * 4;
+                    // missing channels are same as sampling R8, RG8 or RGB8 texture
+                    dst[0] = pixel[0];
+                    dst[1] = info.numComp > 1 ? pixel[1] : 0;
+                    dst[2] = info.numComp > 2 ? pixel[2] : 0;
+                    dst[3] = info.numComp > 3 ? pixel[3] : 255;
+                }
+            }
+            
+            info.atlasPage = atlasPages.Size() - 1;
+            info.atlasX = (short)(shelfX + AtlasPadding);
+            info.atlasY = (short)(shelfY + AtlasPadding);
+            shelfX += width;
+            shelfHeight = MAX(shelfHeight, height);
+            atlasPageHeights.Back() = MAX(atlasPageHeights.Back(), shelfY + shelfHeight);
+        }
+    }
+    
+    int numAtlasPages = atlasPages.Size();
+    const uint64_t atlasPageSize = AtlasSize * AtlasSize * 4; // < max size
+    ScopedPtr<ImagePackEntry> entries = new ImagePackEntry[numImages + numAtlasPages];
+    uint64_t currentOffset = sizeof(int) * 2 + numImages * sizeof(ImageInfo) + (numImages + numAtlasPages) * sizeof(ImagePackEntry);
+    
+    // compress each image seperately, this way we can load textures on demand
+    // each mip is a seperate frame, each frame has its own overhead
+    size_t compressBound = ZSTD_compressBound(beforeCompressedSize + numAtlasPages * atlasPageSize) 
+                           + (numImages * MaxPackMips + numAtlasPages) * ZSTD_compressBound(0);
+    ScopedPtr<char> compressedBuffer = new char[compressBound];
+    char* currentFrame = compressedBuffer.ptr;
+    
+    // quality summary of the BCn textures
+    int numMeasured = 0, minPSNRImage = 0;
+    float sumPSNR = 0.0f, minPSNR = 99.0f;
+    uint64_t measuredBytes = 0;
+    
+    for (int i = 0; i < numImages; i++)
+    {
+        uint64_t imageStart = currentCompressions[i];
+        uint64_t imageEnd   = i + 1 < numImages ? currentCompressions[i + 1] : beforeCompressedSize;
+        uint64_t imageSize  = imageEnd - imageStart;
+        
+        MemsetZero(&entries[i], sizeof(ImagePackEntry));
+        entries[i].offset = currentOffset;
+        entries[i].decompressedSize = imageSize;
+        
+        if (imageSize == 0 || imageInfos[i].atlasPage != -1) {
+            entries[i].decompressedSize = 0;
+            continue;
+        }
+        
+        // format is defined by size and number of components
+        ImageInfo info = imageInfos[i];
+        uint64_t seed = uint64_t(info.width) | (uint64_t(info.height) << 16) | (uint64_t(info.numComp) << 32);
+        entries[i].contentHash = HashTextureData(toCompressionBuffer + imageStart, imageSize, seed);
+        
+        // each mip has its own frame, streaming reads only the mips that are missing on gpu
+        uint64_t mipStart = imageStart;
+        for (int mip = 0; mip < GetNumMips(info); mip++)
+        {
+            uint64_t mipSize = GetMipDataSize(info, mip, isMobile);
+            uint64_t frameSize = ZSTD_compress(currentFrame, compressBound, toCompressionBuffer + mipStart, mipSize, 9);
+            ASSERT(!ZSTD_isError(frameSize));
+            
+            entries[i].mipCompressedSizes[mip] = (uint32_t)frameSize;
+            entries[i].compressedSize += frameSize;
+            mipStart      += mipSize;
+            currentFrame  += frameSize;
+            compressBound -= frameSize;
+        }
+        
+        if (imagePSNR[i] > 0.0f)
+        {
+            numMeasured++;
+            sumPSNR += imagePSNR[i];
+            measuredBytes += entries[i].compressedSize;
+            if (imagePSNR[i] < minPSNR) minPSNR = imagePSNR[i], minPSNRImage = i;
+        }
+        currentOffset += entries[i].compressedSize;
+    }
     
-    uint64_t compressedSize = uint64_t(beforeCompressedSize * 0.90);
-    ScopedPtr<char> compressedBuffer = new char[compressedSize];
+    if (numMeasured > 0)
+    {
+        AX_LOG("%i textures compressed: %llu bytes, avg psnr: %.2fdB, min psnr: %.2fdB %s, rdo lambda: %.2f\n", 
+               numMeasured, (unsigned long long)measuredBytes, sumPSNR / numMeasured, minPSNR, images[minPSNRImage].path, g_TextureRDOLambda);
+    }
     
-    compressedSize = ZSTD_compress(compressedBuffer, compressedSize, toCompressionBuffer, beforeCompressedSize, 9);
-    ASSERT(!ZSTD_isError(compressedSize));
+    // atlas pages are stored after the images
+    for (int i = 0; i < numAtlasPages; i++)
+    {
+        ImagePackEntry& entry = entries[numImages + i];
+        // rows are continuous, first rows are the used part of the page
+        uint64_t pageSize = uint64_t(AtlasSize) * atlasPageHeights[i] * 4;
+        uint64_t frameSize = ZSTD_compress(currentFrame, compressBound, atlasPages[i], pageSize, 9);
+        ASSERT(!ZSTD_isError(frameSize));
+        
+        MemsetZero(&entry, sizeof(ImagePackEntry));
+        entry.mipCompressedSizes[0] = (uint32_t)frameSize;
+        entry.offset = currentOffset;
+        entry.compressedSize = frameSize;
+        entry.decompressedSize = pageSize; // height of the page is defined by size
+        entry.contentHash = HashTextureData(atlasPages[i], pageSize, AtlasSize);
+        delete[] atlasPages[i];
+        currentOffset  += frameSize;
+        currentFrame   += frameSize;
+        compressBound  -= frameSize;
+    }
     
-    uint64_t decompressedSize = beforeCompressedSize;
-    AFileWrite(&decompressedSize, sizeof(uint64_t), file);
-    AFileWrite(&compressedSize, sizeof(uint64_t), file);
-    AFileWrite(compressedBuffer, compressedSize, file);
+    AFile file = AFileOpen(path, AOpenFlag_WriteBinary);
+    AFileWrite(&g_AXTextureVersion, sizeof(int), file);
+    AFileWrite(&numAtlasPages, sizeof(int), file);
+    AFileWrite(imageInfos.ptr, numImages * sizeof(ImageInfo), file);
+    AFileWrite(entries.ptr, (numImages + numAtlasPages) * sizeof(ImagePackEntry), file);
+    AFileWrite(compressedBuffer.ptr, uint64_t(currentFrame - compressedBuffer.ptr), file);
     
     AFileClose(file);
 #endif
 }
 
-static void LoadSceneImagesGeneric(const char* texturePath, Texture* textures, int numImages)
+// atlas pages are trimmed to the used height
+static int GetAtlasPageHeight(ImagePackEntry entry)
 {
-    if (numImages == 0) {
-        return;
+    return MAX((int)(entry.decompressedSize / (AtlasSize * 4)), 1);
+}
+
+// returns decompressed frame, caller has to delete it. nullptr if fails
+static unsigned char* ReadPackFrame(AFile file, uint64_t offset, uint64_t compressedSize, uint64_t decompressedSize)
+{
+    ScopedPtr<unsigned char> compressedBuffer = new unsigned char[compressedSize];
+    AFileSeek(file, offset);
+    AFileRead(compressedBuffer.ptr, compressedSize, file);
+    
+    unsigned char* decompressedBuffer = new unsigned char[decompressedSize];
+    uint64_t result = ZSTD_decompress(decompressedBuffer, decompressedSize, compressedBuffer.ptr, compressedSize);
+    if (ZSTD_isError(result) || result != decompressedSize) {
+        AX_ERROR("texture pack decompression failed %s", ZSTD_isError(result) ? ZSTD_getErrorName(result) : "size mismatch");
+        delete[] decompressedBuffer;
+        return nullptr;
     }
-    AFile file = AFileOpen(texturePath, AOpenFlag_ReadBinary);
-    int version = 0;
-    AFileRead(&version, sizeof(int), file);
-    ASSERT(version == g_AXTextureVersion); // probably using old version, find newer version of texture or reload the gltf or fbx scene
+    return decompressedBuffer;
+}
+
+// mip frames are stored after each other, starting from the base level
+static unsigned char* ReadPackMip(TexturePack* pack, int index, int mip)
+{
+    ImagePackEntry entry = pack->entries[index];
+    uint64_t offset = entry.offset;
+    for (int i = 0; i < mip; i++)
+        offset += entry.mipCompressedSizes[i];
     
-    ScopedPtr<ImageInfo> imageInfos = new ImageInfo[numImages];
+    return ReadPackFrame(pack->file, offset, entry.mipCompressedSizes[mip], GetMipDataSize(pack->infos[index], mip, IsAndroid()));
+}
+
+// reads mips [firstMip, lastMip) from disk and uploads them, first level of the texture is textureMip
+static bool UploadPackMips(TexturePack* pack, int index, Texture texture, int textureMip, int firstMip, int lastMip)
+{
+    for (int mip = firstMip; mip < lastMip; mip++)
+    {
+        ScopedPtr<unsigned char> data = ReadPackMip(pack, index, mip);
+        if (data.ptr == nullptr)
+            return false;
+        
+        int dataSize = (int)GetMipDataSize(pack->infos[index], mip, IsAndroid());
+        rUploadTextureMip(texture, mip - textureMip, data.ptr, dataSize);
+    }
+    return true;
+}
+
+// only the mips that are smaller or equal to the firstMip are read from disk.
+// reused is true if the same texture is already loaded by another pack
+static bool LoadPackImage(TexturePack* pack, int index, int firstMip, bool* reused = nullptr)
+{
+    ImageInfo info = pack->infos[index];
+    ImagePackEntry entry = pack->entries[index];
+    if (info.width == 0 || entry.compressedSize == 0 || info.atlasPage != -1)
+        return false;
     
-    for (int i = 0; i < numImages; i++)
+    bool shared = AcquireSharedTexture(entry.contentHash, &pack->textures[index]);
+    if (reused) *reused = shared;
+    if (shared) {
+        pack->numLoaded++;
+        return true;
+    }
+    
+    TextureType textureType = TextureType_CompressedR + info.numComp-1;
+    TexFlags flags = TexFlags_Compressed;
+    
+    bool notCompressed = info.width <= 128 && info.height <= 128;
+    if (notCompressed)
     {
-        AFileRead(&imageInfos.ptr[i], sizeof(ImageInfo), file);
+        flags = TexFlags_RawData;
+        switch (info.numComp)
+        {
+            case 1: textureType = TextureType_R8;    break;
+            case 2: textureType = TextureType_RG8;   break;
+            case 3: textureType = TextureType_RGB8;  break;
+            case 4: textureType = TextureType_RGBA8; break;
+            default: 
+                textureType = TextureType_R8; 
+                AX_WARN("texture numComp is undefined, %i", info.numComp);
+                break;
+        } 
     }
     
-    uint64_t decompressedSize, compressedSize;
-    AFileRead(&decompressedSize, sizeof(uint64_t), file);
-    AFileRead(&compressedSize, sizeof(uint64_t), file);
+    int numMips = GetNumMips(info);
+    firstMip = MIN(firstMip, numMips - 1);
+    Texture texture = rCreateMipmappedTexture(MAX(info.width >> firstMip, 1), MAX(info.height >> firstMip, 1), numMips - firstMip, textureType, flags);
     
-    ScopedPtr<unsigned char> compressedBuffer = new unsigned char[compressedSize];
-    AFileRead(compressedBuffer.ptr, compressedSize, file);
+    if (!UploadPackMips(pack, index, texture, firstMip, firstMip, numMips)) {
+        rDeleteTexture(texture);
+        return false;
+    }
     
-    ScopedPtr<unsigned char> decompressedBuffer = new unsigned char[decompressedSize];
-    decompressedSize = ZSTD_decompress(decompressedBuffer.ptr, decompressedSize, compressedBuffer, compressedSize);
-    ASSERT(!ZSTD_isError(decompressedSize));
+    pack->textures[index] = texture;
+    pack->numLoaded++;
+    RegisterSharedTexture(entry.contentHash, texture);
+    return true;
+}
+
+// size of the image in gpu memory including mips after firstMip
+static uint64_t GetImageMemorySize(ImageInfo info, int firstMip)
+{
+    if (info.width == 0) return 0;
+    uint64_t size = 0;
     
-    unsigned char* currentImage = decompressedBuffer.ptr;
+    for (int mip = firstMip; mip < GetNumMips(info); mip++)
+    {
+        size += GetMipDataSize(info, mip, IsAndroid());
+    }
+    return size;
+}
+
+// loads the image starting from the mip, if the image is already on gpu only the missing mips are read from disk
+static void LoadPackImageMip(TexturePack* pack, int index, int mip)
+{
+    ImageResidency& residency = pack->residency[index];
+    Texture& texture = pack->textures[index];
+    ImageInfo info = pack->infos[index];
     
-    for (int i = 0; i < numImages; i++)
+    int numMips = GetNumMips(info);
+    mip = MIN(mip, numMips - 1);
+    residency.lastUsedFrame = g_StreamingFrame;
+
+    if (!IsTextureLoaded(texture))
     {
-        ImageInfo info = imageInfos.ptr[i];
-        if (info.width == 0)
-            continue;
+        bool reused = false;
+        if (!LoadPackImage(pack, index, mip, &reused))
+            return;
         
-        int imageSize = info.width * info.height;
-        bool isBC4 = info.numComp == 1 && (IsAndroid() == false);
-        
-        TextureType textureType = TextureType_CompressedR + info.numComp-1;
-        imageSize >>= (int)isBC4; // BC4 is 0.5 byte per pixel
-        
-        TexFlags flags = TexFlags_Compressed | TexFlags_MipMap;
-        bool notCompressed = info.width <= 128 && info.height <= 128;
-        if (notCompressed)
+        // other pack might have dropped the mips of this texture, we don't own it
+        residency.residentMip = (uint8_t)Log2((unsigned)MAX(info.width / MAX(texture.width, 1), 1));
+        if (!reused) 
+            g_TextureMemoryUsage += GetImageMemorySize(info, residency.residentMip);
+        return;
+    }
+    
+    int residentMip = residency.residentMip;
+    if (mip >= residentMip)
+        return;
+    
+    // bigger texture, the mips that we already have are copied on gpu
+    Texture streamed = rCreateMipmappedTexture(MAX(info.width >> mip, 1), MAX(info.height >> mip, 1), numMips - mip, texture.type, TexFlags_Compressed);
+    if (!UploadPackMips(pack, index, streamed, mip, mip, residentMip)) {
+        rDeleteTexture(streamed);
+        return;
+    }
+    rCopyTextureMips(streamed, residentMip - mip, texture, 0, numMips - residentMip);
+    
+    UpdateSharedTexture(texture.handle, streamed);
+    rDeleteTexture(texture);
+    texture = streamed;
+    
+    g_TextureMemoryUsage -= GetImageMemorySize(info, residentMip);
+    g_TextureMemoryUsage += GetImageMemorySize(info, mip);
+    residency.residentMip = (uint8_t)mip;
+}
+
+// drops highest resolution mip of the texture, returns false if not possible
+static bool DropPackImageMip(TexturePack* pack, int index)
+{
+    ImageInfo info = pack->infos[index];
+    ImageResidency& residency = pack->residency[index];
+    int nextMip = residency.residentMip + 1;
+    
+    if (!IsTextureLoaded(pack->textures[index]) || nextMip >= GetNumMips(info) || (info.width >> nextMip) < MinStreamingSize)
+        return false;
+    
+    // other packs are using the same texture, we can't recreate it
+    unsigned int oldHandle = pack->textures[index].handle;
+    if (IsTextureShared(oldHandle) || !rTrimTextureMips(&pack->textures[index], 1))
+        return false;
+    
+    UpdateSharedTexture(oldHandle, pack->textures[index]);    
+    g_TextureMemoryUsage -= GetImageMemorySize(info, residency.residentMip);
+    g_TextureMemoryUsage += GetImageMemorySize(info, nextMip);
+    residency.residentMip = (uint8_t)nextMip;
+    return true;
+}
+
+void RequestTextureScreenSize(TexturePack* pack, int index, float screenSize)
+{
+    if (pack == nullptr || index >= pack->numImages) return;
+    ImageInfo info = pack->infos[index];
+    // texels per pixel, assuming uv's are covering the primitive once
+    float texelDensity = (float)info.width / MAX(screenSize, 1.0f);
+    int mip = texelDensity > 1.0f ? (int)Log2((unsigned)texelDensity) : 0;
+    mip = MIN(mip, GetNumMips(info) - 1);
+    
+    ImageResidency& residency = pack->residency[index];
+    residency.requiredMip = (uint8_t)MIN(mip, (int)residency.requiredMip);
+}
+
+void SetTextureMemoryBudget(uint64_t numBytes)
+{
+    g_TextureBudget = numBytes;
+}
+
+uint64_t GetTextureMemoryUsage()
+{
+    return g_TextureMemoryUsage;
+}
+
+// streams in the mips that are requested last frame and evicts least recently used mips if we are over budget
+static void UpdateTextureStreaming()
+{
+    g_StreamingFrame++;
+    
+    for (int p = 0; p < g_TexturePacks.Size(); p++)
+    {
+        TexturePack* pack = g_TexturePacks[p];
+        for (int i = 0; i < pack->numImages; i++)
         {
-            imageSize = info.width * info.height * info.numComp;
-            flags = TexFlags_RawData;
-            isBC4 = false;
-            switch (info.numComp)
+            ImageResidency& residency = pack->residency[i];
+            int requiredMip = residency.requiredMip;
+            residency.requiredMip = NotRequested;
+            
+            if (requiredMip == NotRequested || !IsTextureLoaded(pack->textures[i]))
+                continue;
+            
+            residency.lastUsedFrame = g_StreamingFrame;
+            
+            bool canStream = !IsTextureShared(pack->textures[i].handle);
+            if (canStream && requiredMip < residency.residentMip && g_NumTextureLoadsThisFrame < MaxTextureLoadsPerFrame)
             {
-                case 1: textureType = TextureType_R8;    break;
-                case 2: textureType = TextureType_RG8;   break;
-                case 3: textureType = TextureType_RGB8;  break;
-                case 4: textureType = TextureType_RGBA8; break;
-                default: 
-                    textureType = TextureType_R8; 
-                    AX_WARN("texture numComp is undefined, %i", info.numComp);
-                    break;
-            } 
+                g_NumTextureLoadsThisFrame++;
+                LoadPackImageMip(pack, i, requiredMip);
+            }
         }
-        Texture imported = rCreateTexture(info.width, info.height, currentImage, textureType, flags);
-        textures[i] = imported;
-        currentImage += imageSize;
+    }
+    
+    while (g_TextureMemoryUsage > g_TextureBudget)
+    {
+        // find least recently used texture that has mips to drop
+        TexturePack* lruPack = nullptr;
+        int lruIndex = -1;
+        uint32_t lruFrame = UINT32_MAX;
         
-        if (IsAndroid() && !notCompressed)
+        for (int p = 0; p < g_TexturePacks.Size(); p++)
         {
-            int mip = MAX((int)Log2((unsigned int)info.width) >> 1, 1) - 1;
-            while (mip-- > 0)
+            TexturePack* pack = g_TexturePacks[p];
+            for (int i = 0; i < pack->numImages; i++)
             {
-                info.width >>= 1;
-                info.height >>= 1;
-                currentImage += info.width * info.height;
+                ImageInfo info = pack->infos[i];
+                ImageResidency residency = pack->residency[i];
+                int nextMip = residency.residentMip + 1;
+                
+                bool canDrop = IsTextureLoaded(pack->textures[i]) && nextMip < GetNumMips(info) && (info.width >> nextMip) >= MinStreamingSize
+                               && !IsTextureShared(pack->textures[i].handle);
+                if (canDrop && residency.lastUsedFrame < lruFrame) {
+                    lruFrame = residency.lastUsedFrame;
+                    lruPack  = pack;
+                    lruIndex = i;
+                }
             }
         }
+        
+        if (lruPack == nullptr || !DropPackImageMip(lruPack, lruIndex))
+            break; // nothing left to evict
+    }
+}
+
+TexturePack* OpenTexturePack(const char* texturePath, Texture* textures, int numImages)
+{
+    if (numImages == 0) {
+        return nullptr;
     }
     
-    AFileClose(file);
+    if (g_TexturePlaceholder.handle == 0)
+    {
+        unsigned char grey[4] = { 128, 128, 128, 255 };
+        g_TexturePlaceholder = rCreateTexture(1, 1, grey, TextureType_RGBA8, TexFlags_RawData);
+    }
+
+    AFile file = AFileOpen(texturePath, AOpenFlag_ReadBinary);
+    ASSERTR(AFileExist(file), return nullptr);
+    
+    int version = 0;
+    AFileRead(&version, sizeof(int), file);
+    if (version != g_AXTextureVersion)
+    {
+        // probably using old version, find newer version of texture or reload the gltf or fbx scene
+        AX_ERROR("texture pack version mismatch %s, version: %i expected: %i", texturePath, version, g_AXTextureVersion);
+        AFileClose(file);
+        return nullptr;
+    }
+    
+    int numAtlasPages = 0;
+    AFileRead(&numAtlasPages, sizeof(int), file);
+    
+    TexturePack* pack = new TexturePack();
+    pack->file      = file;
+    pack->numImages = numImages;
+    pack->numLoaded = 0;
+    pack->infos     = new ImageInfo[numImages];
+    pack->entries   = new ImagePackEntry[numImages + numAtlasPages];
+    pack->residency = new ImageResidency[numImages];
+    pack->textures  = textures;
+    pack->numAtlasPages = numAtlasPages;
+    pack->atlasPages    = numAtlasPages > 0 ? new Texture[numAtlasPages]{} : nullptr;
+    
+    AFileRead(pack->infos, sizeof(ImageInfo) * numImages, file);
+    AFileRead(pack->entries, sizeof(ImagePackEntry) * (numImages + numAtlasPages), file);
+    
+    // atlases are small and shared between many materials, no need to load them lazily
+    for (int i = 0; i < numAtlasPages; i++)
+    {
+        ImagePackEntry entry = pack->entries[numImages + i];
+        if (AcquireSharedTexture(entry.contentHash, &pack->atlasPages[i]))
+            continue;
+
+        ScopedPtr<unsigned char> atlas = ReadPackFrame(file, entry.offset, entry.compressedSize, entry.decompressedSize);
+        if (atlas.ptr == nullptr) {
+            pack->atlasPages[i] = g_TexturePlaceholder;
+            continue;
+        }
+        pack->atlasPages[i] = rCreateTexture(AtlasSize, GetAtlasPageHeight(entry), atlas.ptr, TextureType_RGBA8, TexFlags_RawData);
+        pack->atlasPages[i].buffer = nullptr;
+        RegisterSharedTexture(entry.contentHash, pack->atlasPages[i]);
+    }
+    
+    for (int i = 0; i < numImages; i++)
+    {
+        ImageInfo info = pack->infos[i];
+        // width is zero if the image is missing, renderer checks the width to use default texture.
+        textures[i] = info.atlasPage != -1 ? pack->atlasPages[info.atlasPage] : g_TexturePlaceholder;
+        textures[i].width  = info.width;
+        textures[i].height = info.height;
+        pack->residency[i] = { 0, NotRequested, 0 };
+    }
+    g_TexturePacks.Add(pack);
+    return pack;
+}
+
+bool IsTextureLoaded(const Texture& texture)
+{
+    return texture.handle != g_TexturePlaceholder.handle;
+}
+
+bool GetPackTextureAtlasRect(TexturePack* pack, int index, float* rect)
+{
+    if (pack == nullptr || index >= pack->numImages || pack->infos[index].atlasPage == -1)
+        return false;
+    
+    ImageInfo info = pack->infos[index];
+    const float invAtlasSize = 1.0f / (float)AtlasSize;
+    const float invPageHeight = 1.0f / (float)GetAtlasPageHeight(pack->entries[pack->numImages + info.atlasPage]);
+    rect[0] = info.width  * invAtlasSize;
+    rect[1] = info.height * invPageHeight;
+    rect[2] = info.atlasX * invAtlasSize;
+    rect[3] = info.atlasY * invPageHeight;
+    return true;
+}
+
+Texture RequestPackTexture(TexturePack* pack, int index)
+{
+    if (pack == nullptr) // pack couldn't be opened
+        return g_TexturePlaceholder;
+
+    Texture texture = pack->textures[index];
+    if (IsTextureLoaded(texture) || texture.width == 0 || g_NumTextureLoadsThisFrame >= MaxTextureLoadsPerFrame)
+        return texture;
+    
+    g_NumTextureLoadsThisFrame++;
+    int requiredMip = pack->residency[index].requiredMip;
+    LoadPackImageMip(pack, index, requiredMip == NotRequested ? 0 : requiredMip);
+
+    // missing or corrupted image, mark as failed so we don't try to load it every frame.
+    // width zero means missing image, renderer uses the default texture
+    if (!IsTextureLoaded(pack->textures[index]))
+        pack->textures[index].width = 0;
+    return pack->textures[index];
+}
+
+void BeginTextureStreamingFrame()
+{
+    g_NumTextureLoadsThisFrame = 0;
+    UpdateTextureStreaming();
+}
+
+void CloseTexturePack(TexturePack* pack)
+{
+    if (pack == nullptr) 
+        return;
+    
+    for (int i = 0; i < pack->numAtlasPages; i++)
+    {
+        if (IsTextureLoaded(pack->atlasPages[i]))
+            ReleaseTexture(pack->atlasPages[i]);
+    }
+    
+    for (int i = 0; i < pack->numImages; i++)
+    {
+        if (pack->infos[i].atlasPage != -1)
+            continue; // deleted above
+        
+        if (IsTextureLoaded(pack->textures[i]) && ReleaseTexture(pack->textures[i]))
+            g_TextureMemoryUsage -= GetImageMemorySize(pack->infos[i], pack->residency[i].residentMip);
+    }
+    
+    for (int i = 0; i < g_TexturePacks.Size(); i++)
+    {
+        if (g_TexturePacks[i] == pack) {
+            g_TexturePacks.RemoveUnordered(i);
+            break;
+        }
+    }
+    
+    AFileClose(pack->file);
+    delete[] pack->infos;
+    delete[] pack->entries;
+    delete[] pack->residency;
+    delete[] pack->atlasPages;
+    delete pack;
 }
 
 static void SaveAndroidCompressedImagesFn(Prefab* scene, char* astcPath, AImage* images, int numImages)
@@ -644,13 +1549,41 @@ void CompressSaveSceneImages(Prefab* scene, char* path)
 #endif
 }
 
-void LoadSceneImages(char* path, Texture* textures, int numImages)
+static void ChangeToPlatformTextureExtension(char* path)
 {
-    if (numImages == 0) { textures = nullptr; return; }
 #ifdef __ANDROID__
     ChangeExtension(path, StringLength(path), "astc");
 #else
     ChangeExtension(path, StringLength(path), "dxt");
 #endif
-    LoadSceneImagesGeneric(path, textures, numImages);
+}
+
+TexturePack* OpenSceneImages(char* path, Texture* textures, int numImages)
+{
+    if (numImages == 0) { return nullptr; }
+    ChangeToPlatformTextureExtension(path);
+    return OpenTexturePack(path, textures, numImages);
+}
+
+void LoadSceneImages(char* path, Texture* textures, int numImages)
+{
+    if (numImages == 0) { textures = nullptr; return; }
+    ChangeToPlatformTextureExtension(path);
+    TexturePack* pack = OpenTexturePack(path, textures, numImages);
+    if (pack == nullptr)
+        return;
+    
+    // load all of the images immediately, ownership of the textures belongs to caller
+    for (int i = 0; i < numImages; i++)
+    {
+        LoadPackImage(pack, i, 0);
+    }
+    
+    g_TexturePacks.RemoveUnordered(g_TexturePacks.Size() - 1); // not streamed
+    AFileClose(pack->file);
+    delete[] pack->infos;
+    delete[] pack->entries;
+    delete[] pack->residency;
+    delete[] pack->atlasPages; // atlas textures are owned by the caller as well
+    delete pack;
 }
\ No newline at end of file
@@ -5,14 +5,30 @@
 #include "../../ASTL/Math/Matrix.hpp"
 
 struct Prefab;
+struct ASkinedVertex;
 
-struct Pose
+constexpr int MaxBonePoses = 128; // make 192 or 256 if we use more joints
+constexpr int NumAnimLODs  = 4;
+
+// SoA, every component of the joints has its own stream, this way we can blend 4 joints at once with SIMD
+// streams are padded to multiple of 4, padding joints are identity
+struct alignas(16) Pose
 {
-    Vector4x32f translation;
-    Vector4x32f rotation;
-    // Vector4x32f scale;
+    float tx[MaxBonePoses], ty[MaxBonePoses], tz[MaxBonePoses]; // translation
+    float rx[MaxBonePoses], ry[MaxBonePoses], rz[MaxBonePoses], rw[MaxBonePoses]; // rotation
+    // scale is not animated, we are using the scale of the nodes
 };
 
+// cooked animation clips. AAnimSampler::output of the samplers are compressed in the ABM files:
+//   rotations (numComponent 4) : ushort[count][3], smallest three, index of the largest component is in sign bits of first two shorts
+//   translation and scale      : float min[3], float extent[3], ushort[count][3] normalized between min and min+extent
+// keyframes that can be interpolated from neighbors are removed, so sampler input times are not uniform.
+inline int GetCookedSamplerSize(int count, int numComponent)
+{
+    int keysSize = (count * 3 * sizeof(ushort) + 3) & ~3; // 4 byte aligned so next sampler's floats are aligned
+    return numComponent == 4 ? keysSize : keysSize + sizeof(float) * 6;
+}
+
 struct Matrix3x4f16
 {
     half x[4];
@@ -49,11 +65,20 @@ typedef int eAnimLocation;
 typedef int eAnimState;
 typedef int eAnimControllerState;
 
-constexpr int MaxBonePoses = 128; // make 192 or 256 if we use more joints
+constexpr int   MaxBlendClips      = 8;
+constexpr float BlendWeightEpsilon = 0.001f; // clips with smaller weights are not sampled
+
+// one input of the blend tree
+struct BlendClip
+{
+    int animIdx;
+    float normTime;
+    float weight; // doesn't have to be normalized
+};
 
 struct AnimationController
 {
-    Texture mMatrixTex;
+    int mPaletteRow; // < row of this controller in the shared bone palette texture
     Prefab* mPrefab;
     eAnimState mState;
 
@@ -70,10 +95,7 @@ struct AnimationController
     int mLastAnim;
     eAnimTriggerOpt mTriggerOpt;
 
-    ANode* mSpineNode; // < upper body root bone 
-    ANode* mNeckNode;
-
-    int mSpineNodeIdx;
+    int mSpineNodeIdx; // < upper body root bone
     int mNeckNodeIdx;
 
     // lower body bones are starting from 60th with Brute character and 58 with mixamo Paladin Character
@@ -91,15 +113,39 @@ struct AnimationController
     float mSpineXAngle; // < will rotate around this axis (normalized) default vec3::up
     float mNeckXAngle;  // < will rotate around this axis (normalized) default vec3::up
 
+    // animation LOD, selected from screen size of the character. see: SetLODFromScreenSize
+    // LOD 1 updates every other frame and interpolates, further LODs update less frequently and reuse the previous palette
+    int   mLodLevel;
+    int   mLodFrame;       // frames since last evaluation
+    float mLodDeltaTime;   // accumulated delta time since last evaluation
+    bool  mLodHasPrevPose; // LOD 1 needs two poses to interpolate
+    // written by the renderer while the simulation thread is running, applied with SetLODFromScreenSize between the simulation steps.
+    // negative until character is rendered once
+    float mLodScreenSize;
+    // joints deeper than this are not sampled when LOD > 0, (fingers, toes, head end)
+    // calculated from the deepest joint in CreateAnimationController, can be changed for each character
+    int   mLodCullDepth;
+    unsigned char mNodeDepths[MaxBonePoses]; // depth in skeleton hierarchy
+
+    // last keyframe index of each channel, so forward playback doesn't have to search keyframes from the beginning
+    // mKeyCursors[mKeyCursorOffsets[animIdx] + channelIdx]
+    int* mKeyCursorOffsets;
+    int* mKeyCursors;
+
     // two posses for blending
-    Pose mAnimPoseA[MaxBonePoses]; // < the result bone array that we send to GPU
-    Pose mAnimPoseB[MaxBonePoses]; // < blend target
+    Pose mAnimPoseA; // < the result bone array that we send to GPU
+    Pose mAnimPoseB; // < blend target
     
-    Pose mAnimPoseC[MaxBonePoses]; // < Trigerred animations result
-    Pose mAnimPoseD[MaxBonePoses]; // < Trigerred Animations blend target
+    Pose mAnimPoseC; // < Trigerred animations result
+    Pose mAnimPoseD; // < Trigerred Animations blend target
+
+    Pose mBindPose; // < local transforms of the nodes, non animated joints are using this
+    Pose mOutPose;  // < final pose, upper and lower body merged and spine, neck rotations added
+
+    Pose mLodPrevPose; // < LOD 1 interpolates between these two
+    Pose mLodNextPose;
 
     Matrix4 mBoneMatrices[MaxBonePoses];
-    Matrix3x4f16 mOutMatrices[MaxBonePoses];
 
     // animation indexes to blend coordinates
     // Given xy blend coordinates, we will blend animations.
@@ -114,7 +160,7 @@ struct AnimationController
     void SetAnim(int x, int y, int index)
     {
         if (y >= 0) mLocomotionIndices[y][x] = index;
-        else        mLocomotionIndicesInv[Abs(y-1)][x] = index;
+        else        mLocomotionIndicesInv[Abs(y)-1][x] = index;
     }
 
     int GetAnim(int x, int y)
@@ -134,6 +180,10 @@ struct AnimationController
     // runs the walking running etc animations from given inputs
     void EvaluateLocomotion(float x, float y, float animSpeed);
 
+    // screenSize is the size of the character on screen in pixels, SceneRenderer calls this when rendering the character.
+    // selected LOD is used with next EvaluateLocomotion call
+    void SetLODFromScreenSize(float screenSize);
+
     bool TriggerTransition(float dt, int targetAnim);
 
     // play the given animation, norm is the animation progress between 0.0 and 1.0
@@ -145,21 +195,132 @@ struct AnimationController
     bool TriggerAnim(int animIndex, float triggerInTime, float triggerOutTime, eAnimTriggerOpt triggerOpt);
 
     // after this line all of the functions are private but feel free to use
-    // upload to gpu. internal usage only for now
+    // writes the pose to bone palette, UploadBonePalettes sends it to gpu
     void UploadPose(Pose* nodeMatrices);
     
-    void RecurseBoneMatrices(ANode* node, Matrix4 parentMatrix);
+    // calculates model space matrices of the skeleton nodes, parents first with prefab's skeleton hierarchy
+    void ComputeBoneMatrices(Pose* pose);
 
     void UploadBoneMatrices();
+
+    // converts mBoneMatrices to skinning matrices, half precision. outMatrices must have space for skin.numJoints
+    void WriteBonePalette(Matrix3x4f16* outMatrices);
     
     // when we want to play different animations with lower body and upper body
     void UploadPoseUpperLower(Pose* lowerPose, Pose* uperPose);
 
+    // computes and uploads matrices of mOutPose, with LOD 1 it is interpolated with previous pose
+    void UploadOutPose();
+
+    void UploadInterpolatedPose(float t);
+
+    // inverse bind * bone matrix * transform for each joint of the skin, outMatrices size must be skin.numJoints
+    void ComputeSkinMatrices(Matrix4* outMatrices, const Matrix4& transform);
+
+    // EvaluateLocomotion without LOD, deltaTime is the time since last evaluation
+    void EvaluateLocomotionStep(float x, float y, float animSpeed, float deltaTime);
+
     // use negative normTime to sample animation reversely
     void SampleAnimationPose(Pose* pose, int animIdx, float normTime);
+
+    // samples all of the clips and blends them with their weights in one pass, clips with weight < BlendWeightEpsilon are skipped
+    void SampleBlendTree(Pose* pose, const BlendClip* clips, int numClips);
+
+    // fills the blend tree inputs from the locomotion grid, returns number of clips, at most MaxBlendClips
+    int ComputeLocomotionWeights(float x, float y, BlendClip* clips);
 };
 
 // no constructors and deconstructors hehe
 void CreateAnimationController(Prefab* prefab, AnimationController* animController, bool humanoid = true, int lowerBodyStart = 58);
 
 void ClearAnimationController(AnimationController* animController);
+
+constexpr int MaxAnimatedInstances = 256; // number of rows in bone palette texture
+
+struct LocomotionInput
+{
+    float x, y; // same as EvaluateLocomotion
+    float animSpeed;
+};
+
+// evaluates locomotion of many characters on worker threads, inputs[i] is used for controllers[i]
+// poses are written to bone palettes, call UploadBonePalettes after updating all of the characters
+void EvaluateLocomotionBatch(AnimationController** controllers, const LocomotionInput* inputs, int count);
+
+// uploads bone palettes of all controllers that changed this frame, with one texture update
+// call once per frame, after animations are updated and before rendering
+void UploadBonePalettes();
+
+// bone matrices of all animated characters, each controller has its own row: mPaletteRow
+Texture GetBonePaletteTexture();
+
+// sampled poses are shared between controllers playing same clip at same time,
+// call this when prefabs are destroyed
+void ClearPoseCache();
+
+/*//////////////////////////////////////////////////////////////////////////*/
+/*                              CPU Skinning                                */
+/*//////////////////////////////////////////////////////////////////////////*/
+
+// one primitive to skin on cpu, outNormals can be null
+struct SkinningJob
+{
+    const ASkinedVertex* vertices;
+    int numVertices;
+    Vector3f* outPositions;
+    Vector3f* outNormals;
+};
+
+// skins vertices with the matrices created with ComputeSkinMatrices
+// usefull for raycasting against animated characters, decals, cloth attachments etc.
+void SkinVertices(const Matrix4* skinMatrices, const ASkinedVertex* vertices, int count, Vector3f* outPositions, Vector3f* outNormals);
+
+// skins only the given primitives with worker threads, using current pose of the controller.
+// use world matrix of the mesh node as transform to get world space vertices
+void SkinPrimitives(AnimationController* controller, const Matrix4& transform, const SkinningJob* jobs, int numJobs);
+
+/*//////////////////////////////////////////////////////////////////////////*/
+/*                           Baked Animations                               */
+/*//////////////////////////////////////////////////////////////////////////*/
+
+constexpr float BakedAnimSampleRate = 30.0f;
+constexpr int   MaxBakedRows        = 2048; // GLES 3.0 only guarantees 2048 texture size, longer bakes are wrapped into columns
+
+struct BakedClip
+{
+    int firstFrame; // frame index in baked texture, see: BakedAnimations
+    int numFrames;
+    int animation;  // index of the animation in prefab
+};
+
+// bone palettes of the selected clips sampled with fixed rate, stored in ABM files.
+// for background characters that are only looping clips, they don't need AnimationController,
+// shader interpolates the frames from clip index and time. see: SceneRenderer::RenderBakedAnimations
+// frames are wrapped into columns of MaxBakedRows, column width is numJoints * 3:
+// frame f is at x = (f / MaxBakedRows) * numJoints * 3, y = f % MaxBakedRows
+struct BakedAnimations
+{
+    int numClips;
+    int numJoints;
+    int totalFrames;
+    BakedClip* clips;
+    Matrix3x4f16* palettes; // [totalFrames][numJoints] cpu copy, deleted after uploading to gpu
+    Texture texture;
+};
+
+// one character of the crowd, clip is index in BakedAnimations::clips, clip loops and time is in seconds
+struct BakedAnimInstance
+{
+    Matrix4 transform;
+    int clip;
+    float time;
+};
+
+// samples the given clips of the prefab, skeleton hierarchy of the prefab must be created.
+// clipIndices are animation indices of the prefab
+void BakeAnimations(Prefab* prefab, BakedAnimations* result, const int* clipIndices, int numClips);
+
+// creates the texture and deletes cpu palettes
+void UploadBakedAnimations(BakedAnimations* bake);
+
+void FreeBakedAnimations(BakedAnimations* bake);
@@ -16,9 +16,11 @@
 
 int LoadFBX(const char* path, SceneBundle* fbxScene, float scale);
 
-int SaveGLTFBinary(SceneBundle* gltf, const char* path);
+// bake is optional, baked animations of skinned prefabs, see: BakeAnimations
+int SaveGLTFBinary(SceneBundle* gltf, const char* path, const struct BakedAnimations* bake = nullptr);
 
-int LoadSceneBundleBinary(const char* path, SceneBundle* gltf);
+// if bakeOut is not null and file has baked animations, fills it. palettes are in cpu, use UploadBakedAnimations
+int LoadSceneBundleBinary(const char* path, SceneBundle* gltf, struct BakedAnimations* bakeOut = nullptr);
 
 void CreateVerticesIndices(SceneBundle* gltf);
 
@@ -33,4 +35,44 @@ bool IsTextureLastVersion(const char* path);
 
 void CompressSaveSceneImages(struct Prefab* scene, char* path);
 
+// rate distortion optimization for BCn textures, higher lambda gives smaller files with lower quality.
+// zero disables it, used when the scene textures are cooked. average and min psnr is logged while saving.
+void SetTextureRDOLambda(float lambda);
+
+float GetTextureRDOLambda();
+
+// loads all of the images immediately
 void LoadSceneImages(char* path, struct Texture* textures, int numImages);
+
+// reads only the offset table, textures are placeholders until RequestPackTexture is called
+struct TexturePack* OpenSceneImages(char* path, struct Texture* textures, int numImages);
+
+// uploads the texture to gpu if it isn't loaded yet, returns placeholder if frame budget exceeded
+struct Texture RequestPackTexture(struct TexturePack* pack, int index);
+
+bool IsTextureLoaded(const struct Texture& texture);
+
+// small textures are packed into atlases, rect is xy = scale, zw = offset of uv. returns false if not in an atlas
+bool GetPackTextureAtlasRect(struct TexturePack* pack, int index, float* rect);
+
+// resets texture load budget and streams requested mips in or out, call once per frame
+void BeginTextureStreamingFrame();
+
+// required mip is calculated from screen space size(in pixels) of the primitive that uses the texture
+// highest resolution mip is used if requested multiple times in a frame
+void RequestTextureScreenSize(struct TexturePack* pack, int index, float screenSize);
+
+// least recently used mips are evicted when textures exceed the budget
+void SetTextureMemoryBudget(uint64_t numBytes);
+
+uint64_t GetTextureMemoryUsage();
+
+// deletes loaded textures and closes the file
+void CloseTexturePack(struct TexturePack* pack);
+
+// imports the texture or returns the already loaded one if the file content is same. release with ReleaseTexture
+struct Texture ImportSharedTexture(const char* path, int flags = 0);
+
+// decreases the reference count of shared texture, deletes the texture if it is not used anymore.
+// returns true if texture is deleted
+bool ReleaseTexture(const struct Texture& texture);
@@ -51,6 +51,14 @@ struct CharacterController
     int mKickHuhSound;
     int mSwordSlashSound;
     float mSwordSlashDelay;
+    // set by the simulation thread, SyncWithRenderer plays the sounds
+    bool mPlayKickHuh;
+    bool mPlaySwordSlash;
+
+    // android buttons, written by UpdateButtons on the main thread and consumed by the next simulation step
+    bool mAttackPressed;
+    bool mKickPressed;
+    bool mImpactPressed;
 
     float mIdleTime;
     float mIdleLimit;
@@ -64,13 +72,33 @@ struct CharacterController
     bool mWasPressing;
     bool mControlling;
 
+    // camera is updated by the render thread, it is copied here before each simulation step
+    float mCameraYaw;
+    float mCameraPitch;
+
+    // skinned primitives are skinned on cpu after each simulation step, bind pose bounds are too small
+    // for the attacks and kicks, culling was hiding the character when only the sword was in the view
+    Array<SkinningJob> mSkinJobs;
+    Array<int>         mSkinBoundIndices; // index in mCharacter->worldBounds of each job
+    Array<Vector3f>    mSkinnedPositions; // output of all jobs
+    Array<Vector3f>    mSkinnedBounds;    // min and max of each job in mesh space
+    bool               mHasSkinnedBounds;
+
 //------------------------------------------------------------------------
     void Start(Prefab* _character);
 
+    // runs on the simulation thread, only writes to the controller and the bone palette of the character
     void Update(float deltaTime, bool isSponza);
+
+    // call when simulation thread is not running: copies the last simulated state to the prefab and renderer,
+    // and captures the camera for the next Update
+    void SyncWithRenderer();
     
     void RespondInput();
 
+    // draws and hit tests the android buttons, main thread
+    void UpdateButtons();
+
     void ColissionDetection(Vector3f oldPos);
     
     void TurningState();
@@ -83,5 +111,11 @@ struct CharacterController
 
     void HandleNeckAndSpineRotation(float deltaTime);
 
+    // runs on the simulation thread, skins the primitives with the current pose and writes their bounds
+    void UpdateSkinnedBounds();
+
+    // applies mSkinnedBounds to mCharacter->worldBounds, main thread
+    void ApplySkinnedBounds();
+
     void Destroy();
 };
\ No newline at end of file
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <atomic>
+
+// persistent worker threads, created once at startup. creating os threads every frame costs more than the work
+// that we want to split, so all of the per frame parallel work (occlusion, draw gathering, simulation) runs here.
+
+typedef void(*JobFn)(void* data);
+
+// task is the index of the range in [0, numTasks), begin and end are the element indices
+typedef void(*JobRangeFn)(void* data, int task, int begin, int end);
+
+struct JobCounter
+{
+    std::atomic<int> numJobs{0};
+};
+
+// creates worker threads, number of workers is number of cpu cores - 1.
+// jobs are executed on the calling thread if this is not called
+void InitJobSystem();
+
+// waits for the remaining jobs and destroys the workers
+void DestroyJobSystem();
+
+// worker threads + calling thread
+int GetNumJobThreads();
+
+// splits [0, count) into numTasks ranges and waits until all of them are finished, calling thread executes the last range.
+// returns number of tasks that is used, numTasks is clamped to count and maximum number of tasks
+int ParallelRange(JobRangeFn fn, void* data, int count, int numTasks);
+
+// runs the job on a worker thread, call WaitJobs before using the data
+void RunJobAsync(JobFn fn, void* data, JobCounter* counter);
+
+// helps the workers with the jobs of this counter until all of them are finished
+void WaitJobs(JobCounter* counter);
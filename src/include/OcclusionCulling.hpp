@@ -0,0 +1,32 @@
+
+#pragma once
+
+#include "../../ASTL/Math/Matrix.hpp"
+
+struct Prefab;
+
+// software occlusion culling: big primitives (occluders) are rasterized on cpu into a small depth buffer
+// then bounds of the other primitives are tested against it before draw gathering.
+// works only on cpu, depth buffer doesn't need any gpu readback.
+
+constexpr int OcclusionWidth  = 256;
+constexpr int OcclusionHeight = 128;
+constexpr int OcclusionTileSize = 8; // hierarchical depth, farthest depth of each 8x8 tile
+
+// clears the depth buffer, call once per frame before rasterizing occluders
+void OcclusionBeginFrame(const Matrix4& viewProjection);
+
+// rasterizes the big primitives of prefab that are visible in prefab->worldBounds.visibility, on worker threads.
+// skinned prefabs are not rasterized, because they are animated on gpu
+void OcclusionRasterizePrefab(Prefab* prefab);
+
+// returns true if the primitive at boundsIndex of prefab->worldBounds is rasterized to the depth buffer this frame,
+// occluders are visible if they passed the frustum test, they shouldn't be tested against their own depth
+bool OcclusionIsOccluder(const Prefab* prefab, int boundsIndex);
+
+// returns true if any part of the bounds may be visible
+bool OcclusionTestAABB(Vector4x32f vmin, Vector4x32f vmax);
+
+bool OcclusionIsEnabled();
+
+void OcclusionEdit();
@@ -184,6 +184,45 @@ void rRenderGeomPoint(int numPoints, int pointOffset = 0); // pointOffset=starti
 
 int GraphicsTypeToSize(GraphicType type);
 
+//------------------------------------------------------------------------
+// Multi Draw Indirect
+// many primitives of one mesh can be drawn with one call. vertex shader reads per draw data with aDrawID attribute (location 6).
+// glMultiDrawElementsIndirect is not in GLES 3.2, use per draw path on android
+
+constexpr int MaxIndirectDraws = 16384;
+
+struct DrawElementsIndirectCommand
+{
+    unsigned int count;
+    unsigned int instanceCount;
+    unsigned int firstIndex;
+    int          baseVertex;
+    unsigned int baseInstance; // used as draw index, aDrawID in vertex shader
+};
+
+struct IndirectBuffer
+{
+    unsigned int commandHandle;  // GL_DRAW_INDIRECT_BUFFER
+    unsigned int drawDataHandle; // shader storage buffer, per draw data (model matrices etc.)
+    int maxDraws;
+    int drawDataStride;
+};
+
+bool rSupportsMultiDrawIndirect();
+
+IndirectBuffer rCreateIndirectBuffer(int maxDraws, int drawDataStride);
+
+void rDeleteIndirectBuffer(IndirectBuffer buffer);
+
+// drawData has numDrawData * drawDataStride bytes, instanced commands can share the draw data (baseInstance + instance)
+void rUploadIndirectBuffer(IndirectBuffer buffer, const DrawElementsIndirectCommand* commands, int numCommands, const void* drawData, int numDrawData);
+
+// adds instanced draw index attribute to the mesh (location 6), baseInstance of the commands becomes aDrawID
+void rMeshEnableDrawID(GPUMesh mesh);
+
+// mesh must be bound, draw data is bound to given shader storage binding
+void rRenderMeshMultiIndirect(GPUMesh mesh, IndirectBuffer buffer, int firstCommand, int numCommands, int drawDataBinding);
+
 /*//////////////////////////////////////////////////////////////////////////*/
 /*                                 Renderer                                 */
 /*//////////////////////////////////////////////////////////////////////////*/
@@ -246,6 +285,9 @@ Vector2i rGetViewportSize();
 
 void rRenderMeshIndexOffset(GPUMesh mesh, int numIndex, int offset);
 
+// gl_InstanceID is in [0, numInstances) in vertex shader
+void rRenderMeshIndexOffsetInstanced(GPUMesh mesh, int numIndex, int offset, int numInstances);
+
 void rInitRenderer();
 
 void rDestroyRenderer();
@@ -301,6 +343,26 @@ void rScissorToggle(bool active);
 
 void rScissor(int x, int y, int width, int height);
 
+//------------------------------------------------------------------------
+// State Cache
+// r* functions are tracking the GL state and skipping the redundant calls
+struct rStateStats
+{
+    int issued;   // calls that are sent to driver
+    int filtered; // redundant calls that are skipped
+};
+
+// disable for debugging, when disabled all of the calls are issued
+void rSetStateCacheEnabled(bool enabled);
+
+bool rIsStateCacheEnabled();
+
+// call at the beginning of each frame
+void rBeginFrameStats();
+
+// counters of the last frame
+rStateStats rGetStateStats();
+
 /*//////////////////////////////////////////////////////////////////////////*/
 /*                                 Texture                                  */
 /*//////////////////////////////////////////////////////////////////////////*/
@@ -338,6 +400,15 @@ Texture rCreateTexture(int width, int height, void* data, TextureType type, TexF
 
 Texture rCreateTexture2DArray(int width, int height, int depth, void* data, TextureType type, TexFlags flags = TexFlags_None);
 
+// allocates numMips levels without data, levels are uploaded with rUploadTextureMip. used for texture streaming
+Texture rCreateMipmappedTexture(int width, int height, int numMips, TextureType type, TexFlags flags = TexFlags_None);
+
+// uploads single mip level, data has to be compressed if the texture is compressed
+void rUploadTextureMip(Texture texture, int mip, const void* data, int dataSize);
+
+// copies numMips levels of src to dst on gpu, mip sizes of the textures has to match
+void rCopyTextureMips(Texture dst, int dstMip, Texture src, int srcMip, int numMips);
+
 Texture rCreateDepthTexture(int width, int height, DepthType depthType);
 
 // Imports texture from disk and loads to GPU
@@ -347,8 +418,15 @@ Texture rImportTexture(const char* path, TexFlags flags = TexFlags_None);
 // for now you can only update with same format and same width and height
 void rUpdateTexture(Texture texture, void* data);
 
+// updates part of the texture, data is tightly packed width x height pixels
+void rUpdateTextureRegion(Texture texture, int x, int y, int width, int height, void* data);
+
 void rDeleteTexture(Texture texture);
 
+// recreates the texture without the first numMipsToRemove mips, used for texture streaming.
+// returns false if texture doesn't have enough mips on gpu, texture stays same in that case.
+bool rTrimTextureMips(Texture* texture, int numMipsToRemove);
+
 void rSetTexture(Texture texture, int index, unsigned int loc);
 
 void rSetTexture(Texture* texture, int index, unsigned int location);
@@ -4,21 +4,50 @@
 #include "../../ASTL/Math/Matrix.hpp"
 #include "Renderer.hpp"
 
+//------------------------------------------------------------------------
+// world space AABBs of all primitives of a prefab, SoA so we can cull 4 boxes at once.
+// updated with Prefab::UpdateWorldBounds after the node transforms change
+struct PrimitiveBounds
+{
+    int numPrimitives;
+    int capacity; // multiple of 4, padding boxes are empty (min > max) so they are always culled
+    float* minX, *minY, *minZ;
+    float* maxX, *maxY, *maxZ;
+    int* nodeIndices;      // node of the primitive
+    int* primitiveIndices; // index in mesh primitives
+    uint64_t* visibility;  // bitset, result of the last culling
+};
+
+// all streams are in one allocation, padding boxes are initialized as empty
+void AllocatePrimitiveBounds(PrimitiveBounds* bounds, int count);
+
+void FreePrimitiveBounds(PrimitiveBounds* bounds);
+
+// transforms local aabb with model matrix and writes to bounds[index]
+void SetPrimitiveBounds(PrimitiveBounds* bounds, int index, Vector4x32f localMin, Vector4x32f localMax, const Matrix4& model);
+
 //------------------------------------------------------------------------
 // prefab is GLTF, FBX or OBJ
 struct Prefab : public SceneBundle 
 {
     Texture* gpuTextures;
+    struct TexturePack* texturePack; // gpuTextures are loaded on demand from this pack
+    xyzw* materialUVRects; // 3 per material: albedo, normal, metallic roughness. xy = scale, zw = offset in texture atlas
     GPUMesh  bigMesh; // contains all of the vertices and indices of an prefab
     Matrix4* globalNodeTransforms; // pre calculated global transforms, accumulated with parents
+    // nodes of the skeleton starting from animation root, sorted so parents always come before their children
+    int* skeletonNodes;
+    int* skeletonParents; // node index of the parent of skeletonNodes[i], -1 for the animation root
+    int numSkeletonNodes;
+    struct BakedAnimations* bakedAnimations; // selected clips sampled with fixed rate, for crowds. null if nothing is baked
+    int numAnimControllers; // pose cache is only used when more than one controller can share the poses
     struct TLAS* tlas;
+    PrimitiveBounds worldBounds;
     int firstTimeRender; // starts with 4 and decreases until its 0 we draw first time and set this to-1
     char path[256]; // relative path
 
-    Texture GetGPUTexture(int index)
-    {
-        return gpuTextures[textures[index].source];
-    }
+    // loads the texture if it is first time used
+    Texture GetGPUTexture(int index);
 
     ANode* GetNodePtr(int index)
     {
@@ -36,8 +65,13 @@ struct Prefab : public SceneBundle
     }
 
     void UpdateGlobalNodeTransforms(int rootNodeIdx, Matrix4 parentMat);
+
+    // transforms local bounds of primitives with globalNodeTransforms and refits the tlas, call after UpdateGlobalNodeTransforms
+    void UpdateWorldBounds();
     
     static int FindAnimRootNodeIndex(Prefab* prefab);
+    // fills skeletonNodes and skeletonParents, breadth first from animation root
+    static void CreateSkeletonHierarchy(Prefab* prefab);
     static int FindNodeFromName(Prefab* prefab, const char* name);
 };
 
@@ -143,7 +177,9 @@ struct Scene
     void RemoveLight(LightId id);
 
     // import GLTF, FBX, or OBJ file into scene
-    int ImportPrefab(PrefabID* prefabID, const char* inPath, float scale);
+    // bakeClips are names of the animations that are baked for crowds, see: BakeAnimations.
+    // clips are baked while creating the abm file, delete the abm after changing them
+    int ImportPrefab(PrefabID* prefabID, const char* inPath, float scale, const char** bakeClips = nullptr, int numBakeClips = 0);
 
     void Update();
 
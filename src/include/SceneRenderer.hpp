@@ -7,6 +7,7 @@ struct LightInstance;
 struct AnimationController;
 struct CameraBase;
 struct Matrix4;
+struct BakedAnimInstance;
 
 namespace SceneRenderer
 {
@@ -20,6 +21,13 @@ namespace SceneRenderer
     // first draw statics then draw dynamics
     void RenderShadowOfPrefab(Scene* scene, unsigned short prefabID, AnimationController* animSystem);
 
+    void RenderShadowOfBakedAnimations(Scene* scene, unsigned short prefabID, const BakedAnimInstance* instances, int numInstances);
+
+    void RenderShadowOfAnimatedInstances(Scene* scene, unsigned short prefabID, AnimationController** controllers, const Matrix4* transforms, int count);
+
+    // shadow of Scene::m_MeshInstances, instances of the same mesh are drawn with instancing
+    void RenderShadowOfSceneContent(Scene* scene);
+
     void EndShadowRendering();
 
 // Rendering
@@ -27,6 +35,17 @@ namespace SceneRenderer
 
     void RenderPrefab(Scene* scene, unsigned short prefabID, AnimationController* animSystem = nullptr);
 
+    // draws Scene::m_MeshInstances, visible instances of the same mesh are drawn with instancing
+    void RenderAllSceneContent(Scene* scene);
+
+    // renders instances of skinned prefab with its baked animations, for crowds that doesn't need AnimationController.
+    // visible instances are drawn with one instanced draw per primitive, each instance has its own clip and time
+    void RenderBakedAnimations(Scene* scene, unsigned short prefabID, const BakedAnimInstance* instances, int numInstances);
+
+    // renders characters that share the animated prefab, each one is evaluated by its own controller (see: EvaluateLocomotionBatch)
+    // and placed with transforms[i]. LOD screen sizes of the controllers are written here
+    void RenderAnimatedInstances(Scene* scene, unsigned short prefabID, AnimationController** controllers, const Matrix4* transforms, int count);
+
     void EndRendering(bool renderToBackBuffer);
 
     void ShowGBuffer();
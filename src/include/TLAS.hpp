@@ -16,7 +16,7 @@ struct alignas(16) BVHInstance // Tri
     uint bvhIndex;
 	uint nodeIndex;
     uint primitiveIndex; // returns which primitive of the node
-    uint padd2;
+    uint boundsIndex;    // index in prefab->worldBounds
 };
 
 struct BVHInstanceGPU
@@ -43,6 +43,15 @@ struct TLAS
 
     void TraverseBVH(const Ray& ray, uint rootNode, Triout* out);
 
+    // updates instance bounds from prefab->worldBounds and node bounds bottom up, without rebuilding the tree.
+    // for animated prefabs, call after Prefab::UpdateWorldBounds
+    void Refit();
+
+    // hierarchical frustum culling, rejects whole subtrees, if node is completely inside of a plane
+    // the plane is not tested for the children. sets the bits of visible instances in visibility (indexed with boundsIndex)
+    // planes doesn't have to be normalized. returns number of visible instances
+    int CullFrustum(const float planes[][4], int numPlanes, uint64_t* visibility);
+
 private:
 
     void UpdateNodeBounds(uint nodeIdx, Vector4x32f* centeroidMinOut, Vector4x32f* centeroidMaxOut);